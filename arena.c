@@ -0,0 +1,60 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+// enough for any of the structs that go in here, including uint64_t and pointers
+#define ARENA_ALIGN 16
+// one chunk fits a typical offer: a few dozen mimes plus the capture metadata
+#define ARENA_CHUNK_SIZE 4096
+
+// across every arena, for the stats dump
+static size_t live_bytes;
+static size_t peak_bytes;
+
+void arena_init(struct arena *arena) {
+    arena->chunks = NULL;
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct arena_chunk *chunk = arena->chunks;
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        size_t chunk_size = (size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE) + ARENA_ALIGN;
+        chunk = malloc(sizeof *chunk + chunk_size);
+        live_bytes += sizeof *chunk + chunk_size;
+        if (live_bytes > peak_bytes) peak_bytes = live_bytes;
+        chunk->next = arena->chunks;
+        chunk->size = chunk_size;
+        // data sits right after the header, which isn't necessarily aligned
+        chunk->used = (ARENA_ALIGN - (uintptr_t)chunk->data % ARENA_ALIGN) % ARENA_ALIGN;
+        arena->chunks = chunk;
+    }
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+char *arena_strdup(struct arena *arena, const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(arena, len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+void arena_free(struct arena *arena) {
+    struct arena_chunk *chunk = arena->chunks;
+    while (chunk != NULL) {
+        struct arena_chunk *next = chunk->next;
+        live_bytes -= sizeof *chunk + chunk->size;
+        free(chunk);
+        chunk = next;
+    }
+    arena->chunks = NULL;
+}
+
+void arena_usage(size_t *live, size_t *peak) {
+    *live = live_bytes;
+    *peak = peak_bytes;
+}
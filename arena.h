@@ -0,0 +1,25 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+// bump allocator; everything in it is released at once by arena_free
+struct arena {
+    struct arena_chunk *chunks;
+};
+
+void arena_init(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *str);
+void arena_free(struct arena *arena);
+// chunk bytes held by all arenas right now and at most so far
+void arena_usage(size_t *live, size_t *peak);
+
+#endif
@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mime_matcher.h"
+#include "pref_parse.h"
+#include "read_config.h"
+
+// libFuzzer target for parse_mime_prefs, see make fuzz-prefs. an input is the config text, optionally
+// followed by a NUL and the offered mimes one per line; it's parsed, then both matchers have to pick
+// the same mimes. besides crashes and ASan reports, an input aborts when it takes longer or allocates
+// more than these allow for its length, whatever its regexes are
+#define SLOW_NS (20 * 1000000ull)
+#define SLOW_NS_PER_BYTE (50 * 1000ull)
+#define ALLOCS 256
+#define ALLOCS_PER_BYTE 32
+#define PEAK_BYTES (1024 * 1024)
+#define PEAK_BYTES_PER_BYTE (64 * 1024)
+#define MAX_OFFERED 64
+
+// from ASan, which both the libFuzzer and replay builds link
+void __sanitizer_install_malloc_and_free_hooks(void (*malloc_hook)(const volatile void *, size_t),
+        void (*free_hook)(const volatile void *));
+size_t __sanitizer_get_allocated_size(const volatile void *ptr);
+
+uint64_t n_allocs;
+uint64_t live_bytes;
+uint64_t peak_bytes;
+
+void count_malloc(const volatile void *ptr, size_t size) {
+    (void) ptr;
+    n_allocs++;
+    live_bytes += size;
+    if (live_bytes > peak_bytes) peak_bytes = live_bytes;
+}
+
+void count_free(const volatile void *ptr) {
+    // hooks are installed after startup, so this may free what was never counted
+    size_t size = __sanitizer_get_allocated_size(ptr);
+    live_bytes = size > live_bytes ? 0 : live_bytes - size;
+}
+
+char *default_offered[] = {"text/html", "text/_moz_htmlcontext", "UTF8_STRING", "TEXT", "STRING",
+    "text/plain;charset=utf-8", "text/plain", "image/png", "image/jpeg", "text/uri-list",
+    "x-special/gnome-copied-files"};
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void check_selection(struct mime_pref *pref, char **mimes, uint32_t n_mimes) {
+    struct zzz_list *offered = NULL;
+    for (uint32_t i = n_mimes; i > 0; i--) {
+        zzz_list_prepend(&offered, mimes[i - 1]);
+    }
+    struct mime_matcher matcher;
+    mime_matcher_build(pref, &matcher);
+    struct zzz_list *expected = matching_mimes(*pref, offered);
+    // the second match comes from the matcher's cache
+    for (int round = 0; round < 2; round++) {
+        uint32_t n_selected;
+        uint64_t *max_bytes;
+        uint32_t *selected = mime_matcher_match(&matcher, mimes, n_mimes, &n_selected, &max_bytes);
+        struct zzz_list *curr = expected;
+        for (uint32_t k = 0; k < n_selected; k++, curr = curr->next) {
+            if (curr == NULL || curr->value != mimes[selected[k]]) {
+                fputs("mime_matcher and matching_mimes disagree\n", stderr);
+                abort();
+            }
+        }
+        if (curr != NULL) {
+            fputs("mime_matcher selected fewer mimes than matching_mimes\n", stderr);
+            abort();
+        }
+    }
+    zzz_list_free(expected, NULL);
+    zzz_list_free(offered, NULL);
+    mime_matcher_free(&matcher);
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+    (void) argc;
+    (void) argv;
+    __sanitizer_install_malloc_and_free_hooks(&count_malloc, &count_free);
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    char *text = malloc(size + 1);
+    memcpy(text, data, size);
+    text[size] = '\0';
+    size_t text_len = strlen(text);
+
+    char *offered_buf = NULL;
+    char *offered[MAX_OFFERED];
+    uint32_t n_offered = 0;
+    if (text_len < size) {
+        offered_buf = text + text_len + 1;
+        for (char *line = strtok(offered_buf, "\n"); line != NULL && n_offered < MAX_OFFERED;
+                line = strtok(NULL, "\n")) {
+            offered[n_offered++] = line;
+        }
+    }
+
+    uint64_t allocs_before = n_allocs;
+    peak_bytes = live_bytes;
+    uint64_t bytes_before = live_bytes;
+    uint64_t start = now_ns();
+    struct mime_pref pref;
+    uint64_t budget;
+    if (parse_mime_prefs(text, &pref, &budget, NULL)) {
+        if (n_offered > 0) {
+            check_selection(&pref, offered, n_offered);
+        } else {
+            check_selection(&pref, default_offered, sizeof default_offered / sizeof *default_offered);
+        }
+        free_pref_contents(&pref);
+    }
+    uint64_t elapsed = now_ns() - start;
+    uint64_t allocs = n_allocs - allocs_before;
+    uint64_t peak = peak_bytes - bytes_before;
+    free(text);
+
+    if (elapsed > SLOW_NS + SLOW_NS_PER_BYTE * size) {
+        fprintf(stderr, "%zu byte input took %llu ms\n", size, (unsigned long long)(elapsed / 1000000));
+        abort();
+    }
+    if (allocs > ALLOCS + ALLOCS_PER_BYTE * size) {
+        fprintf(stderr, "%zu byte input made %llu allocations\n", size, (unsigned long long)allocs);
+        abort();
+    }
+    if (peak > PEAK_BYTES + PEAK_BYTES_PER_BYTE * size) {
+        fprintf(stderr, "%zu byte input peaked at %llu bytes allocated\n", size, (unsigned long long)peak);
+        abort();
+    }
+    return 0;
+}
+
+#ifdef FUZZ_PREFS_REPLAY
+// runs saved inputs, a crash or corpus directory's files, through the same checks without libFuzzer
+int main(int argc, char *argv[]) {
+    LLVMFuzzerInitialize(&argc, &argv);
+    for (int i = 1; i < argc; i++) {
+        FILE *file = fopen(argv[i], "rb");
+        if (file == NULL) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+        char *data = NULL;
+        size_t size = 0;
+        size_t cap = 0;
+        size_t n;
+        do {
+            if (size == cap) {
+                cap = cap == 0 ? 4096 : cap * 2;
+                data = realloc(data, cap);
+            }
+            n = fread(data + size, 1, cap - size, file);
+            size += n;
+        } while (n > 0);
+        fclose(file);
+        LLVMFuzzerTestOneInput((uint8_t *)data, size);
+        free(data);
+    }
+    return EXIT_SUCCESS;
+}
+#endif
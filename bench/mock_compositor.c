@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mock_compositor.h"
+#include "wlr-data-control-server-protocol.h"
+
+struct mock_device {
+    struct wl_resource *resource;
+    struct mock_seat *seat;
+    struct wl_list link;
+};
+
+struct mock_source *mock_source_new(struct wl_resource *resource) {
+    struct mock_source *source = malloc(sizeof *source);
+    *source = (struct mock_source) {
+        .refs = 1,
+        .resource = resource,
+        .mimes = NULL,
+        .n_mimes = 0,
+        .mimes_capacity = 0,
+        .receive = NULL,
+        .data = NULL,
+        .id = 0,
+    };
+    return source;
+}
+
+struct mock_source *mock_source_ref(struct mock_source *source) {
+    source->refs++;
+    return source;
+}
+
+void mock_source_unref(struct mock_source *source) {
+    if (--source->refs > 0) return;
+    for (uint32_t i = 0; i < source->n_mimes; i++) {
+        free(source->mimes[i]);
+    }
+    free(source->mimes);
+    free(source);
+}
+
+void mock_source_add_mime(struct mock_source *source, const char *mime) {
+    if (source->n_mimes == source->mimes_capacity) {
+        source->mimes_capacity = source->mimes_capacity == 0 ? 8 : source->mimes_capacity * 2;
+        source->mimes = realloc(source->mimes, source->mimes_capacity * sizeof *source->mimes);
+    }
+    source->mimes[source->n_mimes++] = strdup(mime);
+}
+
+void mock_source_send(struct mock_source *source, const char *mime, int fd) {
+    if (source->receive != NULL) {
+        source->receive(source, mime, fd);
+        return;
+    }
+    // the event carries a dup of fd
+    if (source->resource != NULL) {
+        zwlr_data_control_source_v1_send_send(source->resource, mime, fd);
+    }
+    close(fd);
+}
+
+void offer_receive(struct wl_client *client, struct wl_resource *resource, const char *mime_type, int32_t fd) {
+    (void) client;
+    mock_source_send(wl_resource_get_user_data(resource), mime_type, fd);
+}
+
+void destroy_request(struct wl_client *client, struct wl_resource *resource) {
+    (void) client;
+    wl_resource_destroy(resource);
+}
+
+void offer_destroyed(struct wl_resource *resource) {
+    mock_source_unref(wl_resource_get_user_data(resource));
+}
+
+struct zwlr_data_control_offer_v1_interface offer_impl = {
+    .receive = &offer_receive,
+    .destroy = &destroy_request,
+};
+
+void source_offer(struct wl_client *client, struct wl_resource *resource, const char *mime_type) {
+    (void) client;
+    mock_source_add_mime(wl_resource_get_user_data(resource), mime_type);
+}
+
+void source_destroyed(struct wl_resource *resource) {
+    struct mock_source *source = wl_resource_get_user_data(resource);
+    // offers outliving it just close the fds they are given
+    source->resource = NULL;
+    mock_source_unref(source);
+}
+
+struct zwlr_data_control_source_v1_interface source_impl = {
+    .offer = &source_offer,
+    .destroy = &destroy_request,
+};
+
+// data_offer, the offer's mimes, then selection or primary_selection, like a real compositor
+void device_send_offer(struct mock_device *device, struct mock_source *source, bool primary) {
+    if (source == NULL) {
+        if (primary) {
+            zwlr_data_control_device_v1_send_primary_selection(device->resource, NULL);
+        } else {
+            zwlr_data_control_device_v1_send_selection(device->resource, NULL);
+        }
+        return;
+    }
+    struct wl_client *client = wl_resource_get_client(device->resource);
+    struct wl_resource *offer = wl_resource_create(client, &zwlr_data_control_offer_v1_interface, 1, 0);
+    if (offer == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(offer, &offer_impl, mock_source_ref(source), &offer_destroyed);
+    zwlr_data_control_device_v1_send_data_offer(device->resource, offer);
+    for (uint32_t i = 0; i < source->n_mimes; i++) {
+        zwlr_data_control_offer_v1_send_offer(offer, source->mimes[i]);
+    }
+    if (primary) {
+        zwlr_data_control_device_v1_send_primary_selection(device->resource, offer);
+    } else {
+        zwlr_data_control_device_v1_send_selection(device->resource, offer);
+    }
+}
+
+void mock_compositor_set_selection(struct mock_compositor *compositor, uint32_t seat, struct mock_source *source) {
+    struct mock_seat *mock_seat = &compositor->seats[seat];
+    struct mock_source *old = mock_seat->selection;
+    mock_seat->selection = source;
+    if (old != NULL) {
+        if (old != source && old->resource != NULL) {
+            zwlr_data_control_source_v1_send_cancelled(old->resource);
+        }
+        mock_source_unref(old);
+    }
+
+    struct mock_device *device;
+    wl_list_for_each(device, &compositor->devices, link) {
+        if (device->seat == mock_seat) device_send_offer(device, source, false);
+    }
+
+    if (compositor->selection_set != NULL) {
+        struct wl_client *client = source != NULL && source->resource != NULL
+            ? wl_resource_get_client(source->resource)
+            : NULL;
+        compositor->selection_set(compositor, seat, client, source);
+    }
+}
+
+void mock_compositor_set_primary_selection(struct mock_compositor *compositor, uint32_t seat,
+        struct mock_source *source) {
+    struct mock_seat *mock_seat = &compositor->seats[seat];
+    struct mock_source *old = mock_seat->primary_selection;
+    mock_seat->primary_selection = source;
+    if (old != NULL) {
+        if (old != source && old->resource != NULL) {
+            zwlr_data_control_source_v1_send_cancelled(old->resource);
+        }
+        mock_source_unref(old);
+    }
+
+    struct mock_device *device;
+    wl_list_for_each(device, &compositor->devices, link) {
+        if (device->seat == mock_seat) device_send_offer(device, source, true);
+    }
+}
+
+void device_set_selection(struct wl_client *client, struct wl_resource *resource, struct wl_resource *source) {
+    (void) client;
+    struct mock_device *device = wl_resource_get_user_data(resource);
+    struct mock_source *mock_source = source != NULL ? wl_resource_get_user_data(source) : NULL;
+    mock_compositor_set_selection(device->seat->compositor, device->seat->index,
+            mock_source != NULL ? mock_source_ref(mock_source) : NULL);
+}
+
+void device_set_primary_selection(struct wl_client *client, struct wl_resource *resource, struct wl_resource *source) {
+    (void) client;
+    struct mock_device *device = wl_resource_get_user_data(resource);
+    struct mock_source *mock_source = source != NULL ? wl_resource_get_user_data(source) : NULL;
+    mock_compositor_set_primary_selection(device->seat->compositor, device->seat->index,
+            mock_source != NULL ? mock_source_ref(mock_source) : NULL);
+}
+
+struct zwlr_data_control_device_v1_interface device_impl = {
+    .set_selection = &device_set_selection,
+    .destroy = &destroy_request,
+    .set_primary_selection = &device_set_primary_selection,
+};
+
+void device_destroyed(struct wl_resource *resource) {
+    struct mock_device *device = wl_resource_get_user_data(resource);
+    wl_list_remove(&device->link);
+    free(device);
+}
+
+void manager_create_data_source(struct wl_client *client, struct wl_resource *resource, uint32_t id) {
+    struct wl_resource *source = wl_resource_create(client, &zwlr_data_control_source_v1_interface,
+            wl_resource_get_version(resource), id);
+    if (source == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(source, &source_impl, mock_source_new(source), &source_destroyed);
+}
+
+void manager_get_data_device(struct wl_client *client, struct wl_resource *resource, uint32_t id, struct wl_resource *seat) {
+    struct mock_compositor *compositor = wl_resource_get_user_data(resource);
+    struct wl_resource *device_resource = wl_resource_create(client, &zwlr_data_control_device_v1_interface,
+            wl_resource_get_version(resource), id);
+    if (device_resource == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    struct mock_device *device = malloc(sizeof *device);
+    device->resource = device_resource;
+    device->seat = wl_resource_get_user_data(seat);
+    wl_list_insert(&compositor->devices, &device->link);
+    wl_resource_set_implementation(device_resource, &device_impl, device, &device_destroyed);
+
+    // a new device is told about the current selections right away
+    device_send_offer(device, device->seat->selection, false);
+    device_send_offer(device, device->seat->primary_selection, true);
+    if (compositor->device_bound != NULL) {
+        compositor->device_bound(compositor, client);
+    }
+}
+
+struct zwlr_data_control_manager_v1_interface manager_impl = {
+    .create_data_source = &manager_create_data_source,
+    .get_data_device = &manager_get_data_device,
+    .destroy = &destroy_request,
+};
+
+void bind_manager(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+    struct wl_resource *resource = wl_resource_create(client, &zwlr_data_control_manager_v1_interface, version, id);
+    if (resource == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(resource, &manager_impl, data, NULL);
+}
+
+void seat_get_device(struct wl_client *client, struct wl_resource *resource, uint32_t id) {
+    // neither zzz nor zzz_get ask for input devices
+    (void) client;
+    (void) resource;
+    (void) id;
+}
+
+struct wl_seat_interface seat_impl = {
+    .get_pointer = &seat_get_device,
+    .get_keyboard = &seat_get_device,
+    .get_touch = &seat_get_device,
+};
+
+void bind_seat(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+    struct wl_resource *resource = wl_resource_create(client, &wl_seat_interface, version, id);
+    if (resource == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(resource, &seat_impl, data, NULL);
+    wl_seat_send_capabilities(resource, 0);
+    if (version >= 2) {
+        struct mock_seat *seat = data;
+        char name[16];
+        snprintf(name, sizeof name, "seat%u", seat->index);
+        wl_seat_send_name(resource, name);
+    }
+}
+
+bool mock_compositor_init(struct mock_compositor *compositor, uint32_t n_seats) {
+    *compositor = (struct mock_compositor) {0};
+    compositor->n_seats = n_seats;
+    wl_list_init(&compositor->devices);
+    compositor->display = wl_display_create();
+    if (compositor->display == NULL) {
+        fputs("failed to create display\n", stderr);
+        return false;
+    }
+    compositor->loop = wl_display_get_event_loop(compositor->display);
+    compositor->socket = wl_display_add_socket_auto(compositor->display);
+    if (compositor->socket == NULL) {
+        fputs("failed to add wayland socket\n", stderr);
+        wl_display_destroy(compositor->display);
+        return false;
+    }
+    bool created = true;
+    for (uint32_t i = 0; i < n_seats; i++) {
+        compositor->seats[i] = (struct mock_seat) {
+            .compositor = compositor,
+            .index = i,
+        };
+        created = created
+            && wl_global_create(compositor->display, &wl_seat_interface, 2, &compositor->seats[i], &bind_seat) != NULL;
+    }
+    if (!created || wl_global_create(compositor->display, &zwlr_data_control_manager_v1_interface, 2, compositor,
+                &bind_manager) == NULL) {
+        fputs("failed to create globals\n", stderr);
+        wl_display_destroy(compositor->display);
+        return false;
+    }
+    return true;
+}
+
+void mock_compositor_finish(struct mock_compositor *compositor) {
+    // frees devices, client sources and offers through their destroy handlers
+    wl_display_destroy_clients(compositor->display);
+    for (uint32_t i = 0; i < compositor->n_seats; i++) {
+        struct mock_seat *seat = &compositor->seats[i];
+        if (seat->selection != NULL) mock_source_unref(seat->selection);
+        if (seat->primary_selection != NULL) mock_source_unref(seat->primary_selection);
+        *seat = (struct mock_seat) {0};
+    }
+    wl_display_destroy(compositor->display);
+}
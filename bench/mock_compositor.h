@@ -0,0 +1,69 @@
+#ifndef MOCK_COMPOSITOR_H
+#define MOCK_COMPOSITOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-server.h>
+
+// a selection, either set by a client or made up by the benchmark itself
+struct mock_source {
+    unsigned refs;
+    // NULL for synthetic sources, and once the client has destroyed its source
+    struct wl_resource *resource;
+    char **mimes;
+    uint32_t n_mimes;
+    uint32_t mimes_capacity;
+    // synthetic sources are asked for data through this instead of a send event; takes fd
+    void (*receive)(struct mock_source *source, const char *mime, int fd);
+    void *data;
+    // caller defined, e.g. the copy number
+    uint64_t id;
+};
+
+#define MOCK_MAX_SEATS 4
+
+struct mock_compositor;
+
+// each seat has its own selections, named seat0, seat1, ...
+struct mock_seat {
+    struct mock_compositor *compositor;
+    uint32_t index;
+    struct mock_source *selection;
+    struct mock_source *primary_selection;
+};
+
+// just enough of a compositor for wlr-data-control clients: seats and the data control manager
+struct mock_compositor {
+    struct wl_display *display;
+    struct wl_event_loop *loop;
+    // for WAYLAND_DISPLAY
+    const char *socket;
+    // of struct mock_device
+    struct wl_list devices;
+    struct mock_seat seats[MOCK_MAX_SEATS];
+    uint32_t n_seats;
+    // called once a client has a data device
+    void (*device_bound)(struct mock_compositor *compositor, struct wl_client *client);
+    // called after every selection change; client is NULL for synthetic sources and clears
+    void (*selection_set)(struct mock_compositor *compositor, uint32_t seat, struct wl_client *client,
+            struct mock_source *source);
+    void *data;
+};
+
+// n_seats up to MOCK_MAX_SEATS
+bool mock_compositor_init(struct mock_compositor *compositor, uint32_t n_seats);
+void mock_compositor_finish(struct mock_compositor *compositor);
+// takes over the caller's reference to source, which may be NULL to clear the selection
+void mock_compositor_set_selection(struct mock_compositor *compositor, uint32_t seat, struct mock_source *source);
+// same for the primary selection, which the selection_set callback doesn't hear about
+void mock_compositor_set_primary_selection(struct mock_compositor *compositor, uint32_t seat,
+        struct mock_source *source);
+
+struct mock_source *mock_source_new(struct wl_resource *resource);
+struct mock_source *mock_source_ref(struct mock_source *source);
+void mock_source_unref(struct mock_source *source);
+void mock_source_add_mime(struct mock_source *source, const char *mime);
+// asks whoever is behind the source to write mime to fd; takes ownership of fd
+void mock_source_send(struct mock_source *source, const char *mime, int fd);
+
+#endif
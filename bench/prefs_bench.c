@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mime_matcher.h"
+#include "pref_parse.h"
+#include "read_config.h"
+
+// distinct offered lists cycled through to measure the matcher missing its cache
+#define MISS_VARIANTS (2 * MATCHER_CACHE_SIZE)
+#define DEEP_LEVELS PREF_MAX_DEPTH
+#define WIDE_LEAVES 512
+
+// every allocation in the process goes through these, pcre2's included; glibc only
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+uint64_t n_allocs;
+uint64_t alloc_bytes;
+
+void *malloc(size_t size) {
+    n_allocs++;
+    alloc_bytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    n_allocs++;
+    alloc_bytes += n * size;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    n_allocs++;
+    alloc_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+struct config {
+    const char *name;
+    char *text;
+};
+
+// what apps offer for one copy, as seen through wlr-data-control
+struct offer {
+    const char *name;
+    const char *mimes[24];
+};
+
+struct offer offers[] = {
+    {"firefox-text", {"text/html", "text/_moz_htmlcontext", "text/_moz_htmlinfo", "UTF8_STRING", "COMPOUND_TEXT",
+        "TEXT", "STRING", "text/plain;charset=utf-8", "text/plain", "text/x-moz-url-priv"}},
+    {"chromium-image", {"image/png", "text/html", "chromium/x-internal-source-rfh-token"}},
+    {"chromium-text", {"text/html", "text/plain;charset=utf-8", "text/plain", "STRING", "TEXT", "UTF8_STRING",
+        "chromium/x-internal-source-rfh-token"}},
+    {"gtk-text", {"GTK_TEXT_BUFFER_CONTENTS", "application/x-gtk-text-buffer-rich-text", "UTF8_STRING",
+        "COMPOUND_TEXT", "TEXT", "STRING", "text/plain;charset=utf-8", "text/plain"}},
+    {"libreoffice", {"application/x-openoffice-embed-source-xml;windows_formatname=\"Star Embed Source (XML)\"",
+        "text/rtf", "text/richtext", "text/html", "text/plain;charset=utf-16",
+        "application/x-openoffice-objectdescriptor-xml;windows_formatname=\"Star Object Descriptor (XML)\"",
+        "application/x-openoffice-link;windows_formatname=\"Link\"", "text/plain;charset=utf-8", "UTF8_STRING",
+        "STRING", "TEXT", "image/png", "image/bmp"}},
+    {"gimp", {"image/png", "image/bmp", "image/x-bmp", "image/x-MS-bmp", "image/jpeg", "image/tiff",
+        "image/x-icon", "image/x-ico", "image/x-win-bitmap", "image/vnd.microsoft.icon", "image/webp",
+        "image/avif", "image/x-portable-pixmap", "image/x-xpixmap", "image/x-tga", "application/x-qt-image"}},
+    {"dolphin-files", {"text/uri-list", "x-special/gnome-copied-files", "application/x-kde4-urilist",
+        "application/x-kde-cutselection", "text/plain", "text/plain;charset=utf-8", "UTF8_STRING", "STRING",
+        "TEXT"}},
+    {"foot", {"text/plain;charset=utf-8", "text/plain", "UTF8_STRING", "TEXT", "STRING"}},
+    {"vscode", {"text/plain", "text/plain;charset=utf-8", "STRING", "TEXT", "UTF8_STRING", "vscode-editor-data",
+        "application/vnd.code.copymetadata", "text/html"}},
+};
+
+#define N_OFFERS (sizeof offers / sizeof *offers)
+
+uint32_t offer_len(struct offer *offer) {
+    uint32_t n = 0;
+    while (offer->mimes[n] != NULL) n++;
+    return n;
+}
+
+char *deep_config(uint32_t levels) {
+    size_t cap = levels * 64 + 1;
+    char *text = malloc(cap);
+    size_t len = 0;
+    for (uint32_t i = 0; i < levels; i++) {
+        len += snprintf(text + len, cap - len, "%c application/x-deep-%u ", i % 2 == 0 ? '[' : '(', i);
+    }
+    len += snprintf(text + len, cap - len, "text/plain;charset=utf-8 ");
+    for (uint32_t i = levels; i > 0; i--) {
+        len += snprintf(text + len, cap - len, "image/x-deep-%u%c ", i - 1, (i - 1) % 2 == 0 ? ']' : ')');
+    }
+    return text;
+}
+
+char *wide_config(uint32_t leaves) {
+    size_t cap = leaves * 32 + 64;
+    char *text = malloc(cap);
+    size_t len = snprintf(text, cap, "(");
+    for (uint32_t i = 0; i < leaves; i++) {
+        len += snprintf(text + len, cap - len, "application/x-wide-%u ", i);
+    }
+    snprintf(text + len, cap - len, "text/plain)");
+    return text;
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// per call, from batches doubled until one takes target_ns
+struct timing {
+    double ns;
+    double allocs;
+    double bytes;
+};
+
+typedef void bench_func(void *data, uint64_t i);
+
+struct timing measure(bench_func *func, void *data, uint64_t target_ns) {
+    uint64_t iterations = 1;
+    while (true) {
+        uint64_t allocs_before = n_allocs;
+        uint64_t bytes_before = alloc_bytes;
+        uint64_t start = now_ns();
+        for (uint64_t i = 0; i < iterations; i++) {
+            func(data, i);
+        }
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed >= target_ns || iterations >= (1ull << 30)) {
+            return (struct timing) {
+                .ns = (double)elapsed / iterations,
+                .allocs = (double)(n_allocs - allocs_before) / iterations,
+                .bytes = (double)(alloc_bytes - bytes_before) / iterations,
+            };
+        }
+        iterations *= 2;
+    }
+}
+
+struct parse_data {
+    char *text;
+    // pcre2_serialize_encode output, NULL to compile every regex
+    uint8_t *serialized;
+    uint32_t n_codes;
+};
+
+void bench_parse(void *data, uint64_t i) {
+    (void) i;
+    struct parse_data *parse = data;
+    struct mime_pref pref;
+    uint64_t budget;
+    struct pattern_cache patterns = {0};
+    if (parse->serialized != NULL) {
+        patterns.codes = malloc(parse->n_codes * sizeof *patterns.codes);
+        patterns.n_codes = pcre2_serialize_decode(patterns.codes, parse->n_codes, parse->serialized, NULL);
+    }
+    if (parse_mime_prefs(parse->text, &pref, &budget, parse->serialized != NULL ? &patterns : NULL)) {
+        free_pref_contents(&pref);
+    }
+    for (uint32_t k = patterns.taken; k < patterns.n_codes; k++) {
+        pcre2_code_free(patterns.codes[k]);
+    }
+    free(patterns.codes);
+}
+
+uint32_t collect_codes(struct mime_pref *pref, const pcre2_code **codes, uint32_t n_codes) {
+    if (pref->type == SINGLE_MIME) {
+        if (codes != NULL) codes[n_codes] = pref->inner.regex.code;
+        return n_codes + 1;
+    }
+    for (struct zzz_list *curr = pref->inner.subprefs; curr != NULL; curr = curr->next) {
+        n_codes = collect_codes(curr->value, codes, n_codes);
+    }
+    return n_codes;
+}
+
+struct match_data {
+    struct mime_pref *pref;
+    struct mime_matcher *matcher;
+    struct zzz_list *list;
+    char **mimes;
+    uint32_t n_mimes;
+    // MISS_VARIANTS offered lists, each one mime longer than mimes
+    char ***variants;
+};
+
+void bench_reference(void *data, uint64_t i) {
+    (void) i;
+    struct match_data *match = data;
+    zzz_list_free(matching_mimes(*match->pref, match->list), NULL);
+}
+
+void bench_matcher(void *data, uint64_t i) {
+    (void) i;
+    struct match_data *match = data;
+    uint32_t n_selected;
+    uint64_t *max_bytes;
+    mime_matcher_match(match->matcher, match->mimes, match->n_mimes, &n_selected, &max_bytes);
+}
+
+void bench_matcher_miss(void *data, uint64_t i) {
+    struct match_data *match = data;
+    uint32_t n_selected;
+    uint64_t *max_bytes;
+    mime_matcher_match(match->matcher, match->variants[i % MISS_VARIANTS], match->n_mimes + 1, &n_selected,
+            &max_bytes);
+}
+
+// the matcher has to pick exactly what matching_mimes does, in the same order
+bool same_selection(struct match_data *match) {
+    struct zzz_list *expected = matching_mimes(*match->pref, match->list);
+    uint32_t n_selected;
+    uint64_t *max_bytes;
+    uint32_t *selected = mime_matcher_match(match->matcher, match->mimes, match->n_mimes, &n_selected, &max_bytes);
+    bool same = true;
+    struct zzz_list *curr = expected;
+    for (uint32_t k = 0; k < n_selected && same; k++, curr = curr->next) {
+        same = curr != NULL && curr->value == match->mimes[selected[k]];
+    }
+    same = same && (n_selected == 0 ? expected == NULL : curr == NULL);
+    zzz_list_free(expected, NULL);
+    return same;
+}
+
+int main(int argc, char *argv[]) {
+    char *help =
+        "usage: prefs_bench [options]\n"
+        "  -h          print this help message\n"
+        "  -t MS       time spent on each measurement (default 200)\n"
+        "parses configs from the default one to %u levels deep and %u alternatives wide, then matches\n"
+        "each against what real apps offer: matching_mimes, and mime_matcher hitting and missing its cache\n";
+    uint64_t target_ns = 200 * 1000000ull;
+    int c;
+    while ((c = getopt(argc, argv, "ht:")) != -1) {
+        switch (c) {
+            case 'h':
+                printf(help, DEEP_LEVELS, WIDE_LEAVES);
+                return EXIT_SUCCESS;
+            case 't':
+                target_ns = strtoull(optarg, NULL, 10) * 1000000ull;
+                break;
+            default:
+                fprintf(stderr, help, DEEP_LEVELS, WIDE_LEAVES);
+                return EXIT_FAILURE;
+        }
+    }
+
+    struct config configs[] = {
+        {"default", strdup("[(image/png image/jpeg image/.*)(UTF8_STRING text/plain;charset=utf8 TEXT text/plain)]")},
+        {"typical", strdup("budget 64M\n"
+                "[(image/png<16M image/jpeg<16M image/.*<16M)\n"
+                " (text/uri-list x-special/gnome-copied-files)\n"
+                " (text/html<1M)\n"
+                " (UTF8_STRING text/plain;charset=utf-8 text/plain TEXT STRING)\n"
+                " application/x-openoffice.*<4M]\n")},
+        {"deep", deep_config(DEEP_LEVELS)},
+        {"wide", wide_config(WIDE_LEAVES)},
+    };
+    uint32_t n_configs = sizeof configs / sizeof *configs;
+    bool ok = true;
+
+    printf("%-24s %12s %12s %12s\n", "parse", "ns/call", "allocs/call", "bytes/call");
+    for (uint32_t i = 0; i < n_configs; i++) {
+        struct parse_data parse = {.text = configs[i].text, .serialized = NULL};
+        struct timing compiled = measure(&bench_parse, &parse, target_ns);
+        printf("  %-22s %12.0f %12.1f %12.0f\n", configs[i].name, compiled.ns, compiled.allocs, compiled.bytes);
+
+        // what startup does with an unchanged config, minus reading the cache file
+        struct mime_pref pref;
+        uint64_t budget;
+        if (!parse_mime_prefs(configs[i].text, &pref, &budget, NULL)) {
+            fprintf(stderr, "%s config doesn't parse\n", configs[i].name);
+            return EXIT_FAILURE;
+        }
+        parse.n_codes = collect_codes(&pref, NULL, 0);
+        const pcre2_code **codes = malloc(parse.n_codes * sizeof *codes);
+        collect_codes(&pref, codes, 0);
+        PCRE2_SIZE size;
+        pcre2_serialize_encode(codes, parse.n_codes, &parse.serialized, &size, NULL);
+        free(codes);
+        free_pref_contents(&pref);
+        struct timing cached = measure(&bench_parse, &parse, target_ns);
+        char name[64];
+        snprintf(name, sizeof name, "%s, cached", configs[i].name);
+        printf("  %-22s %12.0f %12.1f %12.0f\n", name, cached.ns, cached.allocs, cached.bytes);
+        pcre2_serialize_free(parse.serialized);
+    }
+
+    printf("\n%-24s %12s %12s %12s %12s\n", "match ns/call", "reference", "matcher", "miss", "build");
+    for (uint32_t i = 0; i < n_configs; i++) {
+        struct mime_pref pref;
+        uint64_t budget;
+        parse_mime_prefs(configs[i].text, &pref, &budget, NULL);
+        for (uint32_t j = 0; j < N_OFFERS; j++) {
+            struct mime_matcher matcher;
+            uint64_t build_start = now_ns();
+            mime_matcher_build(&pref, &matcher);
+            uint64_t build_ns = now_ns() - build_start;
+            struct match_data match = {
+                .pref = &pref,
+                .matcher = &matcher,
+                .list = NULL,
+                .mimes = (char **)offers[j].mimes,
+                .n_mimes = offer_len(&offers[j]),
+            };
+            for (uint32_t k = match.n_mimes; k > 0; k--) {
+                zzz_list_prepend(&match.list, match.mimes[k - 1]);
+            }
+            match.variants = malloc(MISS_VARIANTS * sizeof *match.variants);
+            for (uint32_t v = 0; v < MISS_VARIANTS; v++) {
+                match.variants[v] = malloc((match.n_mimes + 1) * sizeof **match.variants);
+                memcpy(match.variants[v], match.mimes, match.n_mimes * sizeof *match.mimes);
+                if (asprintf(&match.variants[v][match.n_mimes], "application/x-bench-%u", v) < 0) return EXIT_FAILURE;
+            }
+            if (!same_selection(&match)) {
+                fprintf(stderr, "%s x %s: mime_matcher and matching_mimes disagree\n", configs[i].name,
+                        offers[j].name);
+                ok = false;
+            }
+            struct timing reference = measure(&bench_reference, &match, target_ns);
+            struct timing hit = measure(&bench_matcher, &match, target_ns);
+            struct timing miss = measure(&bench_matcher_miss, &match, target_ns);
+            char name[64];
+            snprintf(name, sizeof name, "%s x %s", configs[i].name, offers[j].name);
+            printf("  %-22s %12.0f %12.0f %12.0f %12llu\n", name, reference.ns, hit.ns, miss.ns,
+                    (unsigned long long)build_ns);
+
+            for (uint32_t v = 0; v < MISS_VARIANTS; v++) {
+                free(match.variants[v][match.n_mimes]);
+                free(match.variants[v]);
+            }
+            free(match.variants);
+            zzz_list_free(match.list, NULL);
+            mime_matcher_free(&matcher);
+        }
+        free_pref_contents(&pref);
+    }
+    for (uint32_t i = 0; i < n_configs; i++) {
+        free(configs[i].text);
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,892 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "history.h"
+#include "mock_compositor.h"
+
+// every payload starts with its copy number in hex, so a stored entry can be matched to its copy
+#define HEADER_LEN 8
+#define PATTERN_LEN (64 * 1024)
+#define PASTE_CHUNK (1024 * 1024)
+// slow sources write every tick
+#define SLOW_TICK_MS 10
+// with -d: offers per drag, the pause between drags, and what zzz gets as -p
+#define DRAG_OFFERS 20
+#define DRAG_PAUSE_MS 1000
+#define PRIMARY_QUIET_MS "300"
+
+enum source_mode {
+    SOURCE_FAST,
+    // writes at a fixed byte rate
+    SOURCE_SLOW,
+    // writes half the payload, goes quiet for a while, then writes the rest
+    SOURCE_STALL,
+};
+
+struct options {
+    uint32_t copies;
+    double rate;
+    uint32_t n_mimes;
+    uint64_t *sizes;
+    uint32_t n_sizes;
+    char *sizes_arg;
+    enum source_mode mode;
+    uint64_t slow_rate;
+    uint32_t stall_ms;
+    char *source_arg;
+    uint32_t pastes;
+    // primary selection offers per second while dragging, 0 for none
+    double drag_rate;
+    // payload of the copy a second seat makes alongside each one, 0 for a single seat
+    uint64_t seat_size;
+    char *seat_size_arg;
+    uint32_t drain_ms;
+    char *zzz;
+    char *zzz_get;
+};
+
+struct bench {
+    struct options opts;
+    struct mock_compositor compositor;
+    char *tmp_dir;
+    char *store_dir;
+    char **mimes;
+    char *pattern;
+    // of struct synth_writer still in flight
+    struct wl_list writers;
+    bool failed;
+    bool finished;
+
+    pid_t zzz_pid;
+    pid_t zzz_get_pid;
+    struct wl_event_source *child_source;
+    // KiB, from wait4 once the process is gone
+    long zzz_rss;
+    long zzz_get_rss;
+    // user + system
+    uint64_t zzz_cpu_ns;
+    // from fork to zzz binding its data control device
+    uint64_t spawn_ns;
+    uint64_t startup_ns;
+
+    // copy phase
+    struct wl_event_source *copy_timer;
+    struct wl_event_source *drain_timer;
+    bool copying;
+    uint64_t start_ns;
+    uint32_t issued;
+    uint64_t *announced_ns;
+    // 0 until stored
+    uint64_t *latency_ns;
+    uint32_t n_stored;
+
+    // primary selection drags alongside the copies
+    struct wl_event_source *drag_timer;
+    uint32_t drag_offers;
+    uint32_t drags;
+
+    // copies made on the second seat
+    uint32_t seat_issued;
+
+    // watches the store for new entries
+    int inotify_fd;
+    struct wl_event_source *inotify_source;
+    struct history_store store;
+    bool store_open;
+    uint64_t next_entry;
+    // largest stored entry, pasted back through zzz_get
+    bool have_paste_entry;
+    uint64_t paste_entry;
+    uint64_t paste_len;
+
+    // paste phase; zzz_get hands the entry to the daemon, or serves it itself without one
+    bool recalling;
+    uint64_t recall_start_ns;
+    uint64_t recall_ns;
+    struct mock_source *paste_source;
+    uint32_t pastes_done;
+    int paste_fd;
+    struct wl_event_source *paste_read;
+    uint64_t paste_start_ns;
+    uint64_t paste_ns;
+    uint64_t paste_bytes;
+    char *paste_buf;
+};
+
+// one receive of a synthetic copy
+struct synth_writer {
+    struct bench *bench;
+    int fd;
+    uint32_t seq;
+    uint64_t size;
+    uint64_t written;
+    // NULL for slow sources, which only write from the timer
+    struct wl_event_source *fd_source;
+    struct wl_event_source *timer;
+    bool stalled;
+    struct wl_list link;
+};
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void bench_finish(struct bench *bench, bool failed) {
+    if (failed) bench->failed = true;
+    if (bench->finished) return;
+    bench->finished = true;
+    wl_display_terminate(bench->compositor.display);
+}
+
+void writer_free(struct synth_writer *writer) {
+    if (writer->fd_source != NULL) wl_event_source_remove(writer->fd_source);
+    wl_event_source_remove(writer->timer);
+    wl_list_remove(&writer->link);
+    close(writer->fd);
+    free(writer);
+}
+
+// returns false once the writer is done, either finished or the reader went away
+bool writer_write(struct synth_writer *writer, uint64_t budget) {
+    struct bench *bench = writer->bench;
+    while (budget > 0 && writer->written < writer->size) {
+        uint64_t limit = writer->size;
+        if (bench->opts.mode == SOURCE_STALL && !writer->stalled) {
+            if (writer->written >= writer->size / 2) {
+                writer->stalled = true;
+                wl_event_source_fd_update(writer->fd_source, 0);
+                wl_event_source_timer_update(writer->timer, bench->opts.stall_ms);
+                return true;
+            }
+            limit = writer->size / 2;
+        }
+
+        char header[HEADER_LEN + 1];
+        const char *chunk;
+        uint64_t len;
+        if (writer->written < HEADER_LEN) {
+            snprintf(header, sizeof header, "%08x", writer->seq);
+            chunk = header + writer->written;
+            len = HEADER_LEN - writer->written;
+        } else {
+            uint64_t at = (writer->written - HEADER_LEN) % PATTERN_LEN;
+            chunk = bench->pattern + at;
+            len = PATTERN_LEN - at;
+        }
+        if (len > limit - writer->written) len = limit - writer->written;
+        if (len > budget) len = budget;
+
+        ssize_t n = write(writer->fd, chunk, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN;
+        }
+        writer->written += n;
+        budget -= n;
+    }
+    return writer->written < writer->size;
+}
+
+int writer_writable(int fd, uint32_t mask, void *data) {
+    (void) fd;
+    (void) mask;
+    struct synth_writer *writer = data;
+    if (!writer_write(writer, UINT64_MAX)) writer_free(writer);
+    return 0;
+}
+
+int writer_tick(void *data) {
+    struct synth_writer *writer = data;
+    struct bench *bench = writer->bench;
+    if (bench->opts.mode == SOURCE_SLOW) {
+        uint64_t budget = bench->opts.slow_rate * SLOW_TICK_MS / 1000;
+        if (!writer_write(writer, budget > 0 ? budget : 1)) {
+            writer_free(writer);
+            return 0;
+        }
+        wl_event_source_timer_update(writer->timer, SLOW_TICK_MS);
+    } else {
+        // end of a stall
+        wl_event_source_fd_update(writer->fd_source, WL_EVENT_WRITABLE);
+    }
+    return 0;
+}
+
+void start_writer(struct bench *bench, int fd, uint32_t seq, uint64_t size) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    struct synth_writer *writer = malloc(sizeof *writer);
+    *writer = (struct synth_writer) {
+        .bench = bench,
+        .fd = fd,
+        .seq = seq,
+        .size = size,
+        .written = 0,
+        .fd_source = NULL,
+        .timer = NULL,
+        .stalled = false,
+    };
+    wl_list_insert(&bench->writers, &writer->link);
+    struct wl_event_loop *loop = bench->compositor.loop;
+    writer->timer = wl_event_loop_add_timer(loop, &writer_tick, writer);
+    if (bench->opts.mode == SOURCE_SLOW) {
+        wl_event_source_timer_update(writer->timer, 1);
+    } else {
+        writer->fd_source = wl_event_loop_add_fd(loop, fd, WL_EVENT_WRITABLE, &writer_writable, writer);
+    }
+}
+
+void synth_receive(struct mock_source *source, const char *mime, int fd) {
+    (void) mime;
+    struct bench *bench = source->data;
+    start_writer(bench, fd, source->id, bench->opts.sizes[source->id % bench->opts.n_sizes]);
+}
+
+// the second seat's copies, sized separately
+void seat_receive(struct mock_source *source, const char *mime, int fd) {
+    (void) mime;
+    struct bench *bench = source->data;
+    start_writer(bench, fd, source->id, bench->opts.seat_size);
+}
+
+void issue_copy(struct bench *bench) {
+    uint32_t seq = bench->issued++;
+    struct mock_source *source = mock_source_new(NULL);
+    for (uint32_t i = 0; i < bench->opts.n_mimes; i++) {
+        mock_source_add_mime(source, bench->mimes[i]);
+    }
+    source->receive = &synth_receive;
+    source->data = bench;
+    source->id = seq;
+    bench->announced_ns[seq] = now_ns();
+    mock_compositor_set_selection(&bench->compositor, 0, source);
+
+    if (bench->opts.seat_size == 0) return;
+    struct mock_source *seat_source = mock_source_new(NULL);
+    mock_source_add_mime(seat_source, bench->mimes[0]);
+    seat_source->receive = &seat_receive;
+    seat_source->data = bench;
+    seat_source->id = bench->seat_issued++;
+    mock_compositor_set_selection(&bench->compositor, 1, seat_source);
+}
+
+// a drag is a burst of primary selection offers, a settled one is a pause
+int drag_tick(void *data) {
+    struct bench *bench = data;
+    struct mock_source *source = mock_source_new(NULL);
+    mock_source_add_mime(source, bench->mimes[0]);
+    source->receive = &synth_receive;
+    source->data = bench;
+    source->id = bench->drag_offers++;
+    mock_compositor_set_primary_selection(&bench->compositor, 0, source);
+    if (bench->drag_offers % DRAG_OFFERS == 0) {
+        bench->drags++;
+        wl_event_source_timer_update(bench->drag_timer, DRAG_PAUSE_MS);
+    } else {
+        int wait_ms = (int)(1000 / bench->opts.drag_rate);
+        wl_event_source_timer_update(bench->drag_timer, wait_ms > 0 ? wait_ms : 1);
+    }
+    return 0;
+}
+
+void start_paste(struct bench *bench);
+
+void end_copy_phase(struct bench *bench) {
+    if (!bench->copying) return;
+    bench->copying = false;
+    wl_event_source_timer_update(bench->copy_timer, 0);
+    wl_event_source_timer_update(bench->drag_timer, 0);
+    wl_event_source_timer_update(bench->drain_timer, 0);
+    if (bench->opts.pastes == 0 || !bench->have_paste_entry) {
+        bench_finish(bench, false);
+        return;
+    }
+
+    char number[32];
+    snprintf(number, sizeof number, "%llu", (unsigned long long)bench->paste_entry);
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        execl(bench->opts.zzz_get, bench->opts.zzz_get, number, (char *)NULL);
+        perror(bench->opts.zzz_get);
+        _exit(127);
+    } else if (pid < 0) {
+        perror("fork");
+        bench_finish(bench, true);
+        return;
+    }
+    bench->zzz_get_pid = pid;
+    bench->recalling = true;
+    bench->recall_start_ns = now_ns();
+}
+
+int copy_tick(void *data) {
+    struct bench *bench = data;
+    uint64_t elapsed = now_ns() - bench->start_ns;
+    // the first copy goes out right away, the rest on schedule; a late tick catches up
+    uint64_t due = (uint64_t)(elapsed / 1e9 * bench->opts.rate) + 1;
+    if (due > bench->opts.copies) due = bench->opts.copies;
+    while (bench->issued < due) issue_copy(bench);
+
+    if (bench->issued == bench->opts.copies) {
+        wl_event_source_timer_update(bench->drain_timer, bench->opts.drain_ms > 0 ? bench->opts.drain_ms : 1);
+        return 0;
+    }
+    uint64_t next_ns = (uint64_t)(bench->issued / bench->opts.rate * 1e9);
+    int wait_ms = next_ns > elapsed ? (int)((next_ns - elapsed + 999999) / 1000000) : 1;
+    wl_event_source_timer_update(bench->copy_timer, wait_ms);
+    return 0;
+}
+
+int drain_timeout(void *data) {
+    // whatever isn't stored by now never will be
+    end_copy_phase(data);
+    return 0;
+}
+
+// matches entries written since the last call to the copies they came from
+void collect_stored(struct bench *bench) {
+    if (!bench->store_open) {
+        if (!history_open(&bench->store, bench->store_dir, false)) return;
+        bench->store_open = true;
+    }
+    uint64_t now = now_ns();
+    uint64_t count = history_count(&bench->store);
+    for (; bench->next_entry < count; bench->next_entry++) {
+        struct history_entry_rec entry;
+        struct history_item_rec item;
+        struct history_blob_rec blob;
+        if (!history_get_entry(&bench->store, bench->next_entry, &entry) || entry.n_items == 0
+                || !history_get_item(&bench->store, entry.first_item, &item)
+                || !history_get_blob(&bench->store, item.blob, &blob)) {
+            continue;
+        }
+        // stored payloads may be compressed, go through the reader for the sequence number
+        struct history_reader reader;
+        if (!history_reader_open(&bench->store, &blob, &reader)) continue;
+        char header[HEADER_LEN + 1] = {0};
+        ssize_t header_len = history_reader_read(&reader, header, HEADER_LEN);
+        history_reader_close(&reader);
+        if (header_len != HEADER_LEN) continue;
+        char *end;
+        unsigned long seq = strtoul(header, &end, 16);
+        if (*end != '\0' || seq >= bench->issued || bench->latency_ns[seq] != 0) continue;
+
+        bench->latency_ns[seq] = now - bench->announced_ns[seq];
+        bench->n_stored++;
+        if (!bench->have_paste_entry || blob.length > bench->paste_len) {
+            bench->have_paste_entry = true;
+            bench->paste_entry = bench->next_entry;
+            bench->paste_len = blob.length;
+        }
+    }
+    if (bench->n_stored == bench->opts.copies) end_copy_phase(bench);
+}
+
+int store_changed(int fd, uint32_t mask, void *data) {
+    (void) mask;
+    struct bench *bench = data;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool entries_changed = false;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof buf)) > 0) {
+        for (char *at = buf; at < buf + n; ) {
+            struct inotify_event *event = (struct inotify_event *)at;
+            if (event->len > 0 && strcmp(event->name, "entries") == 0) entries_changed = true;
+            at += sizeof *event + event->len;
+        }
+    }
+    if (entries_changed) collect_stored(bench);
+    return 0;
+}
+
+void paste_done(struct bench *bench) {
+    wl_event_source_remove(bench->paste_read);
+    bench->paste_read = NULL;
+    close(bench->paste_fd);
+    bench->paste_fd = -1;
+    bench->paste_ns += now_ns() - bench->paste_start_ns;
+    bench->pastes_done++;
+    if (bench->pastes_done < bench->opts.pastes) {
+        start_paste(bench);
+    } else {
+        bench_finish(bench, false);
+    }
+}
+
+int paste_readable(int fd, uint32_t mask, void *data) {
+    (void) mask;
+    struct bench *bench = data;
+    while (true) {
+        ssize_t n = read(fd, bench->paste_buf, PASTE_CHUNK);
+        if (n > 0) {
+            bench->paste_bytes += n;
+        } else if (n == 0) {
+            paste_done(bench);
+            return 0;
+        } else if (errno == EAGAIN) {
+            return 0;
+        } else if (errno != EINTR) {
+            perror("paste");
+            bench_finish(bench, true);
+            return 0;
+        }
+    }
+}
+
+// the bench plays paste target for zzz_get
+void start_paste(struct bench *bench) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        bench_finish(bench, true);
+        return;
+    }
+    // only our end; the write end is zzz_get's to block on
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    bench->paste_fd = fds[0];
+    bench->paste_start_ns = now_ns();
+    bench->paste_read = wl_event_loop_add_fd(bench->compositor.loop, fds[0], WL_EVENT_READABLE,
+            &paste_readable, bench);
+    mock_source_send(bench->paste_source, bench->paste_source->mimes[0], fds[1]);
+}
+
+pid_t client_pid(struct wl_client *client) {
+    pid_t pid;
+    wl_client_get_credentials(client, &pid, NULL, NULL);
+    return pid;
+}
+
+void device_bound(struct mock_compositor *compositor, struct wl_client *client) {
+    struct bench *bench = compositor->data;
+    if (bench->copying || bench->issued > 0 || client_pid(client) != bench->zzz_pid) return;
+    bench->copying = true;
+    bench->start_ns = now_ns();
+    bench->startup_ns = bench->start_ns - bench->spawn_ns;
+    wl_event_source_timer_update(bench->copy_timer, 1);
+    if (bench->opts.drag_rate > 0) wl_event_source_timer_update(bench->drag_timer, 1);
+}
+
+void selection_set(struct mock_compositor *compositor, uint32_t seat, struct wl_client *client,
+        struct mock_source *source) {
+    struct bench *bench = compositor->data;
+    if (seat != 0 || client == NULL || bench->paste_source != NULL || !bench->recalling) return;
+    pid_t pid = client_pid(client);
+    if (pid != bench->zzz_get_pid && pid != bench->zzz_pid) return;
+    bench->recall_ns = now_ns() - bench->recall_start_ns;
+    if (source->n_mimes == 0) {
+        fputs("zzz_get offered nothing\n", stderr);
+        bench_finish(bench, true);
+        return;
+    }
+    bench->paste_source = mock_source_ref(source);
+    start_paste(bench);
+}
+
+void reap(struct bench *bench, pid_t pid, int status, struct rusage *usage) {
+    if (pid == bench->zzz_pid) {
+        bench->zzz_pid = -1;
+        bench->zzz_rss = usage->ru_maxrss;
+        bench->zzz_cpu_ns = (uint64_t)(usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000000
+            + (uint64_t)(usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) * 1000;
+        if (!bench->finished) {
+            fprintf(stderr, "zzz exited early with status %d\n", status);
+            bench_finish(bench, true);
+        }
+    } else if (pid == bench->zzz_get_pid) {
+        bench->zzz_get_pid = -1;
+        bench->zzz_get_rss = usage->ru_maxrss;
+        // handing off to the daemon, zzz_get is done as soon as it has replied
+        if (!bench->finished && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+            fprintf(stderr, "zzz_get failed with status %d\n", status);
+            bench_finish(bench, true);
+        }
+    }
+}
+
+int child_exited(int signal_number, void *data) {
+    (void) signal_number;
+    struct bench *bench = data;
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        reap(bench, pid, status, &usage);
+    }
+    return 0;
+}
+
+void stop_child(struct bench *bench, pid_t pid) {
+    if (pid <= 0) return;
+    kill(pid, SIGTERM);
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == pid) {
+        reap(bench, pid, status, &usage);
+    }
+}
+
+int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void) st;
+    (void) type;
+    (void) ftw;
+    remove(path);
+    return 0;
+}
+
+bool parse_size(char *text, uint64_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text) return false;
+    switch (*end) {
+        case 'G': value *= 1024; // fallthrough
+        case 'M': value *= 1024; // fallthrough
+        case 'k': value *= 1024; end++; break;
+        default: break;
+    }
+    if (*end != '\0') return false;
+    // too short to hold the copy number otherwise
+    *size = value < HEADER_LEN ? HEADER_LEN : value;
+    return true;
+}
+
+bool parse_sizes(char *text, struct options *opts) {
+    char *copy = strdup(text);
+    opts->n_sizes = 0;
+    for (char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        opts->sizes = realloc(opts->sizes, (opts->n_sizes + 1) * sizeof *opts->sizes);
+        if (!parse_size(tok, &opts->sizes[opts->n_sizes++])) {
+            free(copy);
+            return false;
+        }
+    }
+    free(copy);
+    opts->sizes_arg = text;
+    return opts->n_sizes > 0;
+}
+
+bool parse_source(char *text, struct options *opts) {
+    opts->source_arg = text;
+    if (strcmp(text, "fast") == 0) {
+        opts->mode = SOURCE_FAST;
+        return true;
+    } else if (strncmp(text, "slow:", 5) == 0) {
+        opts->mode = SOURCE_SLOW;
+        return parse_size(text + 5, &opts->slow_rate);
+    } else if (strncmp(text, "stall:", 6) == 0) {
+        opts->mode = SOURCE_STALL;
+        char *end;
+        opts->stall_ms = strtoul(text + 6, &end, 10);
+        return end != text + 6 && *end == '\0';
+    }
+    return false;
+}
+
+// the first few are what toolkits usually offer for text
+char **make_mimes(uint32_t n_mimes) {
+    static const char *common[] = {"text/plain;charset=utf-8", "text/plain", "UTF8_STRING", "TEXT", "STRING"};
+    char **mimes = malloc((n_mimes + 1) * sizeof *mimes);
+    for (uint32_t i = 0; i < n_mimes; i++) {
+        if (i < sizeof common / sizeof *common) {
+            mimes[i] = strdup(common[i]);
+        } else {
+            char name[64];
+            snprintf(name, sizeof name, "application/x-bench-%u", i);
+            mimes[i] = strdup(name);
+        }
+    }
+    return mimes;
+}
+
+// stores utf-8 text and the first custom mime, so multi-mime captures and dedup get exercised
+bool write_config(char *config_dir) {
+    char *path;
+    if (asprintf(&path, "%s/zzzclip", config_dir) < 0) return false;
+    FILE *config = fopen(path, "w");
+    free(path);
+    if (config == NULL) {
+        perror("config");
+        return false;
+    }
+    fputs("[ (text/plain;charset=utf-8 text/plain UTF8_STRING) application/x-bench-5 ]\n", config);
+    fclose(config);
+    return true;
+}
+
+bool setup_dirs(struct bench *bench) {
+    char template[] = "/tmp/zzz_bench.XXXXXX";
+    if (mkdtemp(template) == NULL) {
+        perror("mkdtemp");
+        return false;
+    }
+    bench->tmp_dir = strdup(template);
+
+    char *config_dir;
+    char *state_dir;
+    if (asprintf(&config_dir, "%s/config", bench->tmp_dir) < 0
+            || asprintf(&state_dir, "%s/state", bench->tmp_dir) < 0) {
+        return false;
+    }
+    bool ok = mkdir(config_dir, 0700) == 0 && mkdir(state_dir, 0700) == 0 && write_config(config_dir);
+    setenv("XDG_CONFIG_HOME", config_dir, 1);
+    setenv("XDG_STATE_HOME", state_dir, 1);
+    if (getenv("XDG_RUNTIME_DIR") == NULL) setenv("XDG_RUNTIME_DIR", bench->tmp_dir, 1);
+    free(config_dir);
+    free(state_dir);
+    if (!ok) return false;
+
+    bench->store_dir = history_dir();
+    if (bench->store_dir == NULL || mkdir(bench->store_dir, 0700) < 0) return false;
+    // the daemon creates the index files itself, so watch the directory
+    bench->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (bench->inotify_fd < 0 || inotify_add_watch(bench->inotify_fd, bench->store_dir, IN_MODIFY) < 0) {
+        perror("inotify");
+        return false;
+    }
+    return true;
+}
+
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// nearest rank
+double percentile_ms(uint64_t *sorted, uint32_t n, double p) {
+    uint32_t rank = (uint32_t)(p / 100 * n + 0.999999);
+    if (rank == 0) rank = 1;
+    return sorted[rank - 1] / 1e6;
+}
+
+void report(struct bench *bench) {
+    struct options *opts = &bench->opts;
+    printf("%u copies at %g/s, %u mimes, sizes %s, %s source\n",
+            opts->copies, opts->rate, opts->n_mimes, opts->sizes_arg, opts->source_arg);
+    printf("  stored     %u/%u\n", bench->n_stored, opts->copies);
+    printf("  startup    %.2f ms from fork to binding the data control device\n", bench->startup_ns / 1e6);
+
+    uint64_t *latencies = malloc((bench->n_stored + 1) * sizeof *latencies);
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < bench->issued; i++) {
+        if (bench->latency_ns[i] != 0) latencies[n++] = bench->latency_ns[i];
+    }
+    if (n > 0) {
+        qsort(latencies, n, sizeof *latencies, &compare_u64);
+        printf("  latency    p50 %.2f ms  p90 %.2f ms  p99 %.2f ms  max %.2f ms\n",
+                percentile_ms(latencies, n, 50), percentile_ms(latencies, n, 90),
+                percentile_ms(latencies, n, 99), latencies[n - 1] / 1e6);
+    }
+    free(latencies);
+
+    if (bench->recall_ns > 0) {
+        printf("  recall     %.2f ms from zzz_get start to selection set\n", bench->recall_ns / 1e6);
+    }
+    if (bench->pastes_done > 0 && bench->paste_ns > 0) {
+        double mib = bench->paste_bytes / (1024.0 * 1024.0);
+        printf("  paste      %u x %llu B  %.2f ms each  %.1f MiB/s\n", bench->pastes_done,
+                (unsigned long long)(bench->paste_bytes / bench->pastes_done),
+                bench->paste_ns / 1e6 / bench->pastes_done, mib / (bench->paste_ns / 1e9));
+    }
+    if (opts->drag_rate > 0) {
+        // zzz is gone by now, the store can be read without racing it
+        uint64_t primary_stored = 0;
+        char *primary_dir = history_primary_dir();
+        struct history_store primary;
+        if (primary_dir != NULL && history_open(&primary, primary_dir, false)) {
+            primary_stored = history_count(&primary);
+            history_close(&primary);
+        }
+        free(primary_dir);
+        printf("  primary    %u offers in %u drags at %g/s, %llu stored\n", bench->drag_offers, bench->drags,
+                opts->drag_rate, (unsigned long long)primary_stored);
+    }
+    if (opts->seat_size > 0) {
+        uint64_t seat_stored = 0;
+        char *seat_dir = history_seat_dir("seat1");
+        struct history_store seat;
+        if (seat_dir != NULL && history_open(&seat, seat_dir, false)) {
+            seat_stored = history_count(&seat);
+            history_close(&seat);
+        }
+        free(seat_dir);
+        printf("  seat1      %u copies of %s, %llu stored\n", bench->seat_issued, opts->seat_size_arg,
+                (unsigned long long)seat_stored);
+    }
+    printf("  cpu        zzz %.1f ms\n", bench->zzz_cpu_ns / 1e6);
+    printf("  peak rss   zzz %ld KiB", bench->zzz_rss);
+    if (bench->zzz_get_rss > 0) printf("  zzz_get %ld KiB", bench->zzz_get_rss);
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    char *help =
+        "usage: zzz_bench [options]\n"
+        "  -h          print this help message\n"
+        "  -n COUNT    number of copies (default 100)\n"
+        "  -r RATE     copies per second (default 10)\n"
+        "  -m COUNT    mimes offered per copy (default 5)\n"
+        "  -s SIZES    comma separated payload sizes, k/M/G suffixes, used in turn (default 1k)\n"
+        "  -S SOURCE   fast, slow:BYTES_PER_SEC or stall:MS (default fast)\n"
+        "  -p COUNT    pastes of the largest stored entry through zzz_get (default 0)\n"
+        "  -d RATE     drag the primary selection at RATE offers/s alongside the copies, zzz runs with -p\n"
+        "  -e SIZE     a second seat copies SIZE alongside every copy; latency is still the first seat's\n"
+        "  -t MS       how long to wait for stores after the last copy (default 10000)\n"
+        "  -z PATH     zzz binary (default build/zzz)\n"
+        "  -g PATH     zzz_get binary (default build/zzz_get)\n";
+
+    struct bench bench = {0};
+    struct options *opts = &bench.opts;
+    *opts = (struct options) {
+        .copies = 100,
+        .rate = 10,
+        .n_mimes = 5,
+        .mode = SOURCE_FAST,
+        .source_arg = "fast",
+        .pastes = 0,
+        .drain_ms = 10000,
+        .zzz = "build/zzz",
+        .zzz_get = "build/zzz_get",
+    };
+    bool ok = parse_sizes("1k", opts);
+    int c;
+    while (ok && (c = getopt(argc, argv, "hn:r:m:s:S:p:d:e:t:z:g:")) != -1) {
+        switch (c) {
+            case 'h':
+                fputs(help, stdout);
+                return EXIT_SUCCESS;
+            case 'n': opts->copies = strtoul(optarg, NULL, 10); break;
+            case 'r': opts->rate = strtod(optarg, NULL); break;
+            case 'm': opts->n_mimes = strtoul(optarg, NULL, 10); break;
+            case 's': ok = parse_sizes(optarg, opts); break;
+            case 'S': ok = parse_source(optarg, opts); break;
+            case 'p': opts->pastes = strtoul(optarg, NULL, 10); break;
+            case 'd': opts->drag_rate = strtod(optarg, NULL); break;
+            case 'e':
+                opts->seat_size_arg = optarg;
+                ok = parse_size(optarg, &opts->seat_size);
+                break;
+            case 't': opts->drain_ms = strtoul(optarg, NULL, 10); break;
+            case 'z': opts->zzz = optarg; break;
+            case 'g': opts->zzz_get = optarg; break;
+            default: ok = false; break;
+        }
+    }
+    if (!ok || opts->copies == 0 || opts->rate <= 0 || opts->n_mimes == 0) {
+        fputs(help, stderr);
+        return EXIT_FAILURE;
+    }
+    if (opts->mode == SOURCE_STALL) opts->drain_ms += opts->stall_ms;
+
+    // readers that drop a capture must not take the bench down
+    signal(SIGPIPE, SIG_IGN);
+
+    bench.zzz_pid = -1;
+    bench.zzz_get_pid = -1;
+    bench.paste_fd = -1;
+    bench.inotify_fd = -1;
+    wl_list_init(&bench.writers);
+    bench.mimes = make_mimes(opts->n_mimes);
+    bench.pattern = malloc(PATTERN_LEN);
+    for (uint32_t i = 0; i < PATTERN_LEN; i++) {
+        bench.pattern[i] = 'a' + i % 26;
+    }
+    bench.paste_buf = malloc(PASTE_CHUNK);
+    bench.announced_ns = calloc(opts->copies, sizeof *bench.announced_ns);
+    bench.latency_ns = calloc(opts->copies, sizeof *bench.latency_ns);
+
+    if (!setup_dirs(&bench) || !mock_compositor_init(&bench.compositor, opts->seat_size > 0 ? 2 : 1)) {
+        return EXIT_FAILURE;
+    }
+    struct mock_compositor *compositor = &bench.compositor;
+    compositor->device_bound = &device_bound;
+    compositor->selection_set = &selection_set;
+    compositor->data = &bench;
+    setenv("WAYLAND_DISPLAY", compositor->socket, 1);
+
+    bench.copy_timer = wl_event_loop_add_timer(compositor->loop, &copy_tick, &bench);
+    bench.drain_timer = wl_event_loop_add_timer(compositor->loop, &drain_timeout, &bench);
+    bench.drag_timer = wl_event_loop_add_timer(compositor->loop, &drag_tick, &bench);
+    bench.inotify_source = wl_event_loop_add_fd(compositor->loop, bench.inotify_fd, WL_EVENT_READABLE,
+            &store_changed, &bench);
+    // blocks SIGCHLD, so children reset their mask before exec
+    bench.child_source = wl_event_loop_add_signal(compositor->loop, SIGCHLD, &child_exited, &bench);
+
+    bench.spawn_ns = now_ns();
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        if (opts->drag_rate > 0) {
+            execl(opts->zzz, opts->zzz, "-p", PRIMARY_QUIET_MS, (char *)NULL);
+        } else {
+            execl(opts->zzz, opts->zzz, (char *)NULL);
+        }
+        perror(opts->zzz);
+        _exit(127);
+    } else if (pid < 0) {
+        perror("fork");
+        return EXIT_FAILURE;
+    }
+    bench.zzz_pid = pid;
+
+    wl_display_run(compositor->display);
+
+    stop_child(&bench, bench.zzz_get_pid);
+    stop_child(&bench, bench.zzz_pid);
+    if (!bench.failed) report(&bench);
+
+    struct synth_writer *writer;
+    struct synth_writer *tmp;
+    wl_list_for_each_safe(writer, tmp, &bench.writers, link) {
+        writer_free(writer);
+    }
+    if (bench.paste_read != NULL) {
+        wl_event_source_remove(bench.paste_read);
+        close(bench.paste_fd);
+    }
+    if (bench.paste_source != NULL) mock_source_unref(bench.paste_source);
+    wl_event_source_remove(bench.copy_timer);
+    wl_event_source_remove(bench.drain_timer);
+    wl_event_source_remove(bench.drag_timer);
+    wl_event_source_remove(bench.inotify_source);
+    wl_event_source_remove(bench.child_source);
+    mock_compositor_finish(compositor);
+    if (bench.store_open) history_close(&bench.store);
+    close(bench.inotify_fd);
+    nftw(bench.tmp_dir, &remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    for (uint32_t i = 0; i < opts->n_mimes; i++) {
+        free(bench.mimes[i]);
+    }
+    free(bench.mimes);
+    free(bench.pattern);
+    free(bench.paste_buf);
+    free(bench.announced_ns);
+    free(bench.latency_ns);
+    free(opts->sizes);
+    free(bench.store_dir);
+    free(bench.tmp_dir);
+    return bench.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "stats.h"
+
+// cap on reads per wakeup so one fast source can't starve the others
+#define READS_PER_WAKEUP 16
+#define SPILL_CHUNK (64 * 1024)
+
+// move what was buffered so far into a memfd; the rest streams straight there
+bool transfer_spill(struct receive_transfer *transfer) {
+    int fd = memfd_create("zzz_clip", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("memfd_create");
+        return false;
+    }
+    if (!write_all(fd, transfer->data, transfer->len)) {
+        perror("spill");
+        close(fd);
+        return false;
+    }
+    free(transfer->data);
+    transfer->data = NULL;
+    transfer->capacity = 0;
+    transfer->spill_fd = fd;
+    return true;
+}
+
+// pipe -> memfd without going through userspace, falling back to a bounce buffer
+// on kernels that can't splice into shmem
+ssize_t transfer_read_spilled(struct receive_transfer *transfer) {
+    ssize_t moved = splice(transfer->source.fd, NULL, transfer->spill_fd, NULL, SPILL_CHUNK,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved >= 0 || errno != EINVAL) return moved;
+
+    static char bounce[SPILL_CHUNK];
+    ssize_t bytes_read = read(transfer->source.fd, bounce, sizeof bounce);
+    if (bytes_read > 0 && !write_all(transfer->spill_fd, bounce, bytes_read)) {
+        return -1;
+    }
+    return bytes_read;
+}
+
+void transfer_finish(struct receive_transfer *transfer) {
+    struct capture *capture = transfer->capture;
+    if (transfer->failed) capture->bytes -= transfer->len;
+    struct mime_stats *mime_stats = stats_mime(transfer->mime);
+    mime_stats->receives++;
+    if (transfer->failed) mime_stats->receives_failed++;
+    mime_stats->received_bytes += transfer->len;
+    histogram_add(&mime_stats->receive_ns, stats_now_ns() - capture->start_ns);
+
+    if (transfer->reading) {
+        // cut off by a limit, the read in flight may still land in data
+        event_loop_abandon(capture->loop, &transfer->source, transfer->data);
+        transfer->data = NULL;
+        transfer->reading = false;
+    } else {
+        event_loop_remove(capture->loop, &transfer->source);
+    }
+    close(transfer->source.fd);
+    transfer->source.fd = -1;
+    transfer->done = true;
+    capture->n_pending--;
+    if (capture->n_pending == 0) {
+        // may free capture, don't touch it afterwards
+        capture->done(capture, capture->done_data);
+    }
+}
+
+// frees what a finished transfer received, it won't make it into the clip
+void transfer_drop(struct receive_transfer *transfer) {
+    transfer->capture->bytes -= transfer->len;
+    transfer->failed = true;
+    free(transfer->data);
+    transfer->data = NULL;
+    if (transfer->spill_fd >= 0) close(transfer->spill_fd);
+    transfer->spill_fd = -1;
+}
+
+// true if transfer itself had to go, in which case it is finished and the capture may be gone
+bool transfer_over_limit(struct receive_transfer *transfer) {
+    struct capture *capture = transfer->capture;
+    if (transfer->max_bytes != 0 && transfer->len > transfer->max_bytes) {
+        stats_mime(transfer->mime)->receives_capped++;
+        transfer->failed = true;
+        transfer_finish(transfer);
+        return true;
+    }
+    // lowest priority first; none of the others can be the last one pending while transfer is
+    for (size_t i = capture->n_transfers; capture->budget != 0 && capture->bytes > capture->budget && i > 0; i--) {
+        struct receive_transfer *victim = &capture->transfers[i - 1];
+        if (victim->failed || victim->len == 0) continue;
+        stats_mime(victim->mime)->receives_capped++;
+        if (victim->done) {
+            transfer_drop(victim);
+            continue;
+        }
+        victim->failed = true;
+        transfer_finish(victim);
+        if (victim == transfer) return true;
+    }
+    return false;
+}
+
+void transfer_grow(struct receive_transfer *transfer) {
+    transfer->capacity *= 2;
+    if (transfer->capacity > SPILL_THRESHOLD) transfer->capacity = SPILL_THRESHOLD;
+    transfer->data = realloc(transfer->data, transfer->capacity);
+}
+
+// from reads on io_uring to readiness and plain syscalls
+bool transfer_poll(struct receive_transfer *transfer) {
+    struct event_loop *loop = transfer->capture->loop;
+    event_loop_remove(loop, &transfer->source);
+    fcntl(transfer->source.fd, F_SETFL, O_NONBLOCK);
+    return event_loop_add(loop, &transfer->source, EPOLLIN);
+}
+
+// io_uring: the next read is queued as soon as the last one completes, all the pipes of a
+// capture are read in the same io_uring_enter
+void transfer_queue_read(struct receive_transfer *transfer) {
+    if (transfer->len == transfer->capacity) {
+        if (transfer->capacity >= SPILL_THRESHOLD) {
+            // spilled transfers splice on readiness instead
+            if (!transfer_spill(transfer) || !transfer_poll(transfer)) {
+                transfer->failed = true;
+                transfer_finish(transfer);
+            }
+            return;
+        }
+        transfer_grow(transfer);
+    }
+    if (!event_loop_read(transfer->capture->loop, &transfer->source, transfer->data + transfer->len,
+                transfer->capacity - transfer->len)) {
+        transfer->failed = true;
+        transfer_finish(transfer);
+        return;
+    }
+    transfer->reading = true;
+}
+
+void transfer_read_done(struct receive_transfer *transfer, int32_t result) {
+    transfer->reading = false;
+    if (result > 0) {
+        hash_update(&transfer->hash, transfer->data + transfer->len, result);
+        transfer->hashed_len += result;
+        transfer->len += result;
+        transfer->capture->bytes += result;
+        if (transfer_over_limit(transfer)) return;
+    } else if (result == 0) {
+        transfer_finish(transfer);
+        return;
+    } else if (result == -EAGAIN) {
+        // someone made the pipe non-blocking after all
+        if (!transfer_poll(transfer)) {
+            transfer->failed = true;
+            transfer_finish(transfer);
+        }
+        return;
+    } else if (result != -EINTR) {
+        errno = -result;
+        perror("receive");
+        transfer->failed = true;
+        transfer_finish(transfer);
+        return;
+    }
+    transfer_queue_read(transfer);
+}
+
+void transfer_readable(struct event_source *source, uint32_t events) {
+    struct receive_transfer *transfer = source->data;
+    if (events & EVENT_LOOP_DONE) {
+        transfer_read_done(transfer, source->result);
+        return;
+    }
+
+    for (int i = 0; i < READS_PER_WAKEUP; i++) {
+        ssize_t bytes_read;
+        if (transfer->spill_fd >= 0) {
+            bytes_read = transfer_read_spilled(transfer);
+        } else {
+            if (transfer->len == transfer->capacity) {
+                if (transfer->capacity >= SPILL_THRESHOLD) {
+                    if (!transfer_spill(transfer)) {
+                        transfer->failed = true;
+                        transfer_finish(transfer);
+                        return;
+                    }
+                    continue;
+                }
+                transfer_grow(transfer);
+            }
+            bytes_read = read(source->fd, transfer->data + transfer->len,
+                    transfer->capacity - transfer->len);
+        }
+        if (bytes_read > 0) {
+            if (transfer->spill_fd < 0) {
+                hash_update(&transfer->hash, transfer->data + transfer->len, bytes_read);
+                transfer->hashed_len += bytes_read;
+            }
+            transfer->len += bytes_read;
+            transfer->capture->bytes += bytes_read;
+            if (transfer_over_limit(transfer)) return;
+        } else if (bytes_read == 0) {
+            transfer_finish(transfer);
+            return;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else if (errno != EINTR) {
+            perror("receive");
+            transfer->failed = true;
+            transfer_finish(transfer);
+            return;
+        }
+    }
+}
+
+struct capture *capture_start(struct event_loop *loop, struct zwlr_data_control_offer_v1 *offer,
+        char **mimes, uint32_t *selected, uint64_t *max_bytes, uint32_t n_selected, uint64_t budget,
+        capture_done_func *done, void *done_data) {
+    if (n_selected == 0) return NULL;
+
+    struct clip *clip = clip_new();
+    struct capture *capture = malloc(sizeof *capture);
+    *capture = (struct capture) {
+        .loop = loop,
+        .clip = clip,
+        .transfers = arena_alloc(&clip->arena, n_selected * sizeof *capture->transfers),
+        .n_transfers = 0,
+        .n_pending = 0,
+        .bytes = 0,
+        .budget = budget,
+        .done = done,
+        .done_data = done_data,
+        .start_ns = stats_now_ns(),
+    };
+
+    for (uint32_t i = 0; i < n_selected; i++) {
+        char *mime = mimes[selected[i]];
+        int fd[2];
+        if (pipe2(fd, O_CLOEXEC) < 0) {
+            perror("pipe");
+            continue;
+        }
+        // only our end; the write end is shared with the source client.
+        // io_uring reads need it blocking, they wait in the kernel
+        if (loop->uring == NULL) fcntl(fd[0], F_SETFL, O_NONBLOCK);
+
+        struct receive_transfer *transfer = &capture->transfers[capture->n_transfers];
+        size_t initial_capacity = 4096;
+        *transfer = (struct receive_transfer) {
+            .source = {
+                .fd = fd[0],
+                .callback = &transfer_readable,
+                .data = transfer,
+            },
+            .capture = capture,
+            .mime = arena_strdup(&clip->arena, mime),
+            .data = malloc(initial_capacity),
+            .len = 0,
+            .capacity = initial_capacity,
+            .max_bytes = max_bytes[i],
+            .spill_fd = -1,
+            .hashed_len = 0,
+            .reading = false,
+            .done = false,
+            .failed = false,
+        };
+        hash_init(&transfer->hash);
+        bool started;
+        if (loop->uring != NULL) {
+            started = transfer->reading = event_loop_read(loop, &transfer->source, transfer->data,
+                    transfer->capacity);
+        } else {
+            started = event_loop_add(loop, &transfer->source, EPOLLIN);
+        }
+        if (!started) {
+            close(fd[0]);
+            close(fd[1]);
+            free(transfer->data);
+            continue;
+        }
+        zwlr_data_control_offer_v1_receive(offer, mime, fd[1]);
+        close(fd[1]);
+        capture->n_transfers++;
+        capture->n_pending++;
+    }
+
+    if (capture->n_transfers == 0) {
+        capture_free(capture);
+        return NULL;
+    }
+    return capture;
+}
+
+struct clip *capture_take_clip(struct capture *capture) {
+    struct clip *clip = capture->clip;
+    clip->items = arena_alloc(&clip->arena, capture->n_transfers * sizeof *clip->items);
+    clip->n_items = 0;
+    for (size_t i = 0; i < capture->n_transfers; i++) {
+        struct receive_transfer *transfer = &capture->transfers[i];
+        if (!transfer->done || transfer->failed) continue;
+
+        if (transfer->data != NULL && transfer->len < transfer->capacity) {
+            // small clips live for a while, don't keep the slack around
+            transfer->data = realloc(transfer->data, transfer->len > 0 ? transfer->len : 1);
+        }
+        struct clip_item *item = &clip->items[clip->n_items++];
+        *item = (struct clip_item) {
+            .mime = transfer->mime,
+            .data = transfer->data,
+            .fd = transfer->spill_fd,
+            .len = transfer->len,
+            .partial_hash = NULL,
+            .hashed_len = transfer->hashed_len,
+        };
+        if (transfer->spill_fd >= 0) {
+            // the spliced rest is left to the store job, hashing it here would hold up the loop
+            item->partial_hash = arena_alloc(&clip->arena, sizeof *item->partial_hash);
+            *item->partial_hash = transfer->hash;
+        } else {
+            item->hash = hash_digest(&transfer->hash);
+        }
+        transfer->data = NULL;
+        transfer->spill_fd = -1;
+    }
+    // transfers are no longer needed, but they're in the arena with everything else
+    capture->n_transfers = 0;
+    capture->clip = NULL;
+    if (clip->n_items == 0) {
+        clip_unref(clip);
+        return NULL;
+    }
+    return clip;
+}
+
+void capture_free(struct capture *capture) {
+    for (size_t i = 0; i < capture->n_transfers; i++) {
+        struct receive_transfer *transfer = &capture->transfers[i];
+        if (transfer->reading) {
+            event_loop_abandon(capture->loop, &transfer->source, transfer->data);
+            transfer->data = NULL;
+        } else if (!transfer->done) {
+            event_loop_remove(capture->loop, &transfer->source);
+        }
+        if (!transfer->done) close(transfer->source.fd);
+        free(transfer->data);
+        if (transfer->spill_fd >= 0) close(transfer->spill_fd);
+    }
+    if (capture->clip != NULL) clip_unref(capture->clip);
+    free(capture);
+}
@@ -0,0 +1,70 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "clip_item.h"
+#include "event_loop.h"
+#include "hash.h"
+#include "wlr-data-control-protocol.h"
+
+struct capture;
+
+typedef void capture_done_func(struct capture *capture, void *data);
+
+// one non-blocking receive pipe per mime
+struct receive_transfer {
+    struct event_source source;
+    struct capture *capture;
+    // in the clip's arena
+    char *mime;
+    char *data;
+    size_t len;
+    size_t capacity;
+    // aborted once len passes this, 0 for no cap
+    uint64_t max_bytes;
+    // set once len passes SPILL_THRESHOLD, data is NULL from then on
+    int spill_fd;
+    // covers everything read into data; spliced bytes are hashed by the store job, see clip_item
+    struct hash_state hash;
+    size_t hashed_len;
+    // io_uring: a read into data is in flight
+    bool reading;
+    bool done;
+    bool failed;
+};
+
+// all mimes of one selection, received in parallel; transfers are in priority order, when the
+// clip goes over its budget the lowest priority ones are dropped first
+struct capture {
+    struct event_loop *loop;
+    // what the transfers land in; the transfers array lives in its arena too
+    struct clip *clip;
+    struct receive_transfer *transfers;
+    size_t n_transfers;
+    size_t n_pending;
+    // received by transfers that haven't failed or been dropped
+    uint64_t bytes;
+    // 0 for none
+    uint64_t budget;
+    capture_done_func *done;
+    void *done_data;
+    // when the receives were requested
+    uint64_t start_ns;
+};
+
+// starts receiving mimes[selected[i]] for each i from offer, at most max_bytes[i] of it and budget
+// across all of them (0 for no limit); done is called from the event loop once every transfer has
+// hit EOF or failed
+// returns NULL if nothing could be started
+struct capture *capture_start(struct event_loop *loop, struct zwlr_data_control_offer_v1 *offer,
+        char **mimes, uint32_t *selected, uint64_t *max_bytes, uint32_t n_selected, uint64_t budget,
+        capture_done_func *done, void *done_data);
+// the transfers that finished as a clip, in the order the mimes were given
+// the caller gets the capture's reference; NULL if nothing was received
+struct clip *capture_take_clip(struct capture *capture);
+// aborts any transfers still in flight
+void capture_free(struct capture *capture);
+
+#endif
@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "clip_cache.h"
+#include "stats.h"
+
+void clip_cache_init(struct clip_cache *cache, uint64_t budget) {
+    *cache = (struct clip_cache) {
+        .budget = budget,
+        .pressure = {
+            .fd = -1,
+        },
+    };
+}
+
+// the slot holding number, or the empty one it would go in
+uint32_t clip_cache_find(struct clip_cache *cache, uint64_t number) {
+    // entry numbers are sequential, so they spread over the slots as they are
+    uint32_t mask = cache->index_capacity - 1;
+    uint32_t i = number & mask;
+    while (cache->index[i] != NULL && cache->index[i]->number != number) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// NULL if number isn't cached
+struct clip_cache_entry *clip_cache_lookup(struct clip_cache *cache, uint64_t number) {
+    if (cache->n_entries == 0) return NULL;
+    return cache->index[clip_cache_find(cache, number)];
+}
+
+void clip_cache_grow(struct clip_cache *cache) {
+    struct clip_cache_entry **old = cache->index;
+    uint32_t old_capacity = cache->index_capacity;
+    cache->index_capacity = old_capacity == 0 ? 64 : old_capacity * 2;
+    cache->index = calloc(cache->index_capacity, sizeof *cache->index);
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (old[i] != NULL) cache->index[clip_cache_find(cache, old[i]->number)] = old[i];
+    }
+    free(old);
+}
+
+// backward shift deletion: entries further along the probe run move up into the hole, so there
+// are no tombstones for lookups to step over
+void clip_cache_unindex(struct clip_cache *cache, uint32_t hole) {
+    uint32_t mask = cache->index_capacity - 1;
+    for (uint32_t i = (hole + 1) & mask; cache->index[i] != NULL; i = (i + 1) & mask) {
+        uint32_t home = cache->index[i]->number & mask;
+        // can't move before its home slot, which is cyclically in (hole, i]
+        bool stays = hole <= i ? hole < home && home <= i : hole < home || home <= i;
+        if (stays) continue;
+        cache->index[hole] = cache->index[i];
+        hole = i;
+    }
+    cache->index[hole] = NULL;
+}
+
+void clip_cache_unlink(struct clip_cache *cache, struct clip_cache_entry *entry) {
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->newest = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->oldest = entry->prev;
+    }
+}
+
+void clip_cache_push(struct clip_cache *cache, struct clip_cache_entry *entry) {
+    entry->prev = NULL;
+    entry->next = cache->newest;
+    if (cache->newest != NULL) {
+        cache->newest->prev = entry;
+    } else {
+        cache->oldest = entry;
+    }
+    cache->newest = entry;
+}
+
+void clip_cache_evict(struct clip_cache *cache, struct clip_cache_entry *entry) {
+    clip_cache_unindex(cache, clip_cache_find(cache, entry->number));
+    clip_cache_unlink(cache, entry);
+    clip_unref(entry->clip);
+    cache->bytes -= entry->bytes;
+    cache->n_entries--;
+    free(entry);
+    stats.cache_entries = cache->n_entries;
+    stats.cache_bytes = cache->bytes;
+}
+
+void clip_cache_free(struct clip_cache *cache) {
+    while (cache->oldest != NULL) {
+        clip_cache_evict(cache, cache->oldest);
+    }
+    free(cache->index);
+    if (cache->pressure.fd >= 0) {
+        event_loop_remove(cache->loop, &cache->pressure);
+        close(cache->pressure.fd);
+    }
+    clip_cache_init(cache, 0);
+}
+
+uint64_t clip_cache_budget(struct clip_cache *cache) {
+    if (cache->pressure_ns != 0 && stats_now_ns() - cache->pressure_ns < CLIP_CACHE_PRESSURE_HOLD_NS) {
+        return cache->budget >> CLIP_CACHE_PRESSURE_SHIFT;
+    }
+    cache->pressure_ns = 0;
+    return cache->budget;
+}
+
+void clip_cache_shrink(struct clip_cache *cache, uint64_t budget) {
+    while (cache->bytes > budget) {
+        clip_cache_evict(cache, cache->oldest);
+        stats.cache_evictions++;
+    }
+}
+
+void clip_cache_put(struct clip_cache *cache, uint64_t number, struct clip *clip) {
+    struct clip_cache_entry *cached = clip_cache_lookup(cache, number);
+    if (cached != NULL) clip_cache_evict(cache, cached);
+
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < clip->n_items; i++) {
+        bytes += clip->items[i].len;
+    }
+    uint64_t budget = clip_cache_budget(cache);
+    if (bytes > budget) return;
+    clip_cache_shrink(cache, budget - bytes);
+
+    // kept at most three quarters full
+    if ((cache->n_entries + 1) * 4 > cache->index_capacity * 3) clip_cache_grow(cache);
+    struct clip_cache_entry *entry = malloc(sizeof *entry);
+    *entry = (struct clip_cache_entry) {
+        .number = number,
+        .clip = clip_ref(clip),
+        .bytes = bytes,
+    };
+    cache->index[clip_cache_find(cache, number)] = entry;
+    clip_cache_push(cache, entry);
+    cache->n_entries++;
+    cache->bytes += bytes;
+    stats.cache_entries = cache->n_entries;
+    stats.cache_bytes = cache->bytes;
+}
+
+struct clip *clip_cache_get(struct clip_cache *cache, uint64_t number) {
+    struct clip_cache_entry *entry = clip_cache_lookup(cache, number);
+    if (entry == NULL) return NULL;
+    clip_cache_unlink(cache, entry);
+    clip_cache_push(cache, entry);
+    return entry->clip;
+}
+
+struct clip *clip_cache_load(struct clip_cache *cache, struct history_store *history, uint64_t number) {
+    struct clip *clip = clip_cache_get(cache, number);
+    if (clip != NULL) {
+        stats.cache_hits++;
+        return clip_ref(clip);
+    }
+    stats.cache_misses++;
+    clip = history_load_clip(history, number);
+    if (clip != NULL) clip_cache_put(cache, number, clip);
+    return clip;
+}
+
+void clip_cache_pressure(struct event_source *source, uint32_t events) {
+    struct clip_cache *cache = source->data;
+    if (events & EPOLLERR) {
+        // the trigger is gone, e.g. the cgroup was removed
+        event_loop_remove(cache->loop, source);
+        close(source->fd);
+        source->fd = -1;
+        return;
+    }
+    stats.cache_pressure_events++;
+    cache->pressure_ns = stats_now_ns();
+    clip_cache_shrink(cache, cache->budget >> CLIP_CACHE_PRESSURE_SHIFT);
+}
+
+bool clip_cache_watch_pressure(struct clip_cache *cache, struct event_loop *loop) {
+    int fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return false;
+    // the trigger lives as long as the fd
+    if (write(fd, CLIP_CACHE_PSI_TRIGGER, strlen(CLIP_CACHE_PSI_TRIGGER) + 1) < 0) {
+        close(fd);
+        return false;
+    }
+    cache->loop = loop;
+    cache->pressure = (struct event_source) {
+        .fd = fd,
+        .callback = &clip_cache_pressure,
+        .data = cache,
+    };
+    if (!event_loop_add(loop, &cache->pressure, EPOLLPRI)) {
+        close(fd);
+        cache->pressure.fd = -1;
+        return false;
+    }
+    return true;
+}
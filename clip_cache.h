@@ -0,0 +1,65 @@
+#ifndef CLIP_CACHE_H
+#define CLIP_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "clip_item.h"
+#include "event_loop.h"
+#include "history.h"
+
+// zzz -c default
+#define CLIP_CACHE_DEFAULT_BUDGET (64 * 1024 * 1024)
+// PSI trigger: memory stalls of 200ms within 2s; unprivileged triggers need a 2s multiple window
+#define CLIP_CACHE_PSI_TRIGGER "some 200000 2000000"
+// the budget is divided by 2^this while there is memory pressure
+#define CLIP_CACHE_PRESSURE_SHIFT 3
+// since the last pressure event, before the full budget applies again
+#define CLIP_CACHE_PRESSURE_HOLD_NS (60 * 1000000000ull)
+
+struct clip_cache_entry {
+    uint64_t number;
+    // holds a reference
+    struct clip *clip;
+    // payload bytes, what counts against the budget
+    uint64_t bytes;
+    // the LRU list, most recently used first
+    struct clip_cache_entry *prev;
+    struct clip_cache_entry *next;
+};
+
+// entry number -> decoded clip, least recently used goes first once the cached payloads
+// exceed the budget; shrinks itself when the kernel reports memory pressure.
+// looking up, adding and evicting an entry are all O(1): an open addressing index finds it and
+// the LRU list keeps the next victim at its tail
+struct clip_cache {
+    // linear probing on the entry number, NULL for an empty slot; capacity is a power of two
+    struct clip_cache_entry **index;
+    uint32_t index_capacity;
+    uint32_t n_entries;
+    struct clip_cache_entry *newest;
+    struct clip_cache_entry *oldest;
+    uint64_t bytes;
+    uint64_t budget;
+    // stats_now_ns of the last pressure event, 0 if there never was one
+    uint64_t pressure_ns;
+    // fd -1 without a PSI trigger
+    struct event_source pressure;
+    struct event_loop *loop;
+};
+
+void clip_cache_init(struct clip_cache *cache, uint64_t budget);
+// memory pressure from /proc/pressure/memory; false if the kernel has no PSI or won't take the trigger
+bool clip_cache_watch_pressure(struct clip_cache *cache, struct event_loop *loop);
+void clip_cache_free(struct clip_cache *cache);
+// takes its own reference, replacing whatever was cached for number;
+// clips bigger than the current budget aren't cached
+void clip_cache_put(struct clip_cache *cache, uint64_t number, struct clip *clip);
+// borrowed, NULL on a miss
+struct clip *clip_cache_get(struct clip_cache *cache, uint64_t number);
+// loads and caches the entry on a miss; a new reference, NULL if the entry can't be read
+struct clip *clip_cache_load(struct clip_cache *cache, struct history_store *history, uint64_t number);
+// evicts down to budget bytes
+void clip_cache_shrink(struct clip_cache *cache, uint64_t budget);
+
+#endif
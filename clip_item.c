@@ -0,0 +1,64 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "clip_item.h"
+
+struct clip *clip_new(void) {
+    struct clip *clip = malloc(sizeof *clip);
+    *clip = (struct clip) {
+        .items = NULL,
+        .n_items = 0,
+        .refs = 1,
+    };
+    arena_init(&clip->arena);
+    return clip;
+}
+
+struct clip *clip_ref(struct clip *clip) {
+    clip->refs++;
+    return clip;
+}
+
+void clip_unref(struct clip *clip) {
+    if (--clip->refs > 0) return;
+    for (uint32_t i = 0; i < clip->n_items; i++) {
+        free(clip->items[i].data);
+        if (clip->items[i].fd >= 0) close(clip->items[i].fd);
+    }
+    arena_free(&clip->arena);
+    free(clip);
+}
+
+bool clip_item_finish_hash(struct clip_item *item) {
+    if (item->partial_hash == NULL) return true;
+    struct hash_state state = *item->partial_hash;
+    if (item->hashed_len < item->len) {
+        char *map = mmap(NULL, item->len, PROT_READ, MAP_SHARED, item->fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            return false;
+        }
+        hash_update(&state, map + item->hashed_len, item->len - item->hashed_len);
+        munmap(map, item->len);
+    }
+    item->hash = hash_digest(&state);
+    item->partial_hash = NULL;
+    item->hashed_len = item->len;
+    return true;
+}
+
+bool write_all(int fd, char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
@@ -0,0 +1,49 @@
+#ifndef CLIP_ITEM_H
+#define CLIP_ITEM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "hash.h"
+
+// payloads larger than this are streamed into a memfd instead of the heap
+#define SPILL_THRESHOLD (64 * 1024)
+
+struct clip_item {
+    // in the owning clip's arena
+    char *mime;
+    // inline payload, NULL when spilled
+    char *data;
+    // memfd holding the payload when spilled, otherwise -1
+    int fd;
+    size_t len;
+    // hash_bytes of the payload, for deduplication in the history store
+    uint64_t hash;
+    // a spilled capture's hash is finished off the dispatch thread, by whoever stores it: until
+    // then hash isn't set and this (in the arena) covers the payload's first hashed_len bytes
+    struct hash_state *partial_hash;
+    size_t hashed_len;
+};
+
+// every mime saved from one selection; metadata lives in the arena,
+// payloads are owned separately and released with it
+struct clip {
+    struct arena arena;
+    struct clip_item *items;
+    uint32_t n_items;
+    // the saved clip holds one, each paste still being written holds another
+    unsigned refs;
+};
+
+struct clip *clip_new(void);
+struct clip *clip_ref(struct clip *clip);
+// drops a reference, freeing on the last one
+void clip_unref(struct clip *clip);
+// hashes the rest of a spilled payload from a mapping of its memfd, item's hash is final after;
+// only item itself is written, the state it was partially hashed with is left as it is
+bool clip_item_finish_hash(struct clip_item *item);
+bool write_all(int fd, char *data, size_t len);
+
+#endif
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zdict.h>
+
+#include "codec.h"
+
+// a clip's first few KiB say all a dictionary needs to know about it
+#define DICT_SAMPLE_MAX (4 * 1024)
+#define DICT_SAMPLES_BYTES (1024 * 1024)
+#define DICT_SIZE (16 * 1024)
+// zdict wants a training set several times the dictionary size
+#define DICT_MIN_SAMPLES_BYTES (8 * DICT_SIZE)
+#define DICT_MIN_SAMPLES 64
+
+static const char *text_mimes[] = {
+    "UTF8_STRING", "STRING", "TEXT", "COMPOUND_TEXT",
+    "application/json", "application/xml", "application/javascript", "application/x-sh",
+};
+
+static const char *compressed_mimes[] = {
+    "image/png", "image/jpeg", "image/gif", "image/webp", "image/avif", "image/heic", "image/jxl",
+    "application/zip", "application/gzip", "application/x-gzip", "application/x-xz", "application/zstd",
+    "application/x-bzip2", "application/x-7z-compressed", "font/woff", "font/woff2",
+};
+
+struct magic {
+    size_t offset;
+    size_t len;
+    const char *bytes;
+};
+
+static const struct magic compressed_magics[] = {
+    {0, 8, "\x89PNG\r\n\x1a\n"},
+    {0, 3, "\xff\xd8\xff"},
+    {0, 4, "GIF8"},
+    {8, 4, "WEBP"},
+    {0, 4, "PK\x03\x04"},
+    {0, 2, "\x1f\x8b"},
+    {0, 4, "\x28\xb5\x2f\xfd"},
+    {0, 6, "\xfd" "7zXZ\x00"},
+    {0, 3, "BZh"},
+    {0, 6, "7z\xbc\xaf\x27\x1c"},
+};
+
+bool mime_has_prefix(const char *str, const char *prefix) {
+    return strncmp(str, prefix, strlen(prefix)) == 0;
+}
+
+bool mime_has_suffix(const char *str, const char *suffix) {
+    size_t len = strlen(str);
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(str + len - suffix_len, suffix) == 0;
+}
+
+bool mime_in_list(const char *mime, const char **list, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (strcmp(mime, list[i]) == 0) return true;
+    }
+    return false;
+}
+
+enum payload_class payload_class(const char *mime, const unsigned char *head, size_t head_len) {
+    // the bytes win over the mime, apps mislabel things
+    for (size_t i = 0; i < sizeof compressed_magics / sizeof *compressed_magics; i++) {
+        const struct magic *magic = &compressed_magics[i];
+        if (head_len >= magic->offset + magic->len
+                && memcmp(head + magic->offset, magic->bytes, magic->len) == 0) {
+            return PAYLOAD_COMPRESSED;
+        }
+    }
+    if (mime_has_prefix(mime, "video/") || mime_has_prefix(mime, "audio/")
+            || mime_in_list(mime, compressed_mimes, sizeof compressed_mimes / sizeof *compressed_mimes)) {
+        return PAYLOAD_COMPRESSED;
+    }
+    if (mime_has_prefix(mime, "text/") || mime_has_suffix(mime, "+xml") || mime_has_suffix(mime, "+json")
+            || mime_in_list(mime, text_mimes, sizeof text_mimes / sizeof *text_mimes)) {
+        return PAYLOAD_TEXT;
+    }
+    return PAYLOAD_BINARY;
+}
+
+void dict_trainer_init(struct dict_trainer *trainer) {
+    *trainer = (struct dict_trainer) {0};
+}
+
+void dict_trainer_free(struct dict_trainer *trainer) {
+    free(trainer->samples);
+    free(trainer->sizes);
+    *trainer = (struct dict_trainer) {0};
+}
+
+void dict_trainer_add(struct dict_trainer *trainer, const char *data, size_t len) {
+    if (len > DICT_SAMPLE_MAX) len = DICT_SAMPLE_MAX;
+    if (len == 0 || trainer->samples_len + len > DICT_SAMPLES_BYTES) return;
+    if (trainer->samples == NULL) {
+        trainer->samples = malloc(DICT_SAMPLES_BYTES);
+        // every sample is at least a byte
+        trainer->sizes = malloc(DICT_SAMPLES_BYTES * sizeof *trainer->sizes);
+    }
+    memcpy(trainer->samples + trainer->samples_len, data, len);
+    trainer->samples_len += len;
+    trainer->sizes[trainer->n_samples++] = len;
+}
+
+bool dict_trainer_ready(struct dict_trainer *trainer, bool have_dict) {
+    if (trainer->n_samples < DICT_MIN_SAMPLES) return false;
+    if (have_dict) return trainer->samples_len + DICT_SAMPLE_MAX > DICT_SAMPLES_BYTES;
+    return trainer->samples_len >= DICT_MIN_SAMPLES_BYTES;
+}
+
+char *dict_trainer_train(struct dict_trainer *trainer, size_t *dict_len) {
+    char *dict = malloc(DICT_SIZE);
+    size_t result = ZDICT_trainFromBuffer(dict, DICT_SIZE, trainer->samples, trainer->sizes, trainer->n_samples);
+    trainer->samples_len = 0;
+    trainer->n_samples = 0;
+    if (ZDICT_isError(result)) {
+        fprintf(stderr, "dictionary training failed: %s\n", ZDICT_getErrorName(result));
+        free(dict);
+        return NULL;
+    }
+    *dict_len = result;
+    return dict;
+}
@@ -0,0 +1,43 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// how a payload is stored in a segment, kept in the record header's flags
+#define CODEC_RAW 0
+#define CODEC_ZSTD 1
+
+// leading payload bytes payload_class looks at
+#define CODEC_MAGIC_LEN 16
+
+enum payload_class {
+    // zstd with a dictionary trained on earlier text
+    PAYLOAD_TEXT,
+    // plain zstd
+    PAYLOAD_BINARY,
+    // already compressed (png, jpeg, zip, ...), stored as-is
+    PAYLOAD_COMPRESSED,
+};
+
+enum payload_class payload_class(const char *mime, const unsigned char *head, size_t head_len);
+
+// text payloads seen since the last dictionary, the training set for the next one
+struct dict_trainer {
+    char *samples;
+    size_t samples_len;
+    size_t *sizes;
+    uint32_t n_samples;
+};
+
+void dict_trainer_init(struct dict_trainer *trainer);
+void dict_trainer_free(struct dict_trainer *trainer);
+// keeps at most the first DICT_SAMPLE_MAX bytes; ignored once the sample buffer is full
+void dict_trainer_add(struct dict_trainer *trainer, const char *data, size_t len);
+// the first dictionary is trained as soon as there is enough text, later ones once the buffer fills up
+bool dict_trainer_ready(struct dict_trainer *trainer, bool have_dict);
+// malloc'd dictionary or NULL; the samples are dropped either way
+char *dict_trainer_train(struct dict_trainer *trainer, size_t *dict_len);
+
+#endif
@@ -0,0 +1,74 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "config_watch.h"
+#include "read_config.h"
+
+// written and closed, renamed into place, or removed (back to the default)
+#define CONFIG_WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)
+
+void config_watch_event(struct event_source *source, uint32_t events) {
+    (void) events;
+    struct config_watch *watch = source->data;
+    // one reload however many events a save produced
+    bool changed = false;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(source->fd, buf, sizeof buf)) > 0) {
+        for (char *curr = buf; curr < buf + len;) {
+            struct inotify_event *event = (struct inotify_event *)curr;
+            if (event->len > 0 && strcmp(event->name, watch->name) == 0) changed = true;
+            curr += sizeof *event + event->len;
+        }
+    }
+    if (changed) watch->changed(watch, watch->data);
+}
+
+bool config_watch_init(struct config_watch *watch, struct event_loop *loop, config_changed_func *changed,
+        void *data) {
+    *watch = (struct config_watch) {
+        .source = {
+            .fd = -1,
+            .callback = &config_watch_event,
+            .data = watch,
+        },
+        .loop = loop,
+        .changed = changed,
+        .data = data,
+    };
+    char *path = config_path();
+    char *slash = strrchr(path, '/');
+    watch->name = strdup(slash + 1);
+    *slash = '\0';
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, path[0] == '\0' ? "/" : path, CONFIG_WATCH_EVENTS) < 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        free(path);
+        return false;
+    }
+    free(path);
+    watch->source.fd = fd;
+    if (!event_loop_add(loop, &watch->source, EPOLLIN)) {
+        close(fd);
+        watch->source.fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void config_watch_finish(struct config_watch *watch) {
+    if (watch->source.fd >= 0) {
+        event_loop_remove(watch->loop, &watch->source);
+        close(watch->source.fd);
+        watch->source.fd = -1;
+    }
+    free(watch->name);
+    watch->name = NULL;
+}
@@ -0,0 +1,29 @@
+#ifndef CONFIG_WATCH_H
+#define CONFIG_WATCH_H
+
+#include <stdbool.h>
+
+#include "event_loop.h"
+
+struct config_watch;
+
+typedef void config_changed_func(struct config_watch *watch, void *data);
+
+// inotify on the directory holding the config rather than the file itself, so editors that
+// save by renaming a new file over it are seen too
+struct config_watch {
+    // the inotify fd, -1 when not watching
+    struct event_source source;
+    struct event_loop *loop;
+    // the config's name within the watched directory
+    char *name;
+    config_changed_func *changed;
+    void *data;
+};
+
+// false when the directory can't be watched, e.g. it doesn't exist; the config then stays as loaded
+bool config_watch_init(struct config_watch *watch, struct event_loop *loop, config_changed_func *changed,
+        void *data);
+void config_watch_finish(struct config_watch *watch);
+
+#endif
@@ -0,0 +1,87 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "clip_item.h"
+#include "control.h"
+#include "history.h"
+
+char *control_path(void) {
+    char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    char *path;
+    if (runtime_dir != NULL && runtime_dir[0] != '\0') {
+        if (asprintf(&path, "%s/zzz.sock", runtime_dir) < 0) return NULL;
+        return path;
+    }
+    char *dir = history_dir();
+    if (dir == NULL) return NULL;
+    int result = asprintf(&path, "%s/control.sock", dir);
+    free(dir);
+    return result < 0 ? NULL : path;
+}
+
+int control_connect(void) {
+    char *path = control_path();
+    if (path == NULL) return -1;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof addr.sun_path) {
+        free(path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    free(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+        // no socket or nobody listening just means no daemon
+        if (errno != ENOENT && errno != ECONNREFUSED) perror("control socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool control_call(int fd, struct control_request *request, const char *string, struct control_reply *reply) {
+    char buf[sizeof *request + CONTROL_STRING_MAX];
+    request->length = string != NULL ? strlen(string) : 0;
+    if (request->length > CONTROL_STRING_MAX) return false;
+    memcpy(buf, request, sizeof *request);
+    if (request->length > 0) memcpy(buf + sizeof *request, string, request->length);
+    if (!write_all(fd, buf, sizeof *request + request->length)) return false;
+
+    return control_read(fd, reply, sizeof *reply);
+}
+
+bool control_read(int fd, void *buf, size_t len) {
+    char *bytes = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, bytes, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        len -= n;
+    }
+    return true;
+}
+
+char *control_status_str(uint32_t status) {
+    switch (status) {
+        case CONTROL_OK:
+            return "ok";
+        case CONTROL_NO_ENTRY:
+            return "no such clipboard entry";
+        case CONTROL_NO_MIME:
+            return "entry has no such mimetype";
+        case CONTROL_BAD_REQUEST:
+            return "bad request";
+        default:
+            return "request failed";
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// the daemon's unix socket; one request per connection, answered with one reply,
+// then the daemon closes it. all fields are native endian, both ends are on one machine
+
+enum control_op {
+    // make entry arg the selection, served by the daemon itself
+    CONTROL_SELECT = 1,
+    // up to arg of the newest entries as control_entry records, newest first
+    CONTROL_LIST = 2,
+    // entry arg's payload for the mime following the request, the first mime if there is none
+    CONTROL_FETCH = 3,
+    // entries containing the query following the request, up to arg of them as search rows
+    CONTROL_SEARCH = 4,
+    // same but matching the query's characters in order, best first
+    CONTROL_FUZZY = 5,
+};
+
+enum control_status {
+    CONTROL_OK = 0,
+    CONTROL_NO_ENTRY = 1,
+    CONTROL_NO_MIME = 2,
+    CONTROL_BAD_REQUEST = 3,
+    CONTROL_FAILED = 4,
+};
+
+// of the mime or query following a request
+#define CONTROL_STRING_MAX 1024
+// bound the reply zzz buffers for each list or search connection
+#define CONTROL_LIST_MAX 1024
+#define CONTROL_SEARCH_MAX 256
+
+struct control_request {
+    uint32_t op;
+    // of the string following the header
+    uint32_t length;
+    uint64_t arg;
+};
+
+// followed by length bytes of body
+struct control_reply {
+    uint32_t status;
+    uint32_t flags;
+    uint64_t length;
+};
+
+struct control_entry {
+    uint64_t number;
+    int64_t timestamp;
+    uint32_t n_items;
+    uint32_t flags;
+};
+
+// $XDG_RUNTIME_DIR/zzz.sock, or next to the history store without one; malloc'd
+char *control_path(void);
+// -1 without a daemon to talk to
+int control_connect(void);
+// sends the request and waits for the reply header; the body is left on fd
+bool control_call(int fd, struct control_request *request, const char *string, struct control_reply *reply);
+// all of len or false
+bool control_read(int fd, void *buf, size_t len);
+char *control_status_str(uint32_t status);
+
+#endif
@@ -0,0 +1,254 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "control_server.h"
+#include "paste.h"
+
+void control_conn_free(struct control_conn *conn) {
+    event_loop_remove(conn->server->loop, &conn->source);
+    close(conn->source.fd);
+    free(conn->out);
+    free(conn);
+}
+
+void control_conn_writable(struct event_source *source, uint32_t events);
+
+// writes what it can of the reply without blocking, the rest goes out on EPOLLOUT; the connection
+// is closed once it's all written or the client is gone
+void control_conn_flush(struct control_conn *conn) {
+    while (conn->out_offset < conn->out_len) {
+        ssize_t n = write(conn->source.fd, conn->out + conn->out_offset, conn->out_len - conn->out_offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (conn->source.callback == &control_conn_writable) return;
+            conn->source.callback = &control_conn_writable;
+            if (!event_loop_modify(conn->server->loop, &conn->source, EPOLLOUT)) control_conn_free(conn);
+            return;
+        }
+        if (n < 0) {
+            if (errno != EPIPE) perror("control reply");
+            control_conn_free(conn);
+            return;
+        }
+        conn->out_offset += n;
+    }
+    control_conn_free(conn);
+}
+
+void control_conn_writable(struct event_source *source, uint32_t events) {
+    (void) events;
+    control_conn_flush(source->data);
+}
+
+// a connection gets one reply, after which it's the reply's: conn must not be used again
+void control_reply(struct control_conn *conn, uint32_t status, void *body, uint64_t length) {
+    struct control_reply reply = {
+        .status = status,
+        .flags = 0,
+        .length = length,
+    };
+    conn->out_len = sizeof reply + length;
+    conn->out = malloc(conn->out_len);
+    memcpy(conn->out, &reply, sizeof reply);
+    if (length > 0) memcpy(conn->out + sizeof reply, body, length);
+    conn->out_offset = 0;
+    control_conn_flush(conn);
+}
+
+void control_list(struct control_conn *conn, uint64_t max) {
+    struct history_store *history = conn->server->history;
+    uint64_t count = history_count(history);
+    if (max > CONTROL_LIST_MAX) max = CONTROL_LIST_MAX;
+    if (max > count) max = count;
+
+    struct control_entry *entries = malloc(max * sizeof *entries + 1);
+    uint64_t n = 0;
+    for (uint64_t number = count; number > 0 && n < max; number--) {
+        struct history_entry_rec entry;
+        if (!history_get_entry(history, number - 1, &entry)) continue;
+        entries[n++] = (struct control_entry) {
+            .number = number - 1,
+            .timestamp = entry.timestamp,
+            .n_items = entry.n_items,
+            .flags = entry.flags,
+        };
+    }
+    control_reply(conn, CONTROL_OK, entries, n * sizeof *entries);
+    free(entries);
+}
+
+void control_search(struct control_conn *conn, struct control_request *request, char *query) {
+    struct control_server *server = conn->server;
+    uint64_t max = request->arg < CONTROL_SEARCH_MAX ? request->arg : CONTROL_SEARCH_MAX;
+    struct search_results results = {0};
+    if (request->op == CONTROL_SEARCH) {
+        search_substring(server->search, server->history, query, max, &results);
+    } else {
+        search_fuzzy(server->search, server->history, query, max, &results);
+    }
+    control_reply(conn, CONTROL_OK, results.rows, results.len);
+    search_results_free(&results);
+}
+
+// the payload goes out like any other paste, so a slow reader only holds up itself
+void control_fetch(struct control_conn *conn, struct clip *clip, char *mime) {
+    struct clip_item *item = NULL;
+    for (uint32_t i = 0; i < clip->n_items && item == NULL; i++) {
+        if (mime[0] == '\0' || strcmp(clip->items[i].mime, mime) == 0) item = &clip->items[i];
+    }
+    if (item == NULL) {
+        control_reply(conn, CONTROL_NO_MIME, NULL, 0);
+        return;
+    }
+    // the reply header goes out in front of the payload
+    struct control_reply reply = {
+        .status = CONTROL_OK,
+        .flags = 0,
+        .length = item->len,
+    };
+    struct event_loop *loop = conn->server->loop;
+    int fd = conn->source.fd;
+    event_loop_remove(loop, &conn->source);
+    free(conn);
+    paste_start(loop, clip, item, fd, &reply, sizeof reply);
+}
+
+void control_handle(struct control_conn *conn, struct control_request *request, char *string) {
+    struct control_server *server = conn->server;
+    if (request->op == CONTROL_LIST) {
+        control_list(conn, request->arg);
+        return;
+    }
+    if (request->op == CONTROL_SEARCH || request->op == CONTROL_FUZZY) {
+        control_search(conn, request, string);
+        return;
+    }
+    if (request->op != CONTROL_SELECT && request->op != CONTROL_FETCH) {
+        control_reply(conn, CONTROL_BAD_REQUEST, NULL, 0);
+        return;
+    }
+
+    struct clip *clip = clip_cache_load(server->cache, server->history, request->arg);
+    if (clip == NULL) {
+        control_reply(conn, CONTROL_NO_ENTRY, NULL, 0);
+        return;
+    }
+    if (request->op == CONTROL_FETCH) {
+        control_fetch(conn, clip, string);
+    } else {
+        control_reply(conn, server->select(clip, server->data) ? CONTROL_OK : CONTROL_FAILED, NULL, 0);
+    }
+    clip_unref(clip);
+}
+
+void control_conn_readable(struct event_source *source, uint32_t events) {
+    (void) events;
+    struct control_conn *conn = source->data;
+    ssize_t n = read(source->fd, conn->buf + conn->len, sizeof conn->buf - conn->len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (n <= 0) {
+        control_conn_free(conn);
+        return;
+    }
+    conn->len += n;
+    if (conn->len < sizeof(struct control_request)) return;
+
+    struct control_request request;
+    memcpy(&request, conn->buf, sizeof request);
+    if (request.length > CONTROL_STRING_MAX) {
+        control_reply(conn, CONTROL_BAD_REQUEST, NULL, 0);
+        return;
+    }
+    if (conn->len < sizeof request + request.length) return;
+
+    char string[CONTROL_STRING_MAX + 1];
+    memcpy(string, conn->buf + sizeof request, request.length);
+    string[request.length] = '\0';
+    control_handle(conn, &request, string);
+}
+
+void control_accept(struct event_source *source, uint32_t events) {
+    (void) events;
+    struct control_server *server = source->data;
+    int fd;
+    while ((fd = accept4(source->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        struct control_conn *conn = malloc(sizeof *conn);
+        *conn = (struct control_conn) {
+            .source = {
+                .fd = fd,
+                .callback = &control_conn_readable,
+                .data = conn,
+            },
+            .server = server,
+            .len = 0,
+            .out = NULL,
+        };
+        if (!event_loop_add(server->loop, &conn->source, EPOLLIN)) {
+            close(fd);
+            free(conn);
+        }
+    }
+    if (errno != EAGAIN && errno != EINTR) perror("control accept");
+}
+
+bool control_server_init(struct control_server *server, struct event_loop *loop, struct history_store *history,
+        struct clip_cache *cache, struct search_index *search, control_select_func *select, void *data) {
+    *server = (struct control_server) {
+        .source = {
+            .fd = -1,
+            .callback = &control_accept,
+            .data = server,
+        },
+        .loop = loop,
+        .history = history,
+        .cache = cache,
+        .search = search,
+        .select = select,
+        .data = data,
+        .path = control_path(),
+    };
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (server->path == NULL || strlen(server->path) >= sizeof addr.sun_path) {
+        fputs("no usable control socket path\n", stderr);
+        return false;
+    }
+    strcpy(addr.sun_path, server->path);
+
+    server->source.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->source.fd < 0) {
+        perror("control socket");
+        return false;
+    }
+    unlink(server->path);
+    if (bind(server->source.fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(server->source.fd, 16) < 0) {
+        perror(server->path);
+        close(server->source.fd);
+        server->source.fd = -1;
+        return false;
+    }
+    if (!event_loop_add(loop, &server->source, EPOLLIN)) {
+        close(server->source.fd);
+        unlink(server->path);
+        server->source.fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void control_server_finish(struct control_server *server) {
+    if (server->source.fd >= 0) {
+        event_loop_remove(server->loop, &server->source);
+        close(server->source.fd);
+        unlink(server->path);
+    }
+    free(server->path);
+    server->path = NULL;
+    server->source.fd = -1;
+}
@@ -0,0 +1,49 @@
+#ifndef CONTROL_SERVER_H
+#define CONTROL_SERVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "clip_cache.h"
+#include "clip_item.h"
+#include "control.h"
+#include "event_loop.h"
+#include "history.h"
+#include "search.h"
+
+// makes clip the selection; false if there is no device to set it on
+typedef bool control_select_func(struct clip *clip, void *data);
+
+// daemon end of the control socket, requests are served from the event loop
+struct control_server {
+    struct event_source source;
+    struct event_loop *loop;
+    struct history_store *history;
+    struct clip_cache *cache;
+    // kept up to date by whoever appends to history
+    struct search_index *search;
+    control_select_func *select;
+    void *data;
+    char *path;
+};
+
+// a request being read, then its reply being written; nothing blocks on a slow client, a reply
+// that doesn't fit the socket buffer waits for EPOLLOUT. fetched payloads are handed to a paste
+// writer, reply header and all
+struct control_conn {
+    struct event_source source;
+    struct control_server *server;
+    char buf[sizeof(struct control_request) + CONTROL_STRING_MAX];
+    size_t len;
+    // reply header and body, NULL until the request is answered
+    char *out;
+    size_t out_len;
+    size_t out_offset;
+};
+
+// replaces a stale socket left behind by an earlier daemon; the store lock makes sure it is stale
+bool control_server_init(struct control_server *server, struct event_loop *loop, struct history_store *history,
+        struct clip_cache *cache, struct search_index *search, control_select_func *select, void *data);
+void control_server_finish(struct control_server *server);
+
+#endif
@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debounce.h"
+#include "stats.h"
+
+// at is on the stats_now_ns clock, CLOCK_MONOTONIC
+void debounce_arm(struct debounce *debounce, uint64_t at_ns) {
+    struct itimerspec spec = {
+        .it_value = {
+            .tv_sec = at_ns / 1000000000,
+            .tv_nsec = at_ns % 1000000000,
+        },
+    };
+    // a zero it_value would disarm instead
+    if (at_ns == 0) spec.it_value.tv_nsec = 1;
+    if (timerfd_settime(debounce->source.fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) perror("timerfd_settime");
+}
+
+uint64_t debounce_deadline(struct debounce *debounce) {
+    uint64_t deadline = debounce->kicked_ns + debounce->quiet_ns;
+    if (debounce->max_ns != 0 && debounce->first_kick_ns + debounce->max_ns < deadline) {
+        deadline = debounce->first_kick_ns + debounce->max_ns;
+    }
+    return deadline;
+}
+
+void debounce_refill(struct debounce *debounce, uint64_t now) {
+    if (debounce->refill_ns == 0) {
+        debounce->tokens = debounce->burst;
+        return;
+    }
+    uint64_t earned = (now - debounce->tokens_ns) / debounce->refill_ns;
+    if (earned == 0) return;
+    if (debounce->tokens + earned >= debounce->burst) {
+        debounce->tokens = debounce->burst;
+        debounce->tokens_ns = now;
+    } else {
+        debounce->tokens += earned;
+        debounce->tokens_ns += earned * debounce->refill_ns;
+    }
+}
+
+void debounce_expired(struct event_source *source, uint32_t events) {
+    (void) events;
+    struct debounce *debounce = source->data;
+    uint64_t expirations;
+    if (read(source->fd, &expirations, sizeof expirations) < 0 || debounce->kicked_ns == 0) return;
+
+    uint64_t now = stats_now_ns();
+    // a kick can land between the timer expiring and this running
+    if (now < debounce_deadline(debounce)) {
+        debounce_arm(debounce, debounce_deadline(debounce));
+        return;
+    }
+    debounce_refill(debounce, now);
+    if (debounce->tokens == 0) {
+        debounce_arm(debounce, debounce->tokens_ns + debounce->refill_ns);
+        return;
+    }
+    debounce->tokens--;
+    debounce->kicked_ns = 0;
+    debounce->fire(debounce, debounce->data);
+}
+
+bool debounce_init(struct debounce *debounce, struct event_loop *loop, uint64_t quiet_ns, uint64_t max_ns,
+        uint32_t burst, uint64_t refill_ns, debounce_func *fire, void *data) {
+    *debounce = (struct debounce) {
+        .source = {
+            .fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC),
+            .callback = &debounce_expired,
+            .data = debounce,
+        },
+        .loop = loop,
+        .quiet_ns = quiet_ns,
+        .max_ns = max_ns,
+        .refill_ns = refill_ns,
+        .burst = burst,
+        .tokens = burst,
+        .tokens_ns = stats_now_ns(),
+        .kicked_ns = 0,
+        .first_kick_ns = 0,
+        .fire = fire,
+        .data = data,
+    };
+    if (debounce->source.fd < 0) {
+        perror("timerfd_create");
+        return false;
+    }
+    if (!event_loop_add(loop, &debounce->source, EPOLLIN)) {
+        close(debounce->source.fd);
+        debounce->source.fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void debounce_finish(struct debounce *debounce) {
+    if (debounce->source.fd < 0) return;
+    event_loop_remove(debounce->loop, &debounce->source);
+    close(debounce->source.fd);
+    debounce->source.fd = -1;
+}
+
+void debounce_kick(struct debounce *debounce) {
+    // re-arming on every kick would be a syscall per event; the expiry checks kicked_ns instead
+    bool armed = debounce->kicked_ns != 0;
+    debounce->kicked_ns = stats_now_ns();
+    if (!armed) {
+        debounce->first_kick_ns = debounce->kicked_ns;
+        debounce_arm(debounce, debounce_deadline(debounce));
+    }
+}
+
+void debounce_cancel(struct debounce *debounce) {
+    debounce->kicked_ns = 0;
+    struct itimerspec spec = {0};
+    timerfd_settime(debounce->source.fd, 0, &spec, NULL);
+}
@@ -0,0 +1,46 @@
+#ifndef DEBOUNCE_H
+#define DEBOUNCE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "event_loop.h"
+
+struct debounce;
+
+typedef void debounce_func(struct debounce *debounce, void *data);
+
+// fires once things have been quiet for quiet_ns after the last kick, however many kicks came
+// before, or max_ns after the first one if that comes sooner; firing spends a token from a
+// bucket of burst, refilled one per refill_ns, and with the bucket empty the firing waits for
+// the next token
+struct debounce {
+    // a timerfd
+    struct event_source source;
+    struct event_loop *loop;
+    uint64_t quiet_ns;
+    // 0 for no limit
+    uint64_t max_ns;
+    // 0 for no rate limit
+    uint64_t refill_ns;
+    uint32_t burst;
+    // as of tokens_ns
+    uint32_t tokens;
+    uint64_t tokens_ns;
+    // stats_now_ns of the latest kick, 0 once it fired
+    uint64_t kicked_ns;
+    // of the first kick since it last fired
+    uint64_t first_kick_ns;
+    debounce_func *fire;
+    void *data;
+};
+
+bool debounce_init(struct debounce *debounce, struct event_loop *loop, uint64_t quiet_ns, uint64_t max_ns,
+        uint32_t burst, uint64_t refill_ns, debounce_func *fire, void *data);
+void debounce_finish(struct debounce *debounce);
+// something changed, (re)starts the quiet period
+void debounce_kick(struct debounce *debounce);
+// drops a pending firing
+void debounce_cancel(struct debounce *debounce);
+
+#endif
@@ -0,0 +1,309 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+#include "uring.h"
+
+// user_data of cancellations, their completions carry nothing
+#define CANCEL_USER_DATA UINT64_MAX
+
+struct event_slot {
+    // NULL while free, and while the request of a removed source is still with the kernel
+    struct event_source *source;
+    // poll mask, 0 for a source doing reads and writes
+    uint32_t events;
+    // a poll, read or write hasn't completed yet; there's never more than one per slot
+    bool in_flight;
+    // freed along with the slot, see event_loop_abandon
+    void *orphan;
+    uint32_t next_free;
+};
+
+bool event_loop_init(struct event_loop *loop) {
+    *loop = (struct event_loop) {
+        .epoll_fd = -1,
+        .uring = NULL,
+        .running = true,
+        .n_events = 0,
+        .curr_event = 0,
+        .slots = NULL,
+        .n_slots = 0,
+        .free_slot = 0,
+    };
+    // only this thread ever submits, which lets completions wait until it asks for them
+    struct uring *uring = malloc(sizeof *uring);
+    if (uring_init(uring, EVENT_LOOP_RING_SIZE, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN)) {
+        // timed waits and never dropping a completion
+        unsigned needed = IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP;
+        if ((uring->features & needed) == needed) {
+            loop->uring = uring;
+            return true;
+        }
+        uring_finish(uring);
+    }
+    free(uring);
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("epoll_create1");
+        return false;
+    }
+    return true;
+}
+
+void event_loop_finish(struct event_loop *loop) {
+    if (loop->uring != NULL) {
+        uring_finish(loop->uring);
+        free(loop->uring);
+        loop->uring = NULL;
+        // nothing is in flight anymore
+        for (uint32_t i = 0; i < loop->n_slots; i++) {
+            free(loop->slots[i].orphan);
+        }
+        free(loop->slots);
+        loop->slots = NULL;
+        loop->n_slots = 0;
+        return;
+    }
+    close(loop->epoll_fd);
+    loop->epoll_fd = -1;
+}
+
+uint32_t slot_new(struct event_loop *loop, struct event_source *source, uint32_t events) {
+    if (loop->free_slot == loop->n_slots) {
+        uint32_t grown = loop->n_slots == 0 ? 16 : loop->n_slots * 2;
+        loop->slots = realloc(loop->slots, grown * sizeof *loop->slots);
+        for (uint32_t i = loop->n_slots; i < grown; i++) {
+            loop->slots[i] = (struct event_slot) {
+                .source = NULL,
+                .events = 0,
+                .in_flight = false,
+                .orphan = NULL,
+                .next_free = i + 1,
+            };
+        }
+        loop->free_slot = loop->n_slots;
+        loop->n_slots = grown;
+    }
+    uint32_t slot = loop->free_slot;
+    loop->free_slot = loop->slots[slot].next_free;
+    loop->slots[slot].source = source;
+    loop->slots[slot].events = events;
+    source->slot = slot;
+    return slot;
+}
+
+void slot_free(struct event_loop *loop, uint32_t slot) {
+    struct event_slot *entry = &loop->slots[slot];
+    free(entry->orphan);
+    *entry = (struct event_slot) {
+        .source = NULL,
+        .events = 0,
+        .in_flight = false,
+        .orphan = NULL,
+        .next_free = loop->free_slot,
+    };
+    loop->free_slot = slot;
+}
+
+bool slot_registered(struct event_loop *loop, struct event_source *source) {
+    return source->slot < loop->n_slots && loop->slots[source->slot].source == source;
+}
+
+struct io_uring_sqe *slot_sqe(struct event_loop *loop, uint32_t slot, uint8_t opcode) {
+    struct io_uring_sqe *sqe = uring_sqe(loop->uring);
+    if (sqe == NULL) {
+        fputs("io_uring submission queue stuck\n", stderr);
+        return NULL;
+    }
+    sqe->opcode = opcode;
+    sqe->fd = loop->slots[slot].source->fd;
+    sqe->user_data = slot;
+    loop->slots[slot].in_flight = true;
+    return sqe;
+}
+
+bool slot_arm(struct event_loop *loop, uint32_t slot) {
+    struct io_uring_sqe *sqe = slot_sqe(loop, slot, IORING_OP_POLL_ADD);
+    if (sqe == NULL) return false;
+    sqe->poll32_events = loop->slots[slot].events;
+    return true;
+}
+
+void slot_cancel(struct event_loop *loop, uint32_t slot) {
+    struct io_uring_sqe *sqe = uring_sqe(loop->uring);
+    if (sqe == NULL) {
+        fputs("io_uring submission queue stuck\n", stderr);
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = slot;
+    sqe->user_data = CANCEL_USER_DATA;
+}
+
+bool event_loop_add(struct event_loop *loop, struct event_source *source, uint32_t events) {
+    if (loop->uring != NULL) {
+        uint32_t slot = slot_new(loop, source, events);
+        if (!slot_arm(loop, slot)) {
+            slot_free(loop, slot);
+            return false;
+        }
+        return true;
+    }
+    struct epoll_event event = {
+        .events = events,
+        .data.ptr = source,
+    };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fd, &event) < 0) {
+        perror("epoll_ctl add");
+        return false;
+    }
+    return true;
+}
+
+bool event_loop_modify(struct event_loop *loop, struct event_source *source, uint32_t events) {
+    if (loop->uring != NULL) {
+        struct event_slot *slot = &loop->slots[source->slot];
+        slot->events = events;
+        // the poll completes either way, and is re-armed with the new mask then
+        if (slot->in_flight) {
+            slot_cancel(loop, source->slot);
+            return true;
+        }
+        return slot_arm(loop, source->slot);
+    }
+    struct epoll_event event = {
+        .events = events,
+        .data.ptr = source,
+    };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, source->fd, &event) < 0) {
+        perror("epoll_ctl mod");
+        return false;
+    }
+    return true;
+}
+
+void event_loop_remove(struct event_loop *loop, struct event_source *source) {
+    if (loop->uring != NULL) {
+        if (!slot_registered(loop, source)) return;
+        struct event_slot *slot = &loop->slots[source->slot];
+        slot->source = NULL;
+        // the slot is freed by the completion, any later one for it would find someone else
+        if (slot->in_flight) {
+            slot_cancel(loop, source->slot);
+        } else {
+            slot_free(loop, source->slot);
+        }
+        return;
+    }
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+    // the owner is probably about to free source, so forget any events for it
+    // still waiting in this batch
+    for (int i = loop->curr_event + 1; i < loop->n_events; i++) {
+        if (loop->events[i].data.ptr == source) {
+            loop->events[i].data.ptr = NULL;
+        }
+    }
+}
+
+void event_loop_abandon(struct event_loop *loop, struct event_source *source, void *buf) {
+    if (loop->uring != NULL && slot_registered(loop, source) && loop->slots[source->slot].in_flight) {
+        loop->slots[source->slot].orphan = buf;
+    } else {
+        free(buf);
+    }
+    event_loop_remove(loop, source);
+}
+
+bool slot_rw(struct event_loop *loop, struct event_source *source, uint8_t opcode, const void *buf, size_t len) {
+    bool registered = slot_registered(loop, source);
+    uint32_t slot = registered ? source->slot : slot_new(loop, source, 0);
+    struct io_uring_sqe *sqe = slot_sqe(loop, slot, opcode);
+    if (sqe == NULL) {
+        if (!registered) slot_free(loop, slot);
+        return false;
+    }
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    // pipes and sockets have no position, this means the current one
+    sqe->off = (uint64_t)-1;
+    return true;
+}
+
+bool event_loop_read(struct event_loop *loop, struct event_source *source, void *buf, size_t len) {
+    return slot_rw(loop, source, IORING_OP_READ, buf, len);
+}
+
+bool event_loop_write(struct event_loop *loop, struct event_source *source, const void *buf, size_t len) {
+    return slot_rw(loop, source, IORING_OP_WRITE, buf, len);
+}
+
+bool uring_dispatch(struct event_loop *loop, int timeout) {
+    int ret = uring_enter(loop->uring, 1, timeout);
+    if (ret < 0 && ret != -EINTR && ret != -ETIME && ret != -EBUSY) {
+        errno = -ret;
+        perror("io_uring_enter");
+        return false;
+    }
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek(loop->uring)) != NULL) {
+        uint64_t user_data = cqe->user_data;
+        int32_t res = cqe->res;
+        uring_seen(loop->uring);
+        if (user_data == CANCEL_USER_DATA) continue;
+
+        uint32_t slot = user_data;
+        struct event_slot *entry = &loop->slots[slot];
+        entry->in_flight = false;
+        struct event_source *source = entry->source;
+        if (source == NULL) {
+            slot_free(loop, slot);
+            continue;
+        }
+        if (entry->events == 0) {
+            source->result = res;
+            source->callback(source, EVENT_LOOP_DONE);
+            continue;
+        }
+        // cancelled by event_loop_modify, re-armed below
+        if (res != -ECANCELED) {
+            uint32_t events = res < 0 ? EPOLLERR : (uint32_t)res;
+            source->callback(source, events);
+        }
+        // slots may have moved, and the source may be gone or polled again
+        entry = &loop->slots[slot];
+        if (entry->source == source && !entry->in_flight && entry->events != 0) {
+            slot_arm(loop, slot);
+        }
+    }
+    return true;
+}
+
+bool event_loop_dispatch(struct event_loop *loop, int timeout) {
+    if (loop->uring != NULL) return uring_dispatch(loop, timeout);
+    int n = epoll_wait(loop->epoll_fd, loop->events, EVENT_LOOP_MAX_EVENTS, timeout);
+    if (n < 0) {
+        if (errno == EINTR) return true;
+        perror("epoll_wait");
+        return false;
+    }
+    loop->n_events = n;
+    for (loop->curr_event = 0; loop->curr_event < loop->n_events; loop->curr_event++) {
+        struct epoll_event *event = &loop->events[loop->curr_event];
+        struct event_source *source = event->data.ptr;
+        if (source != NULL) {
+            source->callback(source, event->events);
+        }
+    }
+    loop->n_events = 0;
+    loop->curr_event = 0;
+    return true;
+}
+
+void event_loop_stop(struct event_loop *loop) {
+    loop->running = false;
+}
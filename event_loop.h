@@ -0,0 +1,73 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define EVENT_LOOP_MAX_EVENTS 32
+#define EVENT_LOOP_RING_SIZE 256
+// passed instead of an epoll mask once a read or write has completed, see event_loop_read
+#define EVENT_LOOP_DONE (1u << 26)
+
+struct event_source;
+
+// events is the epoll event mask that fired
+typedef void event_callback(struct event_source *source, uint32_t events);
+
+// embed this in whatever owns the fd; the loop only ever holds a pointer to it
+struct event_source {
+    int fd;
+    event_callback *callback;
+    void *data;
+    // the loop's: where it keeps the source on io_uring, and what a read or write returned
+    // (bytes or -errno)
+    uint32_t slot;
+    int32_t result;
+};
+
+struct uring;
+struct event_slot;
+
+struct event_loop {
+    int epoll_fd;
+    // NULL if io_uring is unavailable, the loop then runs on epoll
+    struct uring *uring;
+    bool running;
+    // batch currently being dispatched, so sources removed mid-batch can be skipped
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    int n_events;
+    int curr_event;
+    // io_uring: what every request's user_data points back to
+    struct event_slot *slots;
+    uint32_t n_slots;
+    // chained through the free slots, n_slots when there is none
+    uint32_t free_slot;
+};
+
+// on io_uring readiness is a one-shot poll re-armed after every callback, so sources see the
+// same level-triggered events as on epoll, and adding, re-arming and removing sources costs no
+// syscalls of its own: it all goes in with the next wait
+bool event_loop_init(struct event_loop *loop);
+void event_loop_finish(struct event_loop *loop);
+bool event_loop_add(struct event_loop *loop, struct event_source *source, uint32_t events);
+bool event_loop_modify(struct event_loop *loop, struct event_source *source, uint32_t events);
+// safe to call from inside a callback, including on the source being dispatched
+void event_loop_remove(struct event_loop *loop, struct event_source *source);
+// waits up to timeout ms (-1 forever) and dispatches one batch of events
+bool event_loop_dispatch(struct event_loop *loop, int timeout);
+void event_loop_stop(struct event_loop *loop);
+
+// io_uring only (loop->uring != NULL): the read or write is done by the kernel, batched with
+// everything else, and the callback gets EVENT_LOOP_DONE with the result in source->result.
+// one at a time per source, which is registered by the first one and stays so until removed.
+// buf has to stay put until the callback; fd had better be blocking, non-blocking ones just
+// complete with -EAGAIN
+bool event_loop_read(struct event_loop *loop, struct event_source *source, void *buf, size_t len);
+bool event_loop_write(struct event_loop *loop, struct event_source *source, const void *buf, size_t len);
+// event_loop_remove for a source that may have a read or write in flight into buf: the loop
+// frees buf once the kernel is done with it
+void event_loop_abandon(struct event_loop *loop, struct event_source *source, void *buf);
+
+#endif
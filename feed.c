@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "feed.h"
+
+char *feed_path(void) {
+    char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    char *path;
+    if (runtime_dir != NULL && runtime_dir[0] != '\0') {
+        if (asprintf(&path, "%s/zzz_feed", runtime_dir) < 0) return NULL;
+        return path;
+    }
+    char *dir = history_dir();
+    if (dir == NULL) return NULL;
+    int result = asprintf(&path, "%s/feed", dir);
+    free(dir);
+    return result < 0 ? NULL : path;
+}
+
+size_t feed_size(void) {
+    return sizeof(struct feed_header) + FEED_SLOTS * sizeof(struct feed_slot);
+}
+
+bool feed_map(struct feed *feed, int fd, bool writable) {
+    feed->size = feed_size();
+    void *map = mmap(NULL, feed->size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return false;
+    feed->header = map;
+    feed->slots = (struct feed_slot *)(feed->header + 1);
+    feed->writable = writable;
+    return true;
+}
+
+bool feed_create(struct feed *feed) {
+    feed->header = NULL;
+    char *path = feed_path();
+    if (path == NULL) return false;
+    char *tmp_path;
+    if (asprintf(&tmp_path, "%s.tmp", path) < 0) {
+        free(path);
+        return false;
+    }
+    bool ok = false;
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    // zero filled, every slot is even and empty
+    if (fd < 0 || ftruncate(fd, feed_size()) < 0 || !feed_map(feed, fd, true)) {
+        perror(tmp_path);
+        goto done;
+    }
+    *feed->header = (struct feed_header) {
+        .magic = FEED_MAGIC,
+        .version = FEED_VERSION,
+        .n_slots = FEED_SLOTS,
+        .slot_size = sizeof(struct feed_slot),
+    };
+    // readers only ever find a feed that is set up
+    if (rename(tmp_path, path) < 0) {
+        perror(path);
+        munmap(feed->header, feed->size);
+        feed->header = NULL;
+        goto done;
+    }
+    ok = true;
+
+done:
+    if (fd >= 0) close(fd);
+    if (!ok) unlink(tmp_path);
+    free(tmp_path);
+    free(path);
+    return ok;
+}
+
+void feed_wake(struct feed *feed) {
+    __atomic_add_fetch(&feed->header->generation, 1, __ATOMIC_RELEASE);
+    // readers block on the shared file, so not a private futex
+    syscall(SYS_futex, &feed->header->generation, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// the entry's mimes and payload size from the store's indexes, and its preview if it has one
+bool feed_entry_load(struct history_store *store, struct preview_cache *previews, uint64_t number,
+        struct feed_entry *entry) {
+    struct history_entry_rec rec;
+    if (!history_get_entry(store, number, &rec)) return false;
+    memset(entry, 0, sizeof *entry);
+    entry->number = number;
+    entry->timestamp = rec.timestamp;
+    entry->n_mimes = rec.n_items;
+    size_t mimes_len = 0;
+    for (uint32_t i = 0; i < rec.n_items; i++) {
+        struct history_item_rec item;
+        struct history_blob_rec blob;
+        if (!history_get_item(store, rec.first_item + i, &item)) return false;
+        if (history_get_blob(store, item.blob, &blob)) {
+            uint64_t size = history_payload_size(store, &blob);
+            if (size != UINT64_MAX) entry->size += size;
+        }
+        char *mime = history_mime(store, item.mime_id);
+        if (mime == NULL) continue;
+        // one short of the end, which stays the terminating empty name
+        size_t len = strlen(mime) + 1;
+        if (len < sizeof entry->mimes - mimes_len) {
+            memcpy(entry->mimes + mimes_len, mime, len);
+            mimes_len += len;
+        }
+    }
+
+    struct preview_rec preview;
+    if (previews == NULL || !preview_get(previews, number, &preview)) return true;
+    entry->preview_kind = preview.kind;
+    entry->width = preview.width;
+    entry->height = preview.height;
+    if (preview.kind == PREVIEW_TEXT) {
+        char *text = preview_load(previews, &preview);
+        if (text == NULL) {
+            entry->preview_kind = PREVIEW_NONE;
+            return true;
+        }
+        strncpy(entry->preview, text, sizeof entry->preview - 1);
+        free(text);
+    }
+    return true;
+}
+
+void feed_write(struct feed *feed, struct feed_entry *entry) {
+    struct feed_slot *slot = &feed->slots[entry->number % FEED_SLOTS];
+    uint32_t seq = slot->seq;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    // the odd seq lands before any of the entry does
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&slot->entry, entry, sizeof *entry);
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+bool feed_publish(struct feed *feed, struct history_store *store, struct preview_cache *previews, uint64_t number) {
+    if (feed->header == NULL || number < feed->header->newest) return true;
+    if (number >= history_count(store)) return false;
+    struct feed_entry entry;
+    if (!feed_entry_load(store, previews, number, &entry)) return false;
+    feed_write(feed, &entry);
+    __atomic_store_n(&feed->header->newest, number + 1, __ATOMIC_RELEASE);
+    feed_wake(feed);
+    return true;
+}
+
+void feed_fill(struct feed *feed, struct history_store *store, struct preview_cache *previews) {
+    if (feed->header == NULL) return;
+    uint64_t count = history_count(store);
+    uint64_t number = count > FEED_SLOTS ? count - FEED_SLOTS : 0;
+    for (; number < count; number++) {
+        struct feed_entry entry;
+        if (feed_entry_load(store, previews, number, &entry)) feed_write(feed, &entry);
+    }
+    __atomic_store_n(&feed->header->newest, count, __ATOMIC_RELEASE);
+    feed_wake(feed);
+}
+
+void feed_close(struct feed *feed) {
+    if (feed->header == NULL) return;
+    if (feed->writable) {
+        __atomic_store_n(&feed->header->closed, 1, __ATOMIC_RELEASE);
+        feed_wake(feed);
+    }
+    munmap(feed->header, feed->size);
+    feed->header = NULL;
+}
+
+bool feed_open(struct feed *feed) {
+    feed->header = NULL;
+    char *path = feed_path();
+    if (path == NULL) return false;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd < 0) return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && (uint64_t)st.st_size >= feed_size() && feed_map(feed, fd, false);
+    close(fd);
+    if (!ok) return false;
+    struct feed_header *header = feed->header;
+    if (header->magic != FEED_MAGIC || header->version != FEED_VERSION || header->n_slots != FEED_SLOTS
+            || header->slot_size != sizeof(struct feed_slot)) {
+        feed_close(feed);
+        return false;
+    }
+    return true;
+}
+
+uint64_t feed_newest(struct feed *feed) {
+    return __atomic_load_n(&feed->header->newest, __ATOMIC_ACQUIRE);
+}
+
+uint32_t feed_generation(struct feed *feed) {
+    return __atomic_load_n(&feed->header->generation, __ATOMIC_ACQUIRE);
+}
+
+bool feed_closed(struct feed *feed) {
+    return __atomic_load_n(&feed->header->closed, __ATOMIC_ACQUIRE);
+}
+
+bool feed_read(struct feed *feed, uint64_t number, struct feed_entry *entry) {
+    struct feed_slot *slot = &feed->slots[number % FEED_SLOTS];
+    for (uint32_t tries = 0; tries < FEED_READ_TRIES; tries++) {
+        uint32_t before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (before % 2 == 1) continue;
+        memcpy(entry, &slot->entry, sizeof *entry);
+        // the copy is done before seq is looked at again
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == before) {
+            return before != 0 && entry->number == number;
+        }
+    }
+    return false;
+}
+
+bool feed_wait(struct feed *feed, uint32_t seen, int timeout_ms) {
+    // absolute on CLOCK_MONOTONIC, so a wait interrupted by a signal doesn't start its timeout over
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    while (feed_generation(feed) == seen) {
+        // returns at once if the generation moved on in between
+        long result = syscall(SYS_futex, &feed->header->generation, FUTEX_WAIT_BITSET, seen,
+                timeout_ms < 0 ? NULL : &deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+        if (result < 0 && errno == ETIMEDOUT) return false;
+    }
+    return true;
+}
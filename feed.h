@@ -0,0 +1,94 @@
+#ifndef FEED_H
+#define FEED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "history.h"
+#include "preview.h"
+
+// the main store's newest entries, published by zzz in a file any number of readers map read-only:
+// a status bar or picker watching the clipboard reads it with plain loads, no socket round trip and
+// no syscall per read. $XDG_RUNTIME_DIR/zzz_feed (next to the store without one) holds a feed_header
+// and FEED_SLOTS feed_slots, entry n in slot n % FEED_SLOTS. native endian, both ends are on one machine.
+// zzz only ever replaces the file whole, so a mapping never shrinks under a reader; one that finds
+// its feed closed reopens the path for the next daemon's
+
+// "zfd1"
+#define FEED_MAGIC 0x3164667a
+#define FEED_VERSION 1
+#define FEED_SLOTS 64
+#define FEED_MIMES_BYTES 512
+// a text preview and its NUL
+#define FEED_PREVIEW_BYTES (PREVIEW_TEXT_BYTES + 1)
+// attempts at a consistent copy of a slot before giving up on it; the writer holds one for a memcpy
+#define FEED_READ_TRIES 1000
+
+struct feed_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_slots;
+    uint32_t slot_size;
+    // bumped after every publish and on close, the futex readers wait on
+    uint32_t generation;
+    // set once the daemon that wrote this file is gone
+    uint32_t closed;
+    // number of the newest entry published plus one, 0 for none
+    uint64_t newest;
+};
+
+struct feed_entry {
+    uint64_t number;
+    int64_t timestamp;
+    // decoded payload bytes over all mimes
+    uint64_t size;
+    uint32_t n_mimes;
+    // a PREVIEW_*; a thumbnail is only given as its image's size
+    uint32_t preview_kind;
+    uint32_t width;
+    uint32_t height;
+    // names each followed by its NUL, as many as fit, then an empty one
+    char mimes[FEED_MIMES_BYTES];
+    // PREVIEW_TEXT only, NUL terminated
+    char preview[FEED_PREVIEW_BYTES];
+};
+
+struct feed_slot {
+    // seqlock: odd while the writer is rewriting entry; a copy is good if it saw the same even
+    // value before and after
+    uint32_t seq;
+    struct feed_entry entry;
+};
+
+struct feed {
+    // NULL when there is no feed
+    struct feed_header *header;
+    struct feed_slot *slots;
+    size_t size;
+    bool writable;
+};
+
+// malloc'd
+char *feed_path(void);
+// zzz's end, a fresh empty feed replacing any at feed_path
+bool feed_create(struct feed *feed);
+// entry number as the store and previews have it, both only read; previews may be NULL.
+// an entry no newer than the newest published is left alone
+bool feed_publish(struct feed *feed, struct history_store *store, struct preview_cache *previews, uint64_t number);
+// the store's newest FEED_SLOTS entries
+void feed_fill(struct feed *feed, struct history_store *store, struct preview_cache *previews);
+// a writable feed is marked closed and its readers woken first
+void feed_close(struct feed *feed);
+
+// a reader's read-only mapping; false if there is none or it is from an incompatible zzz
+bool feed_open(struct feed *feed);
+uint64_t feed_newest(struct feed *feed);
+uint32_t feed_generation(struct feed *feed);
+bool feed_closed(struct feed *feed);
+// a consistent copy; false once the slot holds another entry, or the writer stalled mid-update
+bool feed_read(struct feed *feed, uint64_t number, struct feed_entry *entry);
+// until the generation moves past seen, or timeout_ms passes (-1 waits for good); false on timeout
+bool feed_wait(struct feed *feed, uint32_t seen, int timeout_ms);
+
+#endif
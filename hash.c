@@ -0,0 +1,124 @@
+#include <string.h>
+
+#include "hash.h"
+
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3 1609587929392839161ULL
+#define P4 9650029242287828579ULL
+#define P5 2870177450012600261ULL
+
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * P2;
+    acc = rotl(acc, 31);
+    return acc * P1;
+}
+
+static uint64_t merge_round(uint64_t acc, uint64_t val) {
+    acc ^= round64(0, val);
+    return acc * P1 + P4;
+}
+
+void hash_init(struct hash_state *state) {
+    *state = (struct hash_state) {
+        .v = { P1 + P2, P2, 0, -P1 },
+        .total_len = 0,
+        .buf_len = 0,
+    };
+}
+
+static void consume_stripe(struct hash_state *state, const unsigned char *p) {
+    for (int i = 0; i < 4; i++) {
+        state->v[i] = round64(state->v[i], read64(p + i * 8));
+    }
+}
+
+void hash_update(struct hash_state *state, const void *data, size_t len) {
+    const unsigned char *p = data;
+    state->total_len += len;
+
+    if (state->buf_len + len < 32) {
+        memcpy(state->buf + state->buf_len, p, len);
+        state->buf_len += len;
+        return;
+    }
+    if (state->buf_len > 0) {
+        size_t fill = 32 - state->buf_len;
+        memcpy(state->buf + state->buf_len, p, fill);
+        consume_stripe(state, state->buf);
+        p += fill;
+        len -= fill;
+        state->buf_len = 0;
+    }
+    while (len >= 32) {
+        consume_stripe(state, p);
+        p += 32;
+        len -= 32;
+    }
+    memcpy(state->buf, p, len);
+    state->buf_len = len;
+}
+
+uint64_t hash_digest(struct hash_state *state) {
+    uint64_t h;
+    if (state->total_len >= 32) {
+        h = rotl(state->v[0], 1) + rotl(state->v[1], 7) + rotl(state->v[2], 12) + rotl(state->v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = merge_round(h, state->v[i]);
+        }
+    } else {
+        h = P5;
+    }
+    h += state->total_len;
+
+    const unsigned char *p = state->buf;
+    size_t len = state->buf_len;
+    while (len >= 8) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * P1 + P4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        h ^= (uint64_t)read32(p) * P1;
+        h = rotl(h, 23) * P2 + P3;
+        p += 4;
+        len -= 4;
+    }
+    while (len > 0) {
+        h ^= *p * P5;
+        h = rotl(h, 11) * P1;
+        p++;
+        len--;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t hash_bytes(const void *data, size_t len) {
+    struct hash_state state;
+    hash_init(&state);
+    hash_update(&state, data, len);
+    return hash_digest(&state);
+}
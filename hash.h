@@ -0,0 +1,20 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// streaming XXH64, so payloads can be hashed chunk by chunk as they arrive
+struct hash_state {
+    uint64_t v[4];
+    uint64_t total_len;
+    unsigned char buf[32];
+    size_t buf_len;
+};
+
+void hash_init(struct hash_state *state);
+void hash_update(struct hash_state *state, const void *data, size_t len);
+uint64_t hash_digest(struct hash_state *state);
+uint64_t hash_bytes(const void *data, size_t len);
+
+#endif
@@ -0,0 +1,1106 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#include "clip_item.h"
+#include "codec.h"
+#include "history.h"
+
+#define COPY_CHUNK (64 * 1024)
+// not worth a zstd frame header
+#define COMPRESS_MIN 64
+// spilled payloads are big enough that speed matters more than ratio
+#define ZSTD_LEVEL 3
+#define ZSTD_LEVEL_SPILLED 1
+
+char *history_dir(void) {
+    char *state_dir = getenv("XDG_STATE_HOME");
+    char *suffix = "/zzz_clip";
+    if (state_dir == NULL || state_dir[0] == '\0') {
+        char *home = getenv("HOME");
+        if (home == NULL) {
+            fputs("neither $XDG_STATE_HOME nor $HOME set\n", stderr);
+            return NULL;
+        }
+        char *state_suffix = "/.local/state";
+        char *final = malloc(strlen(home) + strlen(state_suffix) + strlen(suffix) + 1);
+        final[0] = '\0';
+        strcat(final, home);
+        strcat(final, state_suffix);
+        strcat(final, suffix);
+        return final;
+    } else {
+        char *final = malloc(strlen(state_dir) + strlen(suffix) + 1);
+        final[0] = '\0';
+        strcat(final, state_dir);
+        strcat(final, suffix);
+        return final;
+    }
+}
+
+char *history_primary_dir(void) {
+    char *dir = history_dir();
+    if (dir == NULL) return NULL;
+    char *primary;
+    if (asprintf(&primary, "%s/primary", dir) < 0) primary = NULL;
+    free(dir);
+    return primary;
+}
+
+char *history_seat_dir(const char *seat) {
+    char *dir = history_dir();
+    if (dir == NULL) return NULL;
+    char *seat_dir;
+    if (asprintf(&seat_dir, "%s/seats/%s", dir, seat) < 0) {
+        free(dir);
+        return NULL;
+    }
+    // the name comes from the compositor, keep it a single path component
+    char *name = seat_dir + strlen(dir) + strlen("/seats/");
+    if (name[0] == '.') name[0] = '_';
+    for (char *c = name; *c != '\0'; c++) {
+        if (*c == '/') *c = '_';
+    }
+    free(dir);
+    return seat_dir;
+}
+
+// mkdir -p
+bool make_dirs(char *path) {
+    char *copy = strdup(path);
+    for (char *slash = strchr(copy + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(copy, 0700) < 0 && errno != EEXIST) {
+            perror(copy);
+            free(copy);
+            return false;
+        }
+        *slash = '/';
+    }
+    free(copy);
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+bool pwrite_all(int fd, void *data, size_t len, uint64_t offset) {
+    char *bytes = data;
+    while (len > 0) {
+        ssize_t written = pwrite(fd, bytes, len, offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        bytes += written;
+        len -= written;
+        offset += written;
+    }
+    return true;
+}
+
+uint64_t fd_size(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) return 0;
+    return st.st_size;
+}
+
+void history_load_mimes(struct history_store *store) {
+    for (uint32_t i = 0; i < store->n_mimes; i++) {
+        free(store->mimes[i]);
+    }
+    store->n_mimes = 0;
+
+    uint64_t size = fd_size(store->mimes_fd);
+    char *text = malloc(size + 1);
+    ssize_t text_len = pread(store->mimes_fd, text, size, 0);
+    if (text_len < 0) text_len = 0;
+    text[text_len] = '\0';
+
+    char *line = text;
+    char *newline;
+    // a line without a newline is a torn write, ignore it
+    while ((newline = strchr(line, '\n')) != NULL) {
+        if (store->n_mimes == store->mimes_capacity) {
+            store->mimes_capacity = store->mimes_capacity == 0 ? 16 : store->mimes_capacity * 2;
+            store->mimes = realloc(store->mimes, store->mimes_capacity * sizeof *store->mimes);
+        }
+        store->mimes[store->n_mimes++] = strndup(line, newline - line);
+        line = newline + 1;
+    }
+    free(text);
+}
+
+// dup'd fds share the directory position, start every listing from the top
+DIR *history_opendir(struct history_store *store) {
+    DIR *dir = fdopendir(dup(store->dir_fd));
+    if (dir != NULL) rewinddir(dir);
+    return dir;
+}
+
+int open_segment(struct history_store *store, uint32_t segment, int flags) {
+    char name[32];
+    snprintf(name, sizeof name, "seg.%u", segment);
+    int fd = openat(store->dir_fd, name, flags | O_CLOEXEC, 0600);
+    if (fd < 0) perror(name);
+    return fd;
+}
+
+// newest segment on disk, so appends continue where the last run left off
+bool history_newest_segment(struct history_store *store, uint32_t *newest) {
+    DIR *dir = history_opendir(store);
+    if (dir == NULL) {
+        perror(store->dir);
+        return false;
+    }
+    *newest = 0;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        unsigned segment;
+        if (sscanf(dirent->d_name, "seg.%u", &segment) == 1 && segment > *newest) {
+            *newest = segment;
+        }
+    }
+    closedir(dir);
+    return true;
+}
+
+bool history_open_write_segment(struct history_store *store) {
+    uint32_t newest;
+    if (!history_newest_segment(store, &newest)) return false;
+    store->write_segment = newest;
+    store->write_fd = open_segment(store, newest, O_RDWR | O_CREAT);
+    if (store->write_fd < 0) return false;
+    // anything past the newest blob's payload is from an append that never committed
+    store->write_offset = 0;
+    struct history_blob_rec blob;
+    if (store->n_blobs > 0 && history_get_blob(store, store->n_blobs - 1, &blob) && blob.segment == newest) {
+        store->write_offset = blob.offset + blob.length;
+    }
+    if (fd_size(store->write_fd) > store->write_offset && ftruncate(store->write_fd, store->write_offset) < 0) {
+        perror("history segment");
+        return false;
+    }
+    return true;
+}
+
+#define NO_BLOB UINT64_MAX
+
+void blob_table_insert(struct blob_table *table, uint64_t hash, uint64_t blob);
+
+void blob_table_grow(struct blob_table *table) {
+    struct blob_table old = *table;
+    table->capacity = old.capacity == 0 ? 1024 : old.capacity * 2;
+    table->count = 0;
+    table->hashes = malloc(table->capacity * sizeof *table->hashes);
+    table->blobs = malloc(table->capacity * sizeof *table->blobs);
+    for (size_t i = 0; i < table->capacity; i++) {
+        table->blobs[i] = NO_BLOB;
+    }
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (old.blobs[i] != NO_BLOB) blob_table_insert(table, old.hashes[i], old.blobs[i]);
+    }
+    free(old.hashes);
+    free(old.blobs);
+}
+
+void blob_table_insert(struct blob_table *table, uint64_t hash, uint64_t blob) {
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        blob_table_grow(table);
+    }
+    size_t mask = table->capacity - 1;
+    size_t i = hash & mask;
+    while (table->blobs[i] != NO_BLOB) {
+        i = (i + 1) & mask;
+    }
+    table->hashes[i] = hash;
+    table->blobs[i] = blob;
+    table->count++;
+}
+
+void blob_table_free(struct blob_table *table) {
+    free(table->hashes);
+    free(table->blobs);
+    *table = (struct blob_table) {0};
+}
+
+bool history_load_blobs(struct history_store *store) {
+    store->n_blobs = fd_size(store->blobs_fd) / sizeof(struct history_blob_rec);
+    size_t batch = 4096;
+    struct history_blob_rec *recs = malloc(batch * sizeof *recs);
+    for (uint64_t start = 0; start < store->n_blobs; start += batch) {
+        size_t n = store->n_blobs - start < batch ? store->n_blobs - start : batch;
+        if (pread(store->blobs_fd, recs, n * sizeof *recs, start * sizeof *recs) != (ssize_t)(n * sizeof *recs)) {
+            perror("history blobs");
+            free(recs);
+            return false;
+        }
+        for (size_t i = 0; i < n; i++) {
+            blob_table_insert(&store->blob_table, recs[i].hash, start + i);
+        }
+    }
+    free(recs);
+    return true;
+}
+
+// full byte compare, hashes only narrow down the candidates
+bool blob_matches(struct history_store *store, struct history_blob_rec *blob, struct clip_item *item) {
+    struct history_reader reader;
+    if (!history_reader_open(store, blob, &reader)) return false;
+    // sizes settle most mismatches without decoding anything
+    if (reader.size != item->len) {
+        history_reader_close(&reader);
+        return false;
+    }
+
+    char *stored = store->scratch;
+    char *incoming = store->scratch + COPY_CHUNK;
+    bool matches = true;
+    uint64_t off = 0;
+    while (matches) {
+        ssize_t n = history_reader_read(&reader, stored, COPY_CHUNK);
+        if (n <= 0) {
+            matches = n == 0 && off == item->len;
+            break;
+        }
+        if (off + n > item->len) {
+            matches = false;
+            break;
+        }
+        char *other = incoming;
+        if (item->data != NULL) {
+            other = item->data + off;
+        } else if (pread(item->fd, incoming, n, off) != n) {
+            matches = false;
+            break;
+        }
+        matches = memcmp(stored, other, n) == 0;
+        off += n;
+    }
+    history_reader_close(&reader);
+    return matches;
+}
+
+uint64_t history_find_blob(struct history_store *store, struct clip_item *item) {
+    struct blob_table *table = &store->blob_table;
+    if (table->capacity == 0) return NO_BLOB;
+    size_t mask = table->capacity - 1;
+    for (size_t i = item->hash & mask; table->blobs[i] != NO_BLOB; i = (i + 1) & mask) {
+        if (table->hashes[i] != item->hash) continue;
+        struct history_blob_rec blob;
+        if (history_get_blob(store, table->blobs[i], &blob) && blob_matches(store, &blob, item)) {
+            return table->blobs[i];
+        }
+    }
+    return NO_BLOB;
+}
+
+// malloc'd contents of a file in the store
+char *read_store_file(struct history_store *store, char *name, size_t *len) {
+    int fd = openat(store->dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(name);
+        return NULL;
+    }
+    *len = fd_size(fd);
+    char *contents = malloc(*len + 1);
+    bool ok = pread(fd, contents, *len, 0) == (ssize_t)*len;
+    close(fd);
+    if (!ok) {
+        perror(name);
+        free(contents);
+        return NULL;
+    }
+    return contents;
+}
+
+// highest n of the dict.<n> files, false if there are none
+bool history_newest_dict(struct history_store *store, uint32_t *newest) {
+    DIR *dir = history_opendir(store);
+    if (dir == NULL) return false;
+    bool found = false;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        unsigned n;
+        if (sscanf(dirent->d_name, "dict.%u", &n) == 1 && (!found || n > *newest)) {
+            *newest = n;
+            found = true;
+        }
+    }
+    closedir(dir);
+    return found;
+}
+
+// the newest dictionary keeps compressing text where the last run left off
+bool history_load_cdict(struct history_store *store) {
+    uint32_t newest;
+    if (!history_newest_dict(store, &newest)) return true;
+    store->next_dict = newest + 1;
+    char name[32];
+    snprintf(name, sizeof name, "dict.%u", newest);
+    size_t len;
+    char *dict = read_store_file(store, name, &len);
+    if (dict == NULL) return false;
+    store->cdict = ZSTD_createCDict(dict, len, ZSTD_LEVEL);
+    free(dict);
+    return store->cdict != NULL;
+}
+
+// writes the next dict.<n> and compresses text with it from now on
+void history_train_dict(struct history_store *store) {
+    size_t len;
+    char *dict = dict_trainer_train(&store->trainer, &len);
+    if (dict == NULL) return;
+    char name[32];
+    snprintf(name, sizeof name, "dict.%u", store->next_dict);
+    int fd = openat(store->dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool ok = fd >= 0 && pwrite_all(fd, dict, len, 0);
+    // the frames compressed with it are no use without it
+    ok = ok && (store->sync == HISTORY_SYNC_NONE || fdatasync(fd) == 0);
+    if (fd >= 0) close(fd);
+    store->dir_unsynced = true;
+    if (!ok) {
+        // frames referring to a dictionary that isn't on disk could never be read back
+        perror(name);
+        unlinkat(store->dir_fd, name, 0);
+        free(dict);
+        return;
+    }
+    ZSTD_CDict *cdict = ZSTD_createCDict(dict, len, ZSTD_LEVEL);
+    free(dict);
+    if (cdict == NULL) return;
+    ZSTD_freeCDict(store->cdict);
+    store->cdict = cdict;
+    store->next_dict++;
+}
+
+// NULL if no dictionary in the store has that id
+ZSTD_DDict *history_ddict(struct history_store *store, unsigned id) {
+    for (uint32_t i = 0; i < store->n_dicts; i++) {
+        if (store->dicts[i].id == id) return store->dicts[i].ddict;
+    }
+    // a dictionary written since the last look, load whatever is new
+    DIR *dir = history_opendir(store);
+    if (dir == NULL) return NULL;
+    ZSTD_DDict *found = NULL;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        unsigned n;
+        if (sscanf(dirent->d_name, "dict.%u", &n) != 1) continue;
+        size_t len;
+        char *dict = read_store_file(store, dirent->d_name, &len);
+        if (dict == NULL) continue;
+        unsigned dict_id = ZSTD_getDictID_fromDict(dict, len);
+        bool known = false;
+        for (uint32_t i = 0; i < store->n_dicts; i++) {
+            known = known || store->dicts[i].id == dict_id;
+        }
+        ZSTD_DDict *ddict = known ? NULL : ZSTD_createDDict(dict, len);
+        free(dict);
+        if (ddict == NULL) continue;
+        store->dicts = realloc(store->dicts, (store->n_dicts + 1) * sizeof *store->dicts);
+        store->dicts[store->n_dicts++] = (struct history_dict) {.id = dict_id, .ddict = ddict};
+        if (dict_id == id) found = ddict;
+    }
+    closedir(dir);
+    return found;
+}
+
+// its record header is in the segment and the payload runs to where the header says
+bool blob_intact(struct history_store *store, struct history_blob_rec *blob, uint32_t newest) {
+    if (blob->segment > newest) return false;
+    int fd = history_segment_fd(store, blob->segment);
+    struct history_record_header header;
+    uint64_t size = fd >= 0 ? fd_size(fd) : 0;
+    return fd >= 0 && blob->offset >= sizeof header && blob->length <= size && blob->offset <= size - blob->length
+        && pread(fd, &header, sizeof header, blob->offset - sizeof header) == sizeof header
+        && header.magic == HISTORY_RECORD_MAGIC && header.length == blob->length;
+}
+
+// number is the entry's own; items are appended in entry order, so it starts where the one
+// before it ends
+bool entry_intact(struct history_store *store, uint64_t number, struct history_entry_rec *entry, uint64_t n_items,
+        uint64_t n_blobs, uint32_t newest) {
+    struct history_entry_rec prev;
+    uint64_t prev_end = 0;
+    if (number > 0) {
+        if (!history_get_entry(store, number - 1, &prev)) return false;
+        prev_end = prev.first_item + prev.n_items;
+    }
+    if (entry->first_item != prev_end) return false;
+    // garbage in either field mustn't wrap around
+    if (entry->first_item > n_items || entry->n_items > n_items - entry->first_item) return false;
+    for (uint32_t i = 0; i < entry->n_items; i++) {
+        struct history_item_rec item;
+        struct history_blob_rec blob;
+        if (!history_get_item(store, entry->first_item + i, &item) || item.mime_id >= store->n_mimes
+                || item.blob >= n_blobs || !history_get_blob(store, item.blob, &blob)
+                || !blob_intact(store, &blob, newest)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool truncate_to(int fd, uint64_t size, uint64_t *trimmed) {
+    uint64_t old_size = fd_size(fd);
+    if (old_size <= size) return true;
+    *trimmed += old_size - size;
+    return ftruncate(fd, size) == 0;
+}
+
+// writeback doesn't go in order, so after a crash any file can end in a torn record or miss
+// what another one points at; entries are dropped newest first until one is whole, and every
+// index is cut back to what is left. the write segment is cut in history_open_write_segment
+bool history_recover(struct history_store *store) {
+    // a torn blob record can name any segment
+    uint32_t newest;
+    if (!history_newest_segment(store, &newest)) return false;
+    uint64_t n_items = fd_size(store->items_fd) / sizeof(struct history_item_rec);
+    uint64_t n_blobs = fd_size(store->blobs_fd) / sizeof(struct history_blob_rec);
+    uint64_t dropped = 0;
+    struct history_entry_rec last;
+    while (store->n_entries > 0) {
+        if (history_get_entry(store, store->n_entries - 1, &last) && entry_intact(store, store->n_entries - 1, &last, n_items, n_blobs, newest)) {
+            break;
+        }
+        store->n_entries--;
+        dropped++;
+    }
+    // items past the last committed entry belong to an append that never finished
+    store->n_items = store->n_entries > 0 ? last.first_item + last.n_items : 0;
+    // a blob needn't be used by an entry, one the segment lost would only fail to match
+    struct history_blob_rec blob;
+    while (n_blobs > 0 && !(history_get_blob(store, n_blobs - 1, &blob) && blob_intact(store, &blob, newest))) {
+        n_blobs--;
+    }
+
+    // a mime line without its newline was never used, and the next one would be appended to it
+    uint64_t mimes_len = 0;
+    for (uint32_t i = 0; i < store->n_mimes; i++) {
+        mimes_len += strlen(store->mimes[i]) + 1;
+    }
+    uint64_t trimmed = 0;
+    bool ok = truncate_to(store->entries_fd, store->n_entries * sizeof(struct history_entry_rec), &trimmed)
+        && truncate_to(store->items_fd, store->n_items * sizeof(struct history_item_rec), &trimmed)
+        && truncate_to(store->blobs_fd, n_blobs * sizeof(struct history_blob_rec), &trimmed)
+        && truncate_to(store->mimes_fd, mimes_len, &trimmed);
+    if (!ok) {
+        perror("history recovery");
+        return false;
+    }
+    if (dropped > 0 || trimmed > 0) {
+        fprintf(stderr, "%s: dropped %llu torn entries, %llu bytes\n", store->dir, (unsigned long long)dropped,
+                (unsigned long long)trimmed);
+    }
+    return true;
+}
+
+bool history_sync_data(struct history_store *store) {
+    if (fdatasync(store->write_fd) < 0 || fdatasync(store->blobs_fd) < 0 || fdatasync(store->items_fd) < 0
+            || fdatasync(store->mimes_fd) < 0) {
+        return false;
+    }
+    // new segments and dictionaries have to be findable too
+    if (store->dir_unsynced && fsync(store->dir_fd) < 0) return false;
+    store->dir_unsynced = false;
+    return true;
+}
+
+bool history_sync(struct history_store *store) {
+    if (!store->writable || !store->unsynced) return true;
+    if (!history_sync_data(store) || fdatasync(store->entries_fd) < 0) {
+        perror("history sync");
+        return false;
+    }
+    store->unsynced = false;
+    return true;
+}
+
+bool history_open(struct history_store *store, char *dir, bool writable) {
+    *store = (struct history_store) {
+        .dir = strdup(dir),
+        .dir_fd = -1,
+        .writable = writable,
+        .entries_fd = -1,
+        .items_fd = -1,
+        .blobs_fd = -1,
+        .mimes_fd = -1,
+        .write_fd = -1,
+        .scratch = malloc(HISTORY_SCRATCH),
+        .sync = HISTORY_SYNC_NONE,
+        .unsynced = false,
+        .dir_unsynced = false,
+    };
+
+    if (writable && !make_dirs(dir)) goto fail;
+    store->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (store->dir_fd < 0) {
+        perror(dir);
+        goto fail;
+    }
+    if (writable && flock(store->dir_fd, LOCK_EX | LOCK_NB) < 0) {
+        fprintf(stderr, "%s is already in use by another zzz\n", dir);
+        goto fail;
+    }
+
+    int flags = (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC;
+    store->entries_fd = openat(store->dir_fd, "entries", flags, 0600);
+    store->items_fd = openat(store->dir_fd, "items", flags, 0600);
+    store->blobs_fd = openat(store->dir_fd, "blobs", flags, 0600);
+    store->mimes_fd = openat(store->dir_fd, "mimes", flags | (writable ? O_APPEND : 0), 0600);
+    if (store->entries_fd < 0 || store->items_fd < 0 || store->blobs_fd < 0 || store->mimes_fd < 0) {
+        perror("history index");
+        goto fail;
+    }
+
+    store->n_entries = fd_size(store->entries_fd) / sizeof(struct history_entry_rec);
+    store->n_items = fd_size(store->items_fd) / sizeof(struct history_item_rec);
+    history_load_mimes(store);
+
+    if (writable) {
+        if (!history_recover(store)) goto fail;
+        if (!history_load_blobs(store)) goto fail;
+        if (!history_open_write_segment(store)) goto fail;
+        store->cctx = ZSTD_createCCtx();
+        if (store->cctx == NULL || !history_load_cdict(store)) goto fail;
+    }
+    return true;
+
+fail:
+    history_close(store);
+    return false;
+}
+
+void history_close(struct history_store *store) {
+    if (store->sync != HISTORY_SYNC_NONE) history_sync(store);
+    if (store->dir_fd >= 0) close(store->dir_fd);
+    if (store->entries_fd >= 0) close(store->entries_fd);
+    if (store->items_fd >= 0) close(store->items_fd);
+    if (store->blobs_fd >= 0) close(store->blobs_fd);
+    if (store->mimes_fd >= 0) close(store->mimes_fd);
+    if (store->write_fd >= 0) close(store->write_fd);
+    for (uint32_t i = 0; i < store->n_segment_fds; i++) {
+        if (store->segment_fds[i] >= 0) close(store->segment_fds[i]);
+    }
+    free(store->segment_fds);
+    for (uint32_t i = 0; i < store->n_mimes; i++) {
+        free(store->mimes[i]);
+    }
+    free(store->mimes);
+    free(store->dir);
+    blob_table_free(&store->blob_table);
+    ZSTD_freeCCtx(store->cctx);
+    ZSTD_freeCDict(store->cdict);
+    dict_trainer_free(&store->trainer);
+    for (uint32_t i = 0; i < store->n_dicts; i++) {
+        ZSTD_freeDDict(store->dicts[i].ddict);
+    }
+    free(store->dicts);
+    free(store->scratch);
+    *store = (struct history_store) {
+        .dir_fd = -1,
+        .entries_fd = -1,
+        .items_fd = -1,
+        .blobs_fd = -1,
+        .mimes_fd = -1,
+        .write_fd = -1,
+    };
+}
+
+bool history_intern_mime(struct history_store *store, char *mime, uint32_t *mime_id) {
+    // only a handful of distinct mimes ever show up, a scan is fine
+    for (uint32_t i = 0; i < store->n_mimes; i++) {
+        if (strcmp(store->mimes[i], mime) == 0) {
+            *mime_id = i;
+            return true;
+        }
+    }
+    size_t len = strlen(mime);
+    char *line = malloc(len + 1);
+    memcpy(line, mime, len);
+    line[len] = '\n';
+    bool ok = write_all(store->mimes_fd, line, len + 1);
+    free(line);
+    if (!ok) {
+        perror("history mimes");
+        return false;
+    }
+    if (store->n_mimes == store->mimes_capacity) {
+        store->mimes_capacity = store->mimes_capacity == 0 ? 16 : store->mimes_capacity * 2;
+        store->mimes = realloc(store->mimes, store->mimes_capacity * sizeof *store->mimes);
+    }
+    *mime_id = store->n_mimes;
+    store->mimes[store->n_mimes++] = strdup(mime);
+    return true;
+}
+
+bool history_roll_segment(struct history_store *store) {
+    int fd = open_segment(store, store->write_segment + 1, O_RDWR | O_CREAT | O_TRUNC);
+    if (fd < 0) return false;
+    // history_sync only knows the current one
+    if (store->sync != HISTORY_SYNC_NONE && store->unsynced && fdatasync(store->write_fd) < 0) {
+        perror("history segment");
+        close(fd);
+        return false;
+    }
+    store->dir_unsynced = true;
+    close(store->write_fd);
+    store->write_fd = fd;
+    store->write_segment++;
+    store->write_offset = 0;
+    return true;
+}
+
+// copy_file_range keeps the payload in the kernel; memfds on older kernels need the fallback
+// buf is COPY_CHUNK bytes
+bool copy_fd_payload(int in_fd, uint64_t in_offset, size_t len, int out_fd, uint64_t out_offset, char *buf) {
+    loff_t in_off = in_offset;
+    loff_t in_end = in_offset + len;
+    loff_t out_off = out_offset;
+    while (in_off < in_end) {
+        ssize_t copied = copy_file_range(in_fd, &in_off, out_fd, &out_off, in_end - in_off, 0);
+        if (copied > 0) continue;
+        if (copied < 0 && errno == EINTR) continue;
+        if (copied == 0 || (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)) {
+            return false;
+        }
+
+        while (in_off < in_end) {
+            size_t want = in_end - in_off < COPY_CHUNK ? (size_t)(in_end - in_off) : COPY_CHUNK;
+            ssize_t n = pread(in_fd, buf, want, in_off);
+            if (n <= 0 || !pwrite_all(out_fd, buf, n, out_off)) return false;
+            in_off += n;
+            out_off += n;
+        }
+    }
+    return true;
+}
+
+// streams src into the write segment at offset as one zstd frame; false if that failed or
+// the frame was on its way to outgrowing src, whatever was written is left for the caller
+bool history_compress(struct history_store *store, struct clip_item *item, const char *src,
+        bool use_dict, uint64_t offset, uint64_t *written) {
+    ZSTD_CCtx *cctx = store->cctx;
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, item->data != NULL ? ZSTD_LEVEL : ZSTD_LEVEL_SPILLED);
+    // readers find the dictionary by the id in the frame
+    if (use_dict) ZSTD_CCtx_refCDict(cctx, store->cdict);
+    ZSTD_CCtx_setPledgedSrcSize(cctx, item->len);
+
+    char *out_buf = store->scratch;
+    ZSTD_inBuffer in = {src, item->len, 0};
+    *written = 0;
+    size_t remaining;
+    do {
+        ZSTD_outBuffer out = {out_buf, HISTORY_SCRATCH, 0};
+        remaining = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_end);
+        if (ZSTD_isError(remaining)) {
+            fprintf(stderr, "compressing %s: %s\n", item->mime, ZSTD_getErrorName(remaining));
+            return false;
+        }
+        if (!pwrite_all(store->write_fd, out_buf, out.pos, offset + *written)) return false;
+        *written += out.pos;
+        if (*written >= item->len) return false;
+    } while (remaining != 0);
+    return true;
+}
+
+bool history_write_blob(struct history_store *store, struct clip_item *item, uint64_t *blob_id) {
+    // the raw size bounds the record, a compressed payload is only kept if smaller
+    uint64_t max_record_len = sizeof(struct history_record_header) + item->len;
+    if (store->write_offset > 0 && store->write_offset + max_record_len > HISTORY_SEGMENT_MAX) {
+        if (!history_roll_segment(store)) return false;
+    }
+
+    struct history_record_header header = {
+        .magic = HISTORY_RECORD_MAGIC,
+        .flags = CODEC_RAW,
+        .length = item->len,
+    };
+    struct history_blob_rec blob = {
+        .segment = store->write_segment,
+        .offset = store->write_offset + sizeof header,
+        .length = item->len,
+        .hash = item->hash,
+    };
+
+    const char *src = item->data;
+    if (src == NULL && item->len >= COMPRESS_MIN) {
+        // a spilled payload is compressed straight out of its memfd
+        void *map = mmap(NULL, item->len, PROT_READ, MAP_PRIVATE, item->fd, 0);
+        if (map != MAP_FAILED) src = map;
+    }
+    bool compressed = false;
+    if (src != NULL && item->len >= COMPRESS_MIN) {
+        enum payload_class class = payload_class(item->mime, (const unsigned char *)src,
+                item->len < CODEC_MAGIC_LEN ? item->len : CODEC_MAGIC_LEN);
+        if (class == PAYLOAD_TEXT) {
+            dict_trainer_add(&store->trainer, src, item->len);
+            if (dict_trainer_ready(&store->trainer, store->cdict != NULL)) history_train_dict(store);
+        }
+        uint64_t written;
+        if (class != PAYLOAD_COMPRESSED) {
+            // anything short of 1/16 smaller isn't worth decoding on every paste
+            compressed = history_compress(store, item, src,
+                    class == PAYLOAD_TEXT && item->data != NULL && store->cdict != NULL, blob.offset, &written)
+                && written <= item->len - item->len / 16;
+        }
+        if (compressed) {
+            header.flags = CODEC_ZSTD;
+            header.length = written;
+            blob.length = written;
+        }
+    }
+    if (src != NULL && src != item->data) munmap((void *)src, item->len);
+
+    bool ok = true;
+    if (!compressed && item->data != NULL) {
+        ok = pwrite_all(store->write_fd, item->data, item->len, blob.offset);
+    } else if (!compressed) {
+        ok = copy_fd_payload(item->fd, 0, item->len, store->write_fd, blob.offset, store->scratch);
+    }
+    // a rejected frame may have run past the end of the raw payload
+    if (ok && !compressed && fd_size(store->write_fd) > blob.offset + item->len) {
+        ok = ftruncate(store->write_fd, blob.offset + item->len) == 0;
+    }
+    ok = ok && pwrite_all(store->write_fd, &header, sizeof header, store->write_offset);
+    ok = ok && pwrite_all(store->blobs_fd, &blob, sizeof blob, store->n_blobs * sizeof blob);
+    if (!ok) return false;
+
+    store->write_offset += sizeof header + blob.length;
+    *blob_id = store->n_blobs++;
+    blob_table_insert(&store->blob_table, blob.hash, *blob_id);
+    return true;
+}
+
+// same mimes pointing at the same blobs, in the same order
+bool history_is_newest(struct history_store *store, struct history_item_rec *items, uint32_t n_items) {
+    struct history_entry_rec newest;
+    if (store->n_entries == 0 || !history_get_entry(store, store->n_entries - 1, &newest)) return false;
+    if (newest.n_items != n_items) return false;
+    for (uint32_t i = 0; i < n_items; i++) {
+        struct history_item_rec item;
+        if (!history_get_item(store, newest.first_item + i, &item)) return false;
+        if (item.blob != items[i].blob || item.mime_id != items[i].mime_id) return false;
+    }
+    return true;
+}
+
+bool history_append(struct history_store *store, struct clip_item *items, uint32_t n_items,
+        int64_t timestamp, uint64_t *number) {
+    if (!store->writable) return false;
+
+    struct history_item_rec *item_recs = malloc(n_items * sizeof *item_recs + 1);
+
+    // look everything up first, a re-copy of the newest entry writes nothing at all
+    bool all_stored = true;
+    for (uint32_t i = 0; i < n_items; i++) {
+        struct clip_item *item = &items[i];
+        item_recs[i].flags = 0;
+        item_recs[i].blob = history_find_blob(store, item);
+        if (!history_intern_mime(store, item->mime, &item_recs[i].mime_id)) goto fail;
+        if (item_recs[i].blob == NO_BLOB) all_stored = false;
+    }
+    if (all_stored && history_is_newest(store, item_recs, n_items)) {
+        *number = store->n_entries - 1;
+        free(item_recs);
+        return true;
+    }
+
+    for (uint32_t i = 0; i < n_items; i++) {
+        if (item_recs[i].blob != NO_BLOB) continue;
+        if (!history_write_blob(store, &items[i], &item_recs[i].blob)) goto fail;
+    }
+    if (n_items > 0 && !pwrite_all(store->items_fd, item_recs, n_items * sizeof *item_recs,
+                store->n_items * sizeof *item_recs)) {
+        goto fail;
+    }
+    store->unsynced = true;
+    // write-ahead: everything the entry points at is on disk before the entry is written
+    if (store->sync == HISTORY_SYNC_EVERY && !history_sync_data(store)) goto fail;
+
+    struct history_entry_rec entry = {
+        .first_item = store->n_items,
+        .n_items = n_items,
+        .flags = 0,
+        .timestamp = timestamp,
+    };
+    if (!pwrite_all(store->entries_fd, &entry, sizeof entry, store->n_entries * sizeof entry)) {
+        goto fail;
+    }
+    if (store->sync == HISTORY_SYNC_EVERY) {
+        if (fdatasync(store->entries_fd) < 0) goto fail;
+        store->unsynced = false;
+    }
+    free(item_recs);
+    store->n_items += n_items;
+    *number = store->n_entries++;
+    return true;
+
+fail:
+    perror("history append");
+    free(item_recs);
+    return false;
+}
+
+void history_refresh(struct history_store *store) {
+    if (store->writable) return;
+    store->n_entries = fd_size(store->entries_fd) / sizeof(struct history_entry_rec);
+    store->n_items = fd_size(store->items_fd) / sizeof(struct history_item_rec);
+    store->n_blobs = fd_size(store->blobs_fd) / sizeof(struct history_blob_rec);
+}
+
+uint64_t history_count(struct history_store *store) {
+    if (!store->writable) {
+        store->n_entries = fd_size(store->entries_fd) / sizeof(struct history_entry_rec);
+    }
+    return store->n_entries;
+}
+
+bool history_get_entry(struct history_store *store, uint64_t number, struct history_entry_rec *entry) {
+    if (number >= store->n_entries && number >= history_count(store)) return false;
+    return pread(store->entries_fd, entry, sizeof *entry, number * sizeof *entry) == sizeof *entry;
+}
+
+bool history_get_item(struct history_store *store, uint64_t idx, struct history_item_rec *item) {
+    return pread(store->items_fd, item, sizeof *item, idx * sizeof *item) == sizeof *item;
+}
+
+bool history_get_blob(struct history_store *store, uint64_t blob, struct history_blob_rec *blob_rec) {
+    return pread(store->blobs_fd, blob_rec, sizeof *blob_rec, blob * sizeof *blob_rec) == sizeof *blob_rec;
+}
+
+char *history_mime(struct history_store *store, uint32_t mime_id) {
+    if (mime_id >= store->n_mimes) {
+        // added by the daemon after we loaded them
+        history_load_mimes(store);
+        if (mime_id >= store->n_mimes) return NULL;
+    }
+    return store->mimes[mime_id];
+}
+
+uint64_t history_disk_usage(struct history_store *store) {
+    uint64_t total = fd_size(store->entries_fd) + fd_size(store->items_fd)
+        + fd_size(store->blobs_fd) + fd_size(store->mimes_fd);
+    DIR *dir = history_opendir(store);
+    if (dir == NULL) return total;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        unsigned n;
+        struct stat st;
+        if ((sscanf(dirent->d_name, "seg.%u", &n) == 1 || sscanf(dirent->d_name, "dict.%u", &n) == 1)
+                && fstatat(store->dir_fd, dirent->d_name, &st, 0) == 0) {
+            total += st.st_size;
+        }
+    }
+    closedir(dir);
+    return total;
+}
+
+int history_segment_fd(struct history_store *store, uint32_t segment) {
+    if (segment >= store->n_segment_fds) {
+        store->segment_fds = realloc(store->segment_fds, (segment + 1) * sizeof *store->segment_fds);
+        for (uint32_t i = store->n_segment_fds; i <= segment; i++) {
+            store->segment_fds[i] = -1;
+        }
+        store->n_segment_fds = segment + 1;
+    }
+    if (store->segment_fds[segment] < 0) {
+        store->segment_fds[segment] = open_segment(store, segment, O_RDONLY);
+    }
+    return store->segment_fds[segment];
+}
+
+// next chunk of the stored payload into the input buffer
+bool history_reader_fill(struct history_reader *reader) {
+    size_t want = reader->end - reader->offset < reader->in_capacity
+        ? reader->end - reader->offset : reader->in_capacity;
+    ssize_t n = pread(reader->segment_fd, reader->in_buf, want, reader->offset);
+    if (n <= 0) return false;
+    reader->offset += n;
+    reader->in = (ZSTD_inBuffer) {reader->in_buf, n, 0};
+    return true;
+}
+
+bool history_reader_open(struct history_store *store, struct history_blob_rec *blob, struct history_reader *reader) {
+    *reader = (struct history_reader) {
+        .store = store,
+        .offset = blob->offset,
+        .end = blob->offset + blob->length,
+    };
+    reader->segment_fd = history_segment_fd(store, blob->segment);
+    if (reader->segment_fd < 0) return false;
+
+    struct history_record_header header;
+    if (pread(reader->segment_fd, &header, sizeof header, blob->offset - sizeof header) != sizeof header
+            || header.magic != HISTORY_RECORD_MAGIC || header.length != blob->length) {
+        fputs("corrupt history record\n", stderr);
+        return false;
+    }
+    reader->codec = header.flags & HISTORY_RECORD_CODEC;
+    reader->size = blob->length;
+    if (reader->codec == CODEC_RAW) return true;
+    if (reader->codec != CODEC_ZSTD) {
+        fprintf(stderr, "unknown history codec %u\n", reader->codec);
+        return false;
+    }
+
+    reader->dctx = ZSTD_createDCtx();
+    reader->in_capacity = ZSTD_DStreamInSize();
+    reader->in_buf = malloc(reader->in_capacity);
+    if (reader->dctx == NULL || !history_reader_fill(reader)) goto fail;
+    // always there, the writer pledges the size up front
+    reader->size = ZSTD_getFrameContentSize(reader->in.src, reader->in.size);
+    if (reader->size == ZSTD_CONTENTSIZE_UNKNOWN || reader->size == ZSTD_CONTENTSIZE_ERROR) {
+        fputs("corrupt history payload\n", stderr);
+        goto fail;
+    }
+    unsigned dict_id = ZSTD_getDictID_fromFrame(reader->in.src, reader->in.size);
+    if (dict_id != 0) {
+        ZSTD_DDict *ddict = history_ddict(store, dict_id);
+        if (ddict == NULL) {
+            fprintf(stderr, "missing history dictionary %u\n", dict_id);
+            goto fail;
+        }
+        ZSTD_DCtx_refDDict(reader->dctx, ddict);
+    }
+    return true;
+
+fail:
+    history_reader_close(reader);
+    return false;
+}
+
+ssize_t history_reader_read(struct history_reader *reader, void *buf, size_t len) {
+    if (reader->codec == CODEC_RAW) {
+        size_t want = reader->end - reader->offset < len ? reader->end - reader->offset : len;
+        if (want == 0) return 0;
+        ssize_t n = pread(reader->segment_fd, buf, want, reader->offset);
+        if (n <= 0) return -1;
+        reader->offset += n;
+        return n;
+    }
+
+    if (reader->done) return 0;
+    ZSTD_outBuffer out = {buf, len, 0};
+    while (out.pos == 0) {
+        // out of input before the frame ended means a truncated payload
+        if (reader->in.pos == reader->in.size && !history_reader_fill(reader)) return -1;
+        size_t result = ZSTD_decompressStream(reader->dctx, &out, &reader->in);
+        if (ZSTD_isError(result)) {
+            fprintf(stderr, "corrupt history payload: %s\n", ZSTD_getErrorName(result));
+            return -1;
+        }
+        if (result == 0) {
+            reader->done = true;
+            break;
+        }
+    }
+    return out.pos;
+}
+
+void history_reader_close(struct history_reader *reader) {
+    ZSTD_freeDCtx(reader->dctx);
+    free(reader->in_buf);
+    reader->dctx = NULL;
+    reader->in_buf = NULL;
+}
+
+uint64_t history_payload_size(struct history_store *store, struct history_blob_rec *blob) {
+    int segment_fd = history_segment_fd(store, blob->segment);
+    if (segment_fd < 0) return UINT64_MAX;
+    struct {
+        struct history_record_header header;
+        char frame[ZSTD_FRAMEHEADERSIZE_MAX];
+    } record;
+    size_t want = sizeof record.header + (blob->length < sizeof record.frame ? blob->length : sizeof record.frame);
+    if (pread(segment_fd, &record, want, blob->offset - sizeof record.header) != (ssize_t)want
+            || record.header.magic != HISTORY_RECORD_MAGIC) {
+        return UINT64_MAX;
+    }
+    if ((record.header.flags & HISTORY_RECORD_CODEC) == CODEC_RAW) return blob->length;
+    unsigned long long size = ZSTD_getFrameContentSize(record.frame, want - sizeof record.header);
+    return size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ? UINT64_MAX : size;
+}
+
+// decodes one payload into item the way a capture would have left it: inline up to
+// SPILL_THRESHOLD, in a memfd past that
+bool history_load_payload(struct history_store *store, struct history_blob_rec *blob, struct clip_item *item) {
+    struct history_reader reader;
+    if (!history_reader_open(store, blob, &reader)) return false;
+    item->len = reader.size;
+
+    bool ok;
+    if (reader.size <= SPILL_THRESHOLD) {
+        item->data = malloc(reader.size + 1);
+        size_t len = 0;
+        ssize_t n = 1;
+        while (len < reader.size && (n = history_reader_read(&reader, item->data + len, reader.size - len)) > 0) {
+            len += n;
+        }
+        ok = len == reader.size;
+    } else {
+        item->fd = memfd_create("zzz_clip", MFD_CLOEXEC);
+        if (item->fd < 0) {
+            perror("memfd_create");
+            ok = false;
+        } else if (reader.codec == CODEC_RAW) {
+            ok = copy_fd_payload(reader.segment_fd, reader.offset, reader.size, item->fd, 0, store->scratch);
+        } else {
+            char *buf = store->scratch;
+            uint64_t len = 0;
+            ssize_t n;
+            while ((n = history_reader_read(&reader, buf, COPY_CHUNK)) > 0 && pwrite_all(item->fd, buf, n, len)) {
+                len += n;
+            }
+            ok = n == 0 && len == reader.size;
+        }
+    }
+    history_reader_close(&reader);
+    return ok;
+}
+
+struct clip *history_load_clip(struct history_store *store, uint64_t number) {
+    struct history_entry_rec entry;
+    if (!history_get_entry(store, number, &entry)) return NULL;
+
+    struct clip *clip = clip_new();
+    clip->items = arena_alloc(&clip->arena, entry.n_items * sizeof *clip->items + 1);
+    for (uint32_t i = 0; i < entry.n_items; i++) {
+        struct history_item_rec item;
+        struct history_blob_rec blob;
+        char *mime;
+        if (!history_get_item(store, entry.first_item + i, &item) || !history_get_blob(store, item.blob, &blob)
+                || (mime = history_mime(store, item.mime_id)) == NULL) {
+            fputs("corrupt history index\n", stderr);
+            goto fail;
+        }
+        struct clip_item *clip_item = &clip->items[clip->n_items++];
+        *clip_item = (struct clip_item) {
+            .mime = arena_strdup(&clip->arena, mime),
+            .data = NULL,
+            .fd = -1,
+            .len = 0,
+            .hash = blob.hash,
+        };
+        if (!history_load_payload(store, &blob, clip_item)) goto fail;
+    }
+    return clip;
+
+fail:
+    clip_unref(clip);
+    return NULL;
+}
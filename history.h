@@ -0,0 +1,193 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <zstd.h>
+
+#include "clip_item.h"
+#include "codec.h"
+
+// a new segment is started once the current one would grow past this
+#define HISTORY_SEGMENT_MAX ((uint64_t)64 * 1024 * 1024)
+// per store buffer for copying and compressing payloads
+#define HISTORY_SCRATCH (128 * 1024)
+// "zzzr"
+#define HISTORY_RECORD_MAGIC 0x727a7a7a
+// record header flags holding the CODEC_* the payload is stored with
+#define HISTORY_RECORD_CODEC 0xff
+
+// the store is a directory holding
+//   seg.<n>  append-only logs of (record header, payload)
+//   blobs    fixed-width history_blob_rec, one per distinct payload
+//   items    fixed-width history_item_rec, one per stored mime, pointing at a blob
+//   entries  fixed-width history_entry_rec indexed by entry number
+//   mimes    newline separated mime strings, the id is the line number
+//   dict.<n> zstd dictionaries trained on stored text, the newest one is used for writing
+// an entry only exists once its entries record is written, so that is the commit point.
+// a sync makes everything else durable before the entries; what a crash tears anyway is cut
+// off when the store is next opened for writing, with the entries that pointed at it.
+// payloads are content addressed: an item whose payload is already stored points at the existing
+// blob, nothing else is written for it. blobs aren't counted or freed, segments are never collected
+// payloads are zstd compressed unless that doesn't pay off, readers go through history_reader
+// a store must only be used from one thread at a time; a writer and read-only stores on the same
+// directory can be used side by side, which is how zzz_get reads while zzz appends
+
+struct history_entry_rec {
+    uint64_t first_item;
+    uint32_t n_items;
+    uint32_t flags;
+    int64_t timestamp;
+};
+
+struct history_item_rec {
+    uint64_t blob;
+    uint32_t mime_id;
+    uint32_t flags;
+};
+
+struct history_blob_rec {
+    uint32_t segment;
+    // zero, keeps offset 8 byte aligned on disk
+    uint32_t reserved;
+    // of the payload itself, past the record header
+    uint64_t offset;
+    // as stored, the decoded size of a compressed payload is in its zstd frame
+    uint64_t length;
+    // of the decoded payload
+    uint64_t hash;
+};
+
+// in front of every payload in a segment, lets a segment be walked without the index
+struct history_record_header {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t length;
+};
+
+// hash -> blob id, open addressing; only the writer keeps one
+struct blob_table {
+    uint64_t *hashes;
+    uint64_t *blobs;
+    size_t capacity;
+    size_t count;
+};
+
+enum history_sync {
+    // left to the kernel's writeback, a crash can take the last half a minute or so
+    HISTORY_SYNC_NONE,
+    // appends are durable once history_sync is called, one sync for however many there were
+    HISTORY_SYNC_BATCH,
+    // each append is durable by the time history_append returns
+    HISTORY_SYNC_EVERY,
+};
+
+// loaded for reading, frames name their dictionary by zstd dict id
+struct history_dict {
+    unsigned id;
+    ZSTD_DDict *ddict;
+};
+
+struct history_store {
+    char *dir;
+    int dir_fd;
+    bool writable;
+    int entries_fd;
+    int items_fd;
+    int blobs_fd;
+    int mimes_fd;
+    uint64_t n_entries;
+    uint64_t n_items;
+    uint64_t n_blobs;
+    struct blob_table blob_table;
+    char **mimes;
+    uint32_t n_mimes;
+    uint32_t mimes_capacity;
+    // opened lazily for reading, indexed by segment number, -1 if not open yet
+    int *segment_fds;
+    uint32_t n_segment_fds;
+    // segment being appended to, writable stores only
+    int write_fd;
+    uint32_t write_segment;
+    uint64_t write_offset;
+    // compression, writable stores only
+    ZSTD_CCtx *cctx;
+    // NULL until enough text has been seen to train one
+    ZSTD_CDict *cdict;
+    uint32_t next_dict;
+    struct dict_trainer trainer;
+    struct history_dict *dicts;
+    uint32_t n_dicts;
+    // HISTORY_SCRATCH bytes
+    char *scratch;
+    // writable stores, NONE unless set after opening
+    enum history_sync sync;
+    // appended to, or a file created in dir, since the last sync
+    bool unsynced;
+    bool dir_unsynced;
+};
+
+// streams one payload out of the store, decoding it on the way
+struct history_reader {
+    struct history_store *store;
+    int segment_fd;
+    uint32_t codec;
+    // next stored byte to read and the end of the payload, segment offsets
+    uint64_t offset;
+    uint64_t end;
+    // decoded
+    uint64_t size;
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer in;
+    char *in_buf;
+    size_t in_capacity;
+    bool done;
+};
+
+// $XDG_STATE_HOME/zzz_clip, malloc'd
+char *history_dir(void);
+// the primary selection's own store inside history_dir, malloc'd
+char *history_primary_dir(void);
+// the store of a seat other than the first one zzz bound, inside history_dir, malloc'd;
+// its primary selection goes in a primary dir inside that
+char *history_seat_dir(const char *seat);
+// a writable store creates dir if needed and takes an exclusive lock on it
+bool history_open(struct history_store *store, char *dir, bool writable);
+void history_close(struct history_store *store);
+
+// items are stored in order; their hash must be filled in.
+// a clip identical to the newest entry is not stored again, number is set to that entry
+bool history_append(struct history_store *store, struct clip_item *items, uint32_t n_items,
+        int64_t timestamp, uint64_t *number);
+
+// everything appended so far, payloads and index records first and the entries that commit
+// them last; a no-op if nothing was
+bool history_sync(struct history_store *store);
+
+// a read-only store picks up the counts a writer has appended since; no-op on writable ones
+void history_refresh(struct history_store *store);
+// picks up entries appended by another process since the last call
+uint64_t history_count(struct history_store *store);
+bool history_get_entry(struct history_store *store, uint64_t number, struct history_entry_rec *entry);
+bool history_get_item(struct history_store *store, uint64_t idx, struct history_item_rec *item);
+bool history_get_blob(struct history_store *store, uint64_t blob, struct history_blob_rec *blob_rec);
+// NULL if the id is unknown
+char *history_mime(struct history_store *store, uint32_t mime_id);
+// bytes on disk across the indexes and every segment
+uint64_t history_disk_usage(struct history_store *store);
+// read-only fd for the segment; owned by the store
+int history_segment_fd(struct history_store *store, uint32_t segment);
+
+// a CODEC_RAW reader's payload can also be read straight from segment_fd between offset and end
+bool history_reader_open(struct history_store *store, struct history_blob_rec *blob, struct history_reader *reader);
+// like read(2): 0 once the payload is done, -1 if it is unreadable or corrupt
+ssize_t history_reader_read(struct history_reader *reader, void *buf, size_t len);
+void history_reader_close(struct history_reader *reader);
+// decoded size from the record alone, without setting up a reader; UINT64_MAX if unreadable
+uint64_t history_payload_size(struct history_store *store, struct history_blob_rec *blob);
+
+// the entry's items decoded into a fresh clip, NULL if there is no such entry
+struct clip *history_load_clip(struct history_store *store, uint64_t number);
+
+#endif
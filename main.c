@@ -1,86 +1,181 @@
-#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include <wayland-util.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 
+#include "arena.h"
+#include "capture.h"
+#include "clip_cache.h"
+#include "config_watch.h"
+#include "control_server.h"
+#include "debounce.h"
+#include "event_loop.h"
+#include "feed.h"
+#include "history.h"
+#include "mime_matcher.h"
+#include "paste.h"
+#include "preview.h"
 #include "read_config.h"
+#include "search.h"
+#include "stats.h"
+#include "thumbnail.h"
+#include "uring.h"
+#include "worker.h"
 #include "wlr-data-control-protocol.h"
-#include "zzz_list.h"
+
+// primary selection captures allowed back to back, after that one per refill
+#define PRIMARY_BURST 3
+#define PRIMARY_REFILL_NS (2 * 1000000000ull)
+// appends are made durable together at most this long after the first of them
+#define SYNC_WINDOW_DEFAULT_NS (1000 * 1000000ull)
 
 struct config_opts {
     bool replace;
+    // bytes of decoded clips kept in memory
+    uint64_t cache_budget;
+    // across the mimes of one capture, 0 for no limit
+    uint64_t clip_budget;
+    // how long the primary selection has to stay put before it is captured, 0 to ignore it
+    uint64_t primary_quiet_ns;
+    // for every store written; with HISTORY_SYNC_BATCH, appends are synced sync_window_ns after
+    // the first one since the last sync
+    enum history_sync sync;
+    uint64_t sync_window_ns;
     struct mime_pref pref;
+    // pref compiled down, what actually runs on every selection
+    struct mime_matcher matcher;
 };
 
 struct wl_display *display;
 struct config_opts config;
+struct event_loop event_loop;
+// only ever appended to from the main seat's worker lane
+struct history_store history;
+// read-only on the same directory, for the dispatch thread: control socket, cache, search and stats
+struct history_store history_view;
+// appends, and whatever goes with them, run here rather than between Wayland events
+struct worker_pool workers;
+// next to history, written along with it
+struct preview_cache previews;
+// the main store's newest entries for status bars and pickers; filled from history_view and
+// previews on the dispatch thread, previews only being pread there
+struct feed feed;
+// only open with -p
+struct history_store primary_history;
+// recent entries, decoded, for zzz_get requests coming in over the control socket
+struct clip_cache clip_cache;
+struct control_server control_server;
+struct config_watch config_watch;
+struct search_index search_index;
+// where SIGUSR1 dumps the stats
+char *stats_file;
+// selections zzz has set and the compositor hasn't cancelled yet, released at exit
+struct zzz_list *live_sources;
+
+// an offer and everything derived from it lives in one arena, dropped in one go
+struct offer_state {
+    struct zwlr_data_control_offer_v1 *offer;
+    struct arena arena;
+    // in offer order
+    char **mimes;
+    uint32_t n_mimes;
+    uint32_t mimes_capacity;
+};
+
+struct offer_state *offer_state_new(struct zwlr_data_control_offer_v1 *offer) {
+    struct offer_state *offer_state = malloc(sizeof *offer_state);
+    *offer_state = (struct offer_state) {
+        .offer = offer,
+        .mimes = NULL,
+        .n_mimes = 0,
+        .mimes_capacity = 0,
+    };
+    arena_init(&offer_state->arena);
+    return offer_state;
+}
+
+void offer_state_free(struct offer_state *offer_state) {
+    if (offer_state == NULL) return;
+    zwlr_data_control_offer_v1_destroy(offer_state->offer);
+    arena_free(&offer_state->arena);
+    free(offer_state);
+}
 
 void offer_new_offer(void *data, struct zwlr_data_control_offer_v1 *offer, const char *mime) {
-    struct zzz_list **current_mimes = data;
+    struct offer_state *offer_state = data;
     (void) offer;
 
-    char *mime_cpy = malloc(strlen(mime) + 1);
-    strcpy(mime_cpy, mime);
-    zzz_list_prepend(current_mimes, mime_cpy);
+    if (offer_state->n_mimes == offer_state->mimes_capacity) {
+        // the old array stays in the arena, at most doubling what it uses
+        uint32_t capacity = offer_state->mimes_capacity == 0 ? 16 : offer_state->mimes_capacity * 2;
+        char **mimes = arena_alloc(&offer_state->arena, capacity * sizeof *mimes);
+        if (offer_state->n_mimes > 0) {
+            memcpy(mimes, offer_state->mimes, offer_state->n_mimes * sizeof *mimes);
+        }
+        offer_state->mimes = mimes;
+        offer_state->mimes_capacity = capacity;
+    }
+    offer_state->mimes[offer_state->n_mimes++] = arena_strdup(&offer_state->arena, mime);
 }
 
 struct zwlr_data_control_offer_v1_listener offer_listener = {
     .offer = &offer_new_offer,
 };
 
+struct device_state;
+
 struct registry_objs {
-    struct wl_seat *seat;
-    uint32_t seat_name;
     struct zwlr_data_control_manager_v1 *data_control_manager;
     uint32_t data_control_manager_name;
-    struct zwlr_data_control_device_v1 *device;
-};
-
-struct clip_item {
-    char *mime;
-    char *data;
-    size_t len;
+    // of struct device_state, one per seat
+    struct zzz_list *seats;
+    // the first seat bound, which owns the main store; NULL once it is gone
+    struct device_state *main_seat;
+    // seats bound so far, spreads their stores over the worker lanes
+    uint32_t n_seats_bound;
 };
 
-void free_clip_item_void(void *clip_item_void) {
-    struct clip_item *clip_item = clip_item_void;
-    free(clip_item->mime);
-    free(clip_item->data);
-    free(clip_item);
-}
-
 void source_send(void *data, struct zwlr_data_control_source_v1 *source, const char *mime_type, int32_t fd) {
     (void) source;
-    (void) mime_type;
-    struct zzz_list *items = data;
-    while (items != NULL) {
-        struct clip_item *item = items->value;
+    struct clip *clip = data;
+    for (uint32_t i = 0; i < clip->n_items; i++) {
+        struct clip_item *item = &clip->items[i];
         if (strcmp(item->mime, mime_type) == 0) {
-            // TODO partial writes?
-            write(fd, item->data, item->len);
-            break;
+            // finished from the event loop if the target can't take it all at once
+            paste_start(&event_loop, clip, item, fd, NULL, 0);
+            return;
         }
-
-        items = items->next;
     }
     // close without sending if invalid mime type
     close(fd);
 }
 
 void source_cancelled(void *data, struct zwlr_data_control_source_v1 *source) {
-    struct zzz_list *items = data;
-    zzz_list_free(items, free_clip_item_void);
+    struct clip *clip = data;
+    clip_unref(clip);
+    for (struct zzz_list **curr = &live_sources; *curr != NULL; curr = &(*curr)->next) {
+        if ((*curr)->value == source) {
+            struct zzz_list *next = (*curr)->next;
+            free(*curr);
+            *curr = next;
+            break;
+        }
+    }
     zwlr_data_control_source_v1_destroy(source);
 }
 
@@ -89,134 +184,488 @@ struct zwlr_data_control_source_v1_listener source_listener = {
     .cancelled = &source_cancelled
 };
 
+// everything per seat, so seats never share capture or supersede state
 struct device_state {
     struct registry_objs *registry_objs;
+    struct wl_seat *seat;
+    // registry name of the wl_seat global
+    uint32_t seat_global;
+    // from the seat's name event, malloc'd
+    char *seat_name;
+    struct zwlr_data_control_device_v1 *device;
+    // the main store for the main seat, which the control socket, cache and search index serve;
+    // history_seat_dir for the others. NULL until the seat is named
+    struct history_store *history;
+    // NULL without -p
+    struct history_store *primary_history;
+    // history's, NULL along with it; the primary selection is only ever text
+    struct preview_cache *previews;
+    // worker lane both stores are appended on
+    uint32_t lane;
     // offer that has not been set to primary/selection yet
-    struct zwlr_data_control_offer_v1 *pending_offer;
-    struct zzz_list *pending_offer_mimes;
-    struct zwlr_data_control_offer_v1 *selection_offer;
-    struct zzz_list *selection_offer_mimes;
+    struct offer_state *pending_offer;
+    struct offer_state *selection_offer;
     // data from the last valid selection offer
-    // list of clip_items
-    struct zzz_list *saved_items;
+    struct clip *saved_clip;
+    // receive still in flight for the latest selection offer
+    struct capture *capture;
+    // selection was cleared while capturing; replace once the capture lands
+    bool replace_pending;
+    // latest primary selection offer, captured once primary_debounce fires
+    struct offer_state *primary_offer;
+    struct capture *primary_capture;
+    // last one stored, so selecting the same text again doesn't add an entry
+    struct clip *primary_clip;
+    // fd -1 without -p
+    struct debounce primary_debounce;
+    // appended to since the last sync was queued; only with HISTORY_SYNC_BATCH
+    bool history_unsynced;
+    bool primary_unsynced;
+    // fd -1 unless syncing in batches
+    struct debounce sync_debounce;
 };
 
 void device_data_offer(void *data, struct zwlr_data_control_device_v1 *device, struct zwlr_data_control_offer_v1 *offer) {
     (void) device;
     struct device_state *state = data;
 
-    state->pending_offer = offer;
-    state->pending_offer_mimes = NULL;
-    zwlr_data_control_offer_v1_add_listener(offer, &offer_listener, &state->pending_offer_mimes);
+    // never claimed by a selection event
+    offer_state_free(state->pending_offer);
+    state->pending_offer = offer_state_new(offer);
+    zwlr_data_control_offer_v1_add_listener(offer, &offer_listener, state->pending_offer);
+}
+
+// we become the source; the clip is held until the cancelled event
+void set_selection(struct device_state *state, struct clip *clip) {
+    struct zwlr_data_control_source_v1 *source =
+        zwlr_data_control_manager_v1_create_data_source(state->registry_objs->data_control_manager);
+    for (uint32_t i = 0; i < clip->n_items; i++) {
+        zwlr_data_control_source_v1_offer(source, clip->items[i].mime);
+    }
+    zwlr_data_control_source_v1_add_listener(source, &source_listener, clip_ref(clip));
+    zwlr_data_control_device_v1_set_selection(state->device, source);
+    zzz_list_prepend(&live_sources, source);
+}
+
+void replace_selection(struct device_state *state) {
+    // assume client closed; fill clipboard
+    set_selection(state, state->saved_clip);
+    // this is now the source's responsibility, freed on cancelled event
+    clip_unref(state->saved_clip);
+    state->saved_clip = NULL;
+}
+
+// a capture on its way into a store; the clip reference is the job's own, the worker only reads
+// through it and it is dropped back on the dispatch thread, so refcounts stay single threaded
+struct store_job {
+    struct worker_job job;
+    struct history_store *store;
+    // NULL for none
+    struct preview_cache *previews;
+    struct clip *clip;
+    int64_t timestamp;
+    bool primary;
+    // filled in by the worker
+    // clip's items with every hash finished; a copy, the dispatch thread reads clip meanwhile
+    struct clip_item *items;
+    bool stored;
+    uint64_t number;
+    uint64_t store_ns;
+    bool previewed;
+    uint64_t preview_ns;
+    // set for a new entry in the main store
+    bool indexed;
+    struct search_entry search;
+};
+
+void store_job_run(struct worker_job *job) {
+    struct store_job *store_job = (struct store_job *)job;
+    struct clip *clip = store_job->clip;
+    uint64_t store_start = stats_now_ns();
+    store_job->items = malloc(clip->n_items * sizeof *store_job->items + 1);
+    memcpy(store_job->items, clip->items, clip->n_items * sizeof *store_job->items);
+    bool hashed = true;
+    for (uint32_t i = 0; i < clip->n_items && hashed; i++) {
+        hashed = clip_item_finish_hash(&store_job->items[i]);
+    }
+    uint64_t count = history_count(store_job->store);
+    store_job->stored = hashed && history_append(store_job->store, store_job->items, clip->n_items,
+            store_job->timestamp, &store_job->number);
+    // a re-copy of the newest entry comes back with its number and adds nothing to index
+    if (store_job->stored && store_job->store == &history && store_job->number == count) {
+        search_prepare(store_job->store, store_job->number, &store_job->search);
+        store_job->indexed = true;
+    }
+    uint64_t preview_start = stats_now_ns();
+    store_job->store_ns = preview_start - store_start;
+    if (store_job->stored && store_job->previews != NULL && store_job->number == count) {
+        struct preview preview;
+        if (thumbnail_make(clip, &preview) || preview_text(clip, &preview)) {
+            store_job->previewed = preview_put(store_job->previews, store_job->number, &preview);
+        }
+        preview_free(&preview);
+        store_job->preview_ns = stats_now_ns() - preview_start;
+    }
+}
+
+void store_job_done(struct worker_job *job) {
+    struct store_job *store_job = (struct store_job *)job;
+    struct clip *clip = store_job->clip;
+    for (uint32_t i = 0; i < clip->n_items; i++) {
+        if (store_job->items[i].partial_hash == NULL) clip->items[i] = store_job->items[i];
+    }
+    free(store_job->items);
+    if (store_job->primary) {
+        if (store_job->stored) {
+            stats.primary_stored++;
+        } else {
+            fputs("failed to save primary selection entry\n", stderr);
+        }
+    } else {
+        histogram_add(&stats.store_ns, store_job->store_ns);
+        if (store_job->previewed) {
+            stats.previews++;
+            histogram_add(&stats.preview_ns, store_job->preview_ns);
+        }
+        if (store_job->stored) {
+            stats.captures_stored++;
+        } else {
+            fputs("failed to save clipboard entry\n", stderr);
+        }
+    }
+    if (store_job->stored && store_job->store == &history) {
+        clip_cache_put(&clip_cache, store_job->number, store_job->clip);
+        feed_publish(&feed, &history_view, &previews, store_job->number);
+        if (!store_job->indexed || !search_add(&search_index, &store_job->search)) {
+            search_update(&search_index, &history_view);
+        }
+    }
+    if (store_job->indexed) search_entry_free(&store_job->search);
+    clip_unref(store_job->clip);
+    free(store_job);
+}
+
+void store_clip(struct device_state *state, struct history_store *store, struct clip *clip, bool primary) {
+    if (state->sync_debounce.source.fd >= 0) {
+        if (primary) {
+            state->primary_unsynced = true;
+        } else {
+            state->history_unsynced = true;
+        }
+        debounce_kick(&state->sync_debounce);
+    }
+    struct store_job *job = malloc(sizeof *job);
+    *job = (struct store_job) {
+        .job = {
+            .run = &store_job_run,
+            .done = &store_job_done,
+        },
+        .store = store,
+        .previews = primary ? NULL : state->previews,
+        .clip = clip_ref(clip),
+        .timestamp = time(NULL),
+        .primary = primary,
+        .items = NULL,
+        .stored = false,
+        .previewed = false,
+        .preview_ns = 0,
+        .indexed = false,
+    };
+    worker_pool_submit(&workers, state->lane, &job->job);
+}
+
+// queued on the store's lane, so it covers every append submitted before it
+struct sync_job {
+    struct worker_job job;
+    struct history_store *store;
+    bool synced;
+    uint64_t sync_ns;
+};
+
+void sync_job_run(struct worker_job *job) {
+    struct sync_job *sync_job = (struct sync_job *)job;
+    uint64_t sync_start = stats_now_ns();
+    sync_job->synced = history_sync(sync_job->store);
+    sync_job->sync_ns = stats_now_ns() - sync_start;
+}
+
+void sync_job_done(struct worker_job *job) {
+    struct sync_job *sync_job = (struct sync_job *)job;
+    histogram_add(&stats.sync_ns, sync_job->sync_ns);
+    if (sync_job->synced) {
+        stats.syncs++;
+    } else {
+        stats.syncs_failed++;
+        fputs("failed to sync history\n", stderr);
+    }
+    free(sync_job);
+}
+
+void sync_store(struct device_state *state, struct history_store *store) {
+    struct sync_job *job = malloc(sizeof *job);
+    *job = (struct sync_job) {
+        .job = {
+            .run = &sync_job_run,
+            .done = &sync_job_done,
+        },
+        .store = store,
+        .synced = false,
+        .sync_ns = 0,
+    };
+    worker_pool_submit(&workers, state->lane, &job->job);
+}
+
+void sync_due(struct debounce *debounce, void *data) {
+    (void) debounce;
+    struct device_state *state = data;
+    if (state->history_unsynced && state->history != NULL) sync_store(state, state->history);
+    if (state->primary_unsynced && state->primary_history != NULL) sync_store(state, state->primary_history);
+    state->history_unsynced = false;
+    state->primary_unsynced = false;
+}
+
+// a seat's own stores are closed on their lane, behind the appends still queued for them
+struct close_job {
+    struct worker_job job;
+    struct history_store *history;
+    struct history_store *primary_history;
+    struct preview_cache *previews;
+};
+
+void close_job_run(struct worker_job *job) {
+    struct close_job *close_job = (struct close_job *)job;
+    if (close_job->history != NULL) history_close(close_job->history);
+    if (close_job->primary_history != NULL) history_close(close_job->primary_history);
+    if (close_job->previews != NULL) preview_close(close_job->previews);
+}
+
+void close_job_done(struct worker_job *job) {
+    struct close_job *close_job = (struct close_job *)job;
+    free(close_job->history);
+    free(close_job->primary_history);
+    free(close_job->previews);
+    free(close_job);
+}
+
+void capture_done(struct capture *capture, void *data) {
+    struct device_state *state = data;
+
+    histogram_add(&stats.capture_ns, stats_now_ns() - capture->start_ns);
+    state->capture = NULL;
+
+    struct clip *clip = capture_take_clip(capture);
+    capture_free(capture);
+    if (clip != NULL) {
+        uint64_t clip_bytes = 0;
+        for (uint32_t i = 0; i < clip->n_items; i++) {
+            clip_bytes += clip->items[i].len;
+        }
+        histogram_add(&stats.clip_bytes, clip_bytes);
+
+        if (state->history != NULL) {
+            store_clip(state, state->history, clip, false);
+        } else {
+            fputs("failed to save clipboard entry\n", stderr);
+        }
+        if (state->saved_clip != NULL) clip_unref(state->saved_clip);
+        state->saved_clip = clip;
+    } else {
+        stats.captures_empty++;
+    }
+
+    if (state->replace_pending) {
+        state->replace_pending = false;
+        if (state->saved_clip != NULL && state->device != NULL) {
+            replace_selection(state);
+        }
+    }
 }
 
 void device_selection(void *data, struct zwlr_data_control_device_v1 *device, struct zwlr_data_control_offer_v1 *offer) {
     struct device_state *state = data;
+    (void) device;
 
     // destroy old one
-    if (state->selection_offer != NULL) {
-        zwlr_data_control_offer_v1_destroy(state->selection_offer);
-        state->selection_offer = NULL;
-        zzz_list_free(state->selection_offer_mimes, free);
-    }
+    offer_state_free(state->selection_offer);
+    state->selection_offer = NULL;
 
     // not a clipboard clear
     if (offer != NULL) {
-        if (state->pending_offer == NULL || state->pending_offer != offer) {
+        if (state->pending_offer == NULL || state->pending_offer->offer != offer) {
             fputs("selection given before offer\n", stderr);
             exit(1);
         }
 
         state->selection_offer = state->pending_offer;
-        state->selection_offer_mimes = state->pending_offer_mimes;
         state->pending_offer = NULL;
-        state->pending_offer_mimes = NULL;
-
-        // it was prepended to, so do this revert to insertion order
-        zzz_list_reverse(&state->selection_offer_mimes);
+        state->replace_pending = false;
 
         // save ones we care about
-        struct zzz_list *mimes_to_save = matching_mimes(config.pref, state->selection_offer_mimes);
-        // normally this would be done when we make the source but if the clip is never cleared
-        // we need to free
-        if (mimes_to_save != NULL && state->saved_items != NULL) {
-            zzz_list_free(state->saved_items, free_clip_item_void);
-            state->saved_items = NULL;
+        uint64_t selection_start = stats_now_ns();
+        struct offer_state *selection = state->selection_offer;
+        uint32_t n_selected;
+        uint64_t *max_bytes;
+        uint32_t *selected = mime_matcher_match(&config.matcher, selection->mimes, selection->n_mimes, &n_selected,
+                &max_bytes);
+        histogram_add(&stats.match_ns, stats_now_ns() - selection_start);
+        stats.offers++;
+        stats.mimes_offered += selection->n_mimes;
+        stats.mimes_selected += n_selected;
+        for (uint32_t i = 0; i < selection->n_mimes; i++) {
+            stats_mime(selection->mimes[i])->offered++;
         }
-        struct zzz_list *curr_mime = mimes_to_save;
-        while (curr_mime != NULL) {
-            int fd[2];
-            pipe(fd);
-            zwlr_data_control_offer_v1_receive(offer, curr_mime->value, fd[1]);
-            close(fd[1]);
-            wl_display_roundtrip(display);
-
-            size_t chunk_size = 1024;
-            size_t data_capacity = chunk_size;
-            size_t data_len = 0;
-            char *data = malloc(data_capacity);
-            while (true) {
-                if (data_len + chunk_size > data_capacity) {
-                    data = realloc(data, data_capacity *= 2);
-                }
-                ssize_t bytes_read = read(fd[0], data + data_len, chunk_size);
-                data_len += bytes_read;
-                if (bytes_read != (ssize_t)chunk_size) {
-                    break;
-                }
-            }
-            close(fd[0]);
-            struct clip_item *item = malloc(sizeof(*item));
-            *item = (struct clip_item) {
-                .mime = strdup(curr_mime->value),
-                .data = data,
-                .len = data_len,
-            };
-            zzz_list_prepend(&state->saved_items, item);
-
-            curr_mime = curr_mime->next;
+        for (uint32_t i = 0; i < n_selected; i++) {
+            stats_mime(selection->mimes[selected[i]])->selected++;
+        }
+
+        // whatever an older capture still has in flight is stale now
+        if (state->capture != NULL) {
+            stats.captures_superseded++;
+            capture_free(state->capture);
+            state->capture = NULL;
         }
-        // don't free strings because they are from selection_offer_mimes
-        zzz_list_free(mimes_to_save, NULL);
-    } else if (config.replace && state->saved_items != NULL) {
-        // assume client closed; fill clipboard
-        struct zwlr_data_control_source_v1 *source =
-            zwlr_data_control_manager_v1_create_data_source(state->registry_objs->data_control_manager);
-        struct zzz_list *curr_saved_item = state->saved_items;
-        while (curr_saved_item != NULL) {
-            struct clip_item *item = curr_saved_item->value;
-            zwlr_data_control_source_v1_offer(source, item->mime);
-
-            curr_saved_item = curr_saved_item->next;
+        // every mime is received in parallel; saved_clip is swapped out in capture_done
+        struct capture *capture = capture_start(&event_loop, offer, selection->mimes, selected, max_bytes, n_selected,
+                config.clip_budget, &capture_done, state);
+        if (capture != NULL) {
+            stats.captures++;
+            state->capture = capture;
         }
-        zwlr_data_control_source_v1_add_listener(source, &source_listener, state->saved_items);
-        zwlr_data_control_device_v1_set_selection(device, source);
-        // this is now the source's responsibility, freed on cancelled event
-        state->saved_items = NULL;
+        histogram_add(&stats.selection_ns, stats_now_ns() - selection_start);
+    } else if (config.replace) {
+        if (state->capture != NULL) {
+            state->replace_pending = true;
+        } else if (state->saved_clip != NULL) {
+            replace_selection(state);
+        }
+    }
+}
+
+// an item whose hash isn't finished yet never matches, the store's own check against the newest
+// entry catches what this lets through
+bool same_clip(struct clip *a, struct clip *b) {
+    if (a == NULL || b == NULL || a->n_items != b->n_items) return false;
+    for (uint32_t i = 0; i < a->n_items; i++) {
+        if (a->items[i].partial_hash != NULL || b->items[i].partial_hash != NULL
+                || a->items[i].hash != b->items[i].hash || a->items[i].len != b->items[i].len
+                || strcmp(a->items[i].mime, b->items[i].mime) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void primary_capture_done(struct capture *capture, void *data) {
+    struct device_state *state = data;
+    state->primary_capture = NULL;
+    struct clip *clip = capture_take_clip(capture);
+    capture_free(capture);
+    if (clip == NULL) return;
+
+    if (!same_clip(clip, state->primary_clip)) {
+        if (state->primary_history != NULL) {
+            store_clip(state, state->primary_history, clip, true);
+        } else {
+            fputs("failed to save primary selection entry\n", stderr);
+        }
+    }
+    if (state->primary_clip != NULL) clip_unref(state->primary_clip);
+    state->primary_clip = clip;
+}
+
+// runs between events, so no match is ever half on the old config and half on the new one.
+// captures in flight keep the caps they started with
+void config_changed(struct config_watch *watch, void *data) {
+    (void) watch;
+    (void) data;
+    struct mime_pref pref;
+    uint64_t clip_budget;
+    if (!load_config(&pref, &clip_budget)) {
+        fputs("keeping the previous config\n", stderr);
+        stats.config_rejected++;
+        return;
+    }
+    struct mime_matcher matcher;
+    mime_matcher_build(&pref, &matcher);
+    // the matcher points into the pref's regexes, so it goes first
+    mime_matcher_free(&config.matcher);
+    free_pref_contents(&config.pref);
+    config.pref = pref;
+    config.matcher = matcher;
+    config.clip_budget = clip_budget;
+    stats.config_reloads++;
+}
+
+void primary_settled(struct debounce *debounce, void *data) {
+    (void) debounce;
+    struct device_state *state = data;
+    struct offer_state *primary = state->primary_offer;
+    if (primary == NULL) return;
+    if (state->primary_capture != NULL) {
+        capture_free(state->primary_capture);
+        state->primary_capture = NULL;
     }
+
+    uint32_t n_selected;
+    uint64_t *max_bytes;
+    uint32_t *selected = mime_matcher_match(&config.matcher, primary->mimes, primary->n_mimes, &n_selected, &max_bytes);
+    state->primary_capture = capture_start(&event_loop, primary->offer, primary->mimes, selected, max_bytes, n_selected,
+            config.clip_budget, &primary_capture_done, state);
+    if (state->primary_capture != NULL) stats.primary_captures++;
 }
 
 void device_primary_selection(void *data, struct zwlr_data_control_device_v1 *device, struct zwlr_data_control_offer_v1 *offer) {
     (void) device;
     struct device_state *state = data;
 
-    // we don't care about the pending offer, dump it
-    if (offer != NULL && offer == state->pending_offer) {
-        zwlr_data_control_offer_v1_destroy(state->pending_offer);
+    if (offer == NULL) {
+        offer_state_free(state->primary_offer);
+        state->primary_offer = NULL;
+        if (state->primary_debounce.source.fd >= 0) debounce_cancel(&state->primary_debounce);
+        return;
+    }
+    if (state->pending_offer == NULL || offer != state->pending_offer->offer) return;
+    if (state->primary_debounce.source.fd < 0) {
+        // we don't care about the pending offer, dump it
+        offer_state_free(state->pending_offer);
         state->pending_offer = NULL;
-        zzz_list_free(state->pending_offer_mimes, free);
+        return;
     }
+
+    // a drag sends one of these per motion; only the last one gets captured, once things settle
+    stats.primary_offers++;
+    offer_state_free(state->primary_offer);
+    state->primary_offer = state->pending_offer;
+    state->pending_offer = NULL;
+    debounce_kick(&state->primary_debounce);
 }
 
-void device_finished(void *data, struct zwlr_data_control_device_v1 *device) {
-    struct device_state *state = data;
+// drops the device and whatever was in flight on it, the seat itself stays
+void device_stop(struct device_state *state) {
+    if (state->device != NULL) {
+        zwlr_data_control_device_v1_destroy(state->device);
+        state->device = NULL;
+    }
+    offer_state_free(state->pending_offer);
+    offer_state_free(state->selection_offer);
+    offer_state_free(state->primary_offer);
+    state->pending_offer = NULL;
+    state->selection_offer = NULL;
+    state->primary_offer = NULL;
+    if (state->capture != NULL) {
+        capture_free(state->capture);
+        state->capture = NULL;
+    }
+    if (state->primary_capture != NULL) {
+        capture_free(state->primary_capture);
+        state->primary_capture = NULL;
+    }
+    if (state->primary_debounce.source.fd >= 0) debounce_cancel(&state->primary_debounce);
+}
 
-    zwlr_data_control_device_v1_destroy(device);
-    state->registry_objs->device = NULL;
-    zzz_list_free(state->pending_offer_mimes, free);
-    zzz_list_free(state->selection_offer_mimes, free);
-    if (state->pending_offer != NULL) zwlr_data_control_offer_v1_destroy(state->pending_offer);
-    if (state->selection_offer != NULL) zwlr_data_control_offer_v1_destroy(state->selection_offer);
+void device_finished(void *data, struct zwlr_data_control_device_v1 *device) {
+    (void) device;
+    device_stop(data);
 }
 
 struct zwlr_data_control_device_v1_listener device_listener = {
@@ -226,30 +675,191 @@ struct zwlr_data_control_device_v1_listener device_listener = {
     .finished = &device_finished,
 };
 
+void seat_capabilities(void *data, struct wl_seat *seat, uint32_t capabilities) {
+    (void) data;
+    (void) seat;
+    (void) capabilities;
+}
+
+// the main seat writes the stores opened at startup
+bool seat_open_history(struct device_state *state) {
+    if (state == state->registry_objs->main_seat) {
+        state->history = &history;
+        state->previews = &previews;
+        if (config.primary_quiet_ns != 0) state->primary_history = &primary_history;
+        return true;
+    }
+    char *dir = history_seat_dir(state->seat_name);
+    if (dir == NULL) return false;
+    state->history = malloc(sizeof *state->history);
+    if (!history_open(state->history, dir, true)) {
+        free(state->history);
+        state->history = NULL;
+        free(dir);
+        return false;
+    }
+    state->history->sync = config.sync;
+    // a seat's copies are stored without previews rather than not at all
+    state->previews = malloc(sizeof *state->previews);
+    if (!preview_open(state->previews, dir, true, state->history->n_entries)) {
+        free(state->previews);
+        state->previews = NULL;
+    }
+    if (config.primary_quiet_ns != 0) {
+        char *primary_dir;
+        state->primary_history = malloc(sizeof *state->primary_history);
+        if (asprintf(&primary_dir, "%s/primary", dir) < 0) {
+            free(state->primary_history);
+            state->primary_history = NULL;
+        } else {
+            if (!history_open(state->primary_history, primary_dir, true)) {
+                free(state->primary_history);
+                state->primary_history = NULL;
+            } else {
+                state->primary_history->sync = config.sync;
+            }
+            free(primary_dir);
+        }
+    }
+    free(dir);
+    return true;
+}
+
+// compositors send it right after the bind, before any selection on the seat's device
+void seat_name(void *data, struct wl_seat *seat, const char *name) {
+    (void) seat;
+    struct device_state *state = data;
+    if (state->seat_name != NULL) return;
+    state->seat_name = strdup(name);
+    if (!seat_open_history(state)) {
+        fprintf(stderr, "no history for seat %s, its copies won't be stored\n", name);
+    }
+}
+
+struct wl_seat_listener seat_listener = {
+    .capabilities = &seat_capabilities,
+    .name = &seat_name,
+};
+
+void seat_start_device(struct device_state *state) {
+    struct registry_objs *registry_objs = state->registry_objs;
+    if (state->device != NULL || registry_objs->data_control_manager == NULL) return;
+    state->device = zwlr_data_control_manager_v1_get_data_device(registry_objs->data_control_manager, state->seat);
+    zwlr_data_control_device_v1_add_listener(state->device, &device_listener, state);
+}
+
+struct device_state *seat_new(struct registry_objs *registry_objs, struct wl_registry *registry, uint32_t name,
+        uint32_t version) {
+    struct device_state *state = malloc(sizeof *state);
+    *state = (struct device_state) {
+        .registry_objs = registry_objs,
+        .seat = wl_registry_bind(registry, name, &wl_seat_interface, version < 2 ? version : 2),
+        .seat_global = name,
+        .seat_name = NULL,
+        .device = NULL,
+        .history = NULL,
+        .primary_history = NULL,
+        .previews = NULL,
+        .lane = registry_objs->n_seats_bound++,
+        .pending_offer = NULL,
+        .selection_offer = NULL,
+        .saved_clip = NULL,
+        .capture = NULL,
+        .replace_pending = false,
+        .primary_offer = NULL,
+        .primary_capture = NULL,
+        .primary_clip = NULL,
+        .primary_debounce = {
+            .source = {
+                .fd = -1,
+            },
+        },
+        .history_unsynced = false,
+        .primary_unsynced = false,
+        .sync_debounce = {
+            .source = {
+                .fd = -1,
+            },
+        },
+    };
+    if (config.primary_quiet_ns != 0 && !debounce_init(&state->primary_debounce, &event_loop,
+                config.primary_quiet_ns, 0, PRIMARY_BURST, PRIMARY_REFILL_NS, &primary_settled, state)) {
+        fputs("not tracking the primary selection\n", stderr);
+    }
+    // a steady stream of copies still gets synced once per window
+    if (config.sync == HISTORY_SYNC_BATCH && !debounce_init(&state->sync_debounce, &event_loop,
+                config.sync_window_ns, config.sync_window_ns, 1, 0, &sync_due, state)) {
+        fputs("history is only synced on exit\n", stderr);
+    }
+    if (registry_objs->main_seat == NULL && registry_objs->seats == NULL) registry_objs->main_seat = state;
+    zzz_list_prepend(&registry_objs->seats, state);
+
+    if (version >= 2) {
+        wl_seat_add_listener(state->seat, &seat_listener, state);
+    } else {
+        // no name event to wait for, the registry name has to do
+        char seat_name[32];
+        snprintf(seat_name, sizeof seat_name, "%u", name);
+        state->seat_name = strdup(seat_name);
+        if (!seat_open_history(state)) {
+            fprintf(stderr, "no history for seat %s, its copies won't be stored\n", seat_name);
+        }
+    }
+    return state;
+}
+
+void seat_free(struct device_state *state) {
+    struct registry_objs *registry_objs = state->registry_objs;
+    device_stop(state);
+    debounce_finish(&state->primary_debounce);
+    // ahead of the close job, or of worker_pool_finish for the main seat's stores
+    if (state->sync_debounce.source.fd >= 0 && state->sync_debounce.kicked_ns != 0) {
+        debounce_cancel(&state->sync_debounce);
+        sync_due(&state->sync_debounce, state);
+    }
+    debounce_finish(&state->sync_debounce);
+    if (state->saved_clip != NULL) clip_unref(state->saved_clip);
+    if (state->primary_clip != NULL) clip_unref(state->primary_clip);
+    if (state != registry_objs->main_seat) {
+        struct close_job *job = malloc(sizeof *job);
+        *job = (struct close_job) {
+            .job = {
+                .run = &close_job_run,
+                .done = &close_job_done,
+            },
+            .history = state->history,
+            .primary_history = state->primary_history,
+            .previews = state->previews,
+        };
+        worker_pool_submit(&workers, state->lane, &job->job);
+    } else {
+        registry_objs->main_seat = NULL;
+    }
+    wl_seat_destroy(state->seat);
+    free(state->seat_name);
+
+    for (struct zzz_list **curr = &registry_objs->seats; *curr != NULL; curr = &(*curr)->next) {
+        if ((*curr)->value == state) {
+            struct zzz_list *next = (*curr)->next;
+            free(*curr);
+            *curr = next;
+            break;
+        }
+    }
+    free(state);
+}
+
 void registry_global(void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t version) {
     struct registry_objs *registry_objs = data;
 
     if (strcmp(interface, wl_seat_interface.name) == 0 && version >= 1) {
-        registry_objs->seat_name = name;
-        registry_objs->seat = wl_registry_bind(registry, name, &wl_seat_interface, version);
+        seat_start_device(seat_new(registry_objs, registry, name, version));
     } else if (strcmp(interface, zwlr_data_control_manager_v1_interface.name) == 0 && version >= 2) {
         registry_objs->data_control_manager_name = name;
         registry_objs->data_control_manager = wl_registry_bind(registry, name, &zwlr_data_control_manager_v1_interface, version);
-    }
-
-    if (registry_objs->device == NULL && registry_objs->seat != NULL && registry_objs->data_control_manager != NULL) {
-        registry_objs->device = zwlr_data_control_manager_v1_get_data_device(registry_objs->data_control_manager, registry_objs->seat);
-
-        struct device_state *state = malloc(sizeof *state);
-        *state = (struct device_state) {
-            .registry_objs = registry_objs,
-            .pending_offer = NULL,
-            .pending_offer_mimes = NULL,
-            .selection_offer = NULL,
-            .selection_offer_mimes = NULL,
-        };
-
-        zwlr_data_control_device_v1_add_listener(registry_objs->device, &device_listener, state);
+        for (struct zzz_list *curr = registry_objs->seats; curr != NULL; curr = curr->next) {
+            seat_start_device(curr->value);
+        }
     }
 }
 
@@ -257,10 +867,14 @@ void registry_remove(void *data, struct wl_registry *registry, uint32_t name) {
     struct registry_objs *registry_objs = data;
     (void) registry;
 
-    if (name == registry_objs->seat_name) {
-        wl_seat_destroy(registry_objs->seat);
-        registry_objs->seat = NULL;
-    } else if (name == registry_objs->data_control_manager_name) {
+    for (struct zzz_list *curr = registry_objs->seats; curr != NULL; curr = curr->next) {
+        struct device_state *state = curr->value;
+        if (state->seat_global == name) {
+            seat_free(state);
+            return;
+        }
+    }
+    if (name == registry_objs->data_control_manager_name) {
         zwlr_data_control_manager_v1_destroy(registry_objs->data_control_manager);
         registry_objs->data_control_manager = NULL;
     }
@@ -271,15 +885,66 @@ struct wl_registry_listener registry_listener = {
     .global_remove = &registry_remove,
 };
 
+// entries come from the main store, so they go back to the main seat
+bool control_select(struct clip *clip, void *data) {
+    struct registry_objs *registry_objs = data;
+    struct device_state *state = registry_objs->main_seat;
+    if (state == NULL || state->device == NULL || registry_objs->data_control_manager == NULL) {
+        return false;
+    }
+    set_selection(state, clip);
+    return true;
+}
+
+void display_event(struct event_source *source, uint32_t events) {
+    (void) source;
+    (void) events;
+    // also reports hangups
+    if (wl_display_dispatch(display) == -1) {
+        event_loop_stop(&event_loop);
+    }
+}
+
+void stats_signal(struct event_source *source, uint32_t events) {
+    (void) events;
+    struct signalfd_siginfo info;
+    while (read(source->fd, &info, sizeof info) == sizeof info) {
+        if (stats_file == NULL || !stats_dump(stats_file, &history_view)) {
+            fputs("failed to dump stats\n", stderr);
+        }
+    }
+}
+
+// leaves the loop, so pending syncs are flushed and the stores closed on the way out
+void quit_signal(struct event_source *source, uint32_t events) {
+    (void) events;
+    struct signalfd_siginfo info;
+    while (read(source->fd, &info, sizeof info) == sizeof info) {}
+    event_loop_stop(&event_loop);
+}
+
 int main(int argc, char *argv[]) {
     char *help =
         "usage: zzz [options]\n"
-        "  -h  print this help message\n"
-        "  -r  replace selection when selection is cleared,\n"
-        "      such as when the source application exits\n";
+        "  -h       print this help message\n"
+        "  -r       replace selection when selection is cleared,\n"
+        "           such as when the source application exits\n"
+        "  -c SIZE  memory for recent entries, k/M/G suffixes allowed (default 64M);\n"
+        "           shrinks to an eighth while the system is short on memory\n"
+        "  -p MS    also store the primary selection, in its own history, once it\n"
+        "           has stayed the same for MS milliseconds\n"
+        "  -U       don't use io_uring, stay on epoll and plain reads and writes\n"
+        "  -f SYNC  when stored entries are flushed to disk: every, to sync each one\n"
+        "           before it counts as stored; off, to leave it to the kernel; or\n"
+        "           MS, to sync whatever was stored in one go at most MS\n"
+        "           milliseconds after the first of it (default 1000)\n";
     config.replace = false;
+    config.cache_budget = CLIP_CACHE_DEFAULT_BUDGET;
+    config.sync = HISTORY_SYNC_BATCH;
+    config.sync_window_ns = SYNC_WINDOW_DEFAULT_NS;
+    char *end;
     int c;
-    while ((c = getopt(argc, argv, "hr")) != -1) {
+    while ((c = getopt(argc, argv, "hrUc:p:f:")) != -1) {
         switch (c) {
             case '?':
                 fputs(help, stderr);
@@ -290,13 +955,87 @@ int main(int argc, char *argv[]) {
             case 'r':
                 config.replace = true;
                 break;
+            case 'U':
+                uring_off = true;
+                break;
+            case 'c':
+                if (!parse_size(optarg, &end, &config.cache_budget) || *end != '\0') {
+                    fprintf(stderr, "invalid cache size %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p': {
+                unsigned long quiet_ms = strtoul(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || quiet_ms == 0) {
+                    fprintf(stderr, "invalid primary selection delay %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                config.primary_quiet_ns = quiet_ms * 1000000ull;
+                break;
+            }
+            case 'f': {
+                if (strcmp(optarg, "every") == 0) {
+                    config.sync = HISTORY_SYNC_EVERY;
+                    break;
+                }
+                if (strcmp(optarg, "off") == 0) {
+                    config.sync = HISTORY_SYNC_NONE;
+                    break;
+                }
+                unsigned long window_ms = strtoul(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || window_ms == 0) {
+                    fprintf(stderr, "invalid sync policy %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                config.sync = HISTORY_SYNC_BATCH;
+                config.sync_window_ns = window_ms * 1000000ull;
+                break;
+            }
             default:
                 break;
         }
     }
 
-    struct mime_pref pref = get_config();
+    // paste targets that close early must not take the daemon down with them
+    signal(SIGPIPE, SIG_IGN);
+    // blocked before any worker thread exists, threads keep the mask they were started with
+    sigset_t stats_signals;
+    sigemptyset(&stats_signals);
+    sigaddset(&stats_signals, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &stats_signals, NULL);
+    sigset_t quit_signals;
+    sigemptyset(&quit_signals);
+    sigaddset(&quit_signals, SIGTERM);
+    sigaddset(&quit_signals, SIGINT);
+    sigprocmask(SIG_BLOCK, &quit_signals, NULL);
+    stats_init();
+
+    struct mime_pref pref = get_config(&config.clip_budget);
     config.pref = pref;
+    mime_matcher_build(&config.pref, &config.matcher);
+
+    char *history_path = history_dir();
+    if (history_path == NULL || !history_open(&history, history_path, true)
+            || !history_open(&history_view, history_path, false)) {
+        return EXIT_FAILURE;
+    }
+    history.sync = config.sync;
+    if (!preview_open(&previews, history_path, true, history.n_entries)) {
+        fputs("entries will be stored without previews\n", stderr);
+    }
+    if (!feed_create(&feed)) {
+        fputs("no clipboard feed, status bars will have to ask over the socket\n", stderr);
+    }
+    feed_fill(&feed, &history_view, &previews);
+    free(history_path);
+    if (config.primary_quiet_ns != 0) {
+        char *primary_path = history_primary_dir();
+        if (primary_path == NULL || !history_open(&primary_history, primary_path, true)) {
+            return EXIT_FAILURE;
+        }
+        primary_history.sync = config.sync;
+        free(primary_path);
+    }
 
     display = wl_display_connect(NULL);
     if (display == NULL) {
@@ -307,9 +1046,93 @@ int main(int argc, char *argv[]) {
     struct wl_registry *registry = wl_display_get_registry(display);
     struct registry_objs registry_objs = {0};
     wl_registry_add_listener(registry, &registry_listener, &registry_objs);
-    
-    while (wl_display_dispatch(display) != -1);
 
+    if (!event_loop_init(&event_loop)) {
+        return EXIT_FAILURE;
+    }
+    if (!worker_pool_init(&workers, &event_loop)) {
+        return EXIT_FAILURE;
+    }
+    struct event_source display_source = {
+        .fd = wl_display_get_fd(display),
+        .callback = &display_event,
+        .data = NULL,
+    };
+    if (!event_loop_add(&event_loop, &display_source, EPOLLIN)) {
+        return EXIT_FAILURE;
+    }
+
+    // SIGUSR1 writes the stats out from the loop, not from a handler
+    stats_file = stats_path();
+    struct event_source stats_source = {
+        .fd = signalfd(-1, &stats_signals, SFD_NONBLOCK | SFD_CLOEXEC),
+        .callback = &stats_signal,
+        .data = NULL,
+    };
+    if (stats_source.fd < 0 || !event_loop_add(&event_loop, &stats_source, EPOLLIN)) {
+        perror("signalfd");
+        return EXIT_FAILURE;
+    }
+    struct event_source quit_source = {
+        .fd = signalfd(-1, &quit_signals, SFD_NONBLOCK | SFD_CLOEXEC),
+        .callback = &quit_signal,
+        .data = NULL,
+    };
+    if (quit_source.fd < 0 || !event_loop_add(&event_loop, &quit_source, EPOLLIN)) {
+        perror("signalfd");
+        return EXIT_FAILURE;
+    }
+
+    clip_cache_init(&clip_cache, config.cache_budget);
+    // without PSI the cache just stays within its budget
+    clip_cache_watch_pressure(&clip_cache, &event_loop);
+    // built from the whole store at startup, then entry by entry as they are stored
+    search_init(&search_index);
+    search_update(&search_index, &history_view);
+    if (!control_server_init(&control_server, &event_loop, &history_view, &clip_cache, &search_index, &control_select,
+            &registry_objs)) {
+        // zzz_get still works without it, just slower
+        fputs("control socket unavailable\n", stderr);
+    }
+    if (!config_watch_init(&config_watch, &event_loop, &config_changed, NULL)) {
+        fputs("config changes need a restart\n", stderr);
+    }
+
+    while (event_loop.running) {
+        // callbacks from other fds may have queued requests or read events
+        if (wl_display_dispatch_pending(display) == -1) break;
+        if (wl_display_flush(display) == -1 && errno != EAGAIN) break;
+        if (!event_loop_dispatch(&event_loop, -1)) break;
+    }
+
+    control_server_finish(&control_server);
+    config_watch_finish(&config_watch);
+    while (registry_objs.seats != NULL) {
+        seat_free(registry_objs.seats->value);
+    }
+    while (live_sources != NULL) {
+        struct zwlr_data_control_source_v1 *source = live_sources->value;
+        source_cancelled(zwlr_data_control_source_v1_get_user_data(source), source);
+    }
+    // lets queued appends land and closes the seat stores
+    worker_pool_finish(&workers);
+    event_loop_finish(&event_loop);
+    paste_drop_all();
+    clip_cache_free(&clip_cache);
+    search_free(&search_index);
+    close(stats_source.fd);
+    close(quit_source.fd);
+    free(stats_file);
+    stats_free();
+    feed_close(&feed);
+    history_close(&history);
+    history_close(&history_view);
+    preview_close(&previews);
+    if (config.primary_quiet_ns != 0) history_close(&primary_history);
+    if (registry_objs.data_control_manager != NULL) {
+        zwlr_data_control_manager_v1_destroy(registry_objs.data_control_manager);
+    }
+    wl_registry_destroy(registry);
     wl_display_disconnect(display);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "mime_matcher.h"
+
+void count_nodes(struct mime_pref *pref, uint32_t depth, struct mime_matcher *matcher) {
+    matcher->n_nodes++;
+    if (depth > matcher->depth) matcher->depth = depth;
+    if (pref->type == SINGLE_MIME) {
+        matcher->n_leaves++;
+        return;
+    }
+    for (struct zzz_list *curr = pref->inner.subprefs; curr != NULL; curr = curr->next) {
+        count_nodes(curr->value, depth + 1, matcher);
+    }
+}
+
+// returns the index one past the subtree
+uint32_t flatten(struct mime_pref *pref, uint32_t idx, uint64_t max_bytes, struct mime_matcher *matcher) {
+    struct matcher_node *node = &matcher->nodes[idx];
+    node->type = pref->type;
+    node->leaf = 0;
+    node->max_bytes = pref->max_bytes != 0 ? pref->max_bytes : max_bytes;
+    uint32_t next = idx + 1;
+    if (pref->type == SINGLE_MIME) {
+        node->leaf = matcher->n_leaves;
+        matcher->leaves[matcher->n_leaves++] = pref->inner.regex.code;
+    } else {
+        for (struct zzz_list *curr = pref->inner.subprefs; curr != NULL; curr = curr->next) {
+            next = flatten(curr->value, next, node->max_bytes, matcher);
+        }
+    }
+    node->end = next;
+    return next;
+}
+
+void mime_matcher_build(struct mime_pref *pref, struct mime_matcher *matcher) {
+    *matcher = (struct mime_matcher) {0};
+    count_nodes(pref, 0, matcher);
+    matcher->nodes = malloc(matcher->n_nodes * sizeof *matcher->nodes);
+    matcher->leaves = malloc((matcher->n_leaves + 1) * sizeof *matcher->leaves);
+    matcher->n_leaves = 0;
+    flatten(pref, 0, 0, matcher);
+    // only whether it matched matters, so one small match data does for every leaf
+    matcher->match_data = pcre2_match_data_create(1, NULL);
+}
+
+void cache_entry_clear(struct matcher_cache_entry *entry) {
+    free(entry->key);
+    free(entry->selected);
+    free(entry->max_bytes);
+    *entry = (struct matcher_cache_entry) {0};
+}
+
+void mime_matcher_free(struct mime_matcher *matcher) {
+    for (uint32_t i = 0; i < MATCHER_CACHE_SIZE; i++) {
+        cache_entry_clear(&matcher->cache[i]);
+    }
+    free(matcher->nodes);
+    free(matcher->leaves);
+    pcre2_match_data_free(matcher->match_data);
+    free(matcher->leaf_results);
+    free(matcher->avail);
+    free(matcher->out);
+    free(matcher->out_max_bytes);
+    *matcher = (struct mime_matcher) {0};
+}
+
+struct match_run {
+    struct mime_matcher *matcher;
+    char **mimes;
+    uint32_t n_mimes;
+    uint32_t n_out;
+};
+
+// each (mime, regex) pair is evaluated at most once per match
+bool leaf_matches(struct match_run *run, uint32_t mime, uint32_t leaf) {
+    struct mime_matcher *matcher = run->matcher;
+    int8_t *result = &matcher->leaf_results[(size_t)mime * matcher->n_leaves + leaf];
+    if (*result < 0) {
+        int match = pcre2_match(matcher->leaves[leaf], (PCRE2_SPTR8)run->mimes[mime], PCRE2_ZERO_TERMINATED,
+                0, 0, matcher->match_data, NULL);
+        *result = match >= 0;
+    }
+    return *result;
+}
+
+// appends the selected mime indexes to out, returns how many
+// avail at level says which mimes haven't been taken by an enclosing STORE_ALL_MATCHING yet
+uint32_t eval_node(struct match_run *run, uint32_t idx, uint32_t level) {
+    struct mime_matcher *matcher = run->matcher;
+    struct matcher_node *node = &matcher->nodes[idx];
+    uint8_t *avail = matcher->avail + (size_t)level * run->n_mimes;
+    switch (node->type) {
+        case SINGLE_MIME: {
+            uint32_t found = 0;
+            for (uint32_t i = 0; i < run->n_mimes; i++) {
+                if (avail[i] && leaf_matches(run, i, node->leaf)) {
+                    matcher->out_max_bytes[run->n_out] = node->max_bytes;
+                    matcher->out[run->n_out++] = i;
+                    found++;
+                }
+            }
+            return found;
+        }
+        case STORE_FIRST_MATCHING: {
+            for (uint32_t child = idx + 1; child < node->end; child = matcher->nodes[child].end) {
+                uint32_t found = eval_node(run, child, level);
+                if (found > 0) return found;
+            }
+            return 0;
+        }
+        case STORE_ALL_MATCHING: {
+            uint8_t *remaining = avail + run->n_mimes;
+            memcpy(remaining, avail, run->n_mimes);
+            uint32_t found = 0;
+            for (uint32_t child = idx + 1; child < node->end; child = matcher->nodes[child].end) {
+                uint32_t start = run->n_out;
+                found += eval_node(run, child, level + 1);
+                for (uint32_t i = start; i < run->n_out; i++) {
+                    remaining[matcher->out[i]] = 0;
+                }
+            }
+            return found;
+        }
+    }
+    return 0;
+}
+
+void ensure_scratch(struct mime_matcher *matcher, uint32_t n_mimes) {
+    if (n_mimes <= matcher->scratch_mimes) return;
+    matcher->scratch_mimes = n_mimes;
+    matcher->leaf_results = realloc(matcher->leaf_results, (size_t)n_mimes * (matcher->n_leaves + 1));
+    matcher->avail = realloc(matcher->avail, (size_t)n_mimes * (matcher->depth + 2));
+    matcher->out = realloc(matcher->out, (size_t)n_mimes * sizeof *matcher->out);
+    matcher->out_max_bytes = realloc(matcher->out_max_bytes, (size_t)n_mimes * sizeof *matcher->out_max_bytes);
+}
+
+bool key_equals(char *key, char **mimes, uint32_t n_mimes) {
+    for (uint32_t i = 0; i < n_mimes; i++) {
+        size_t len = strlen(mimes[i]) + 1;
+        if (memcmp(key, mimes[i], len) != 0) return false;
+        key += len;
+    }
+    return true;
+}
+
+uint32_t *mime_matcher_match(struct mime_matcher *matcher, char **mimes, uint32_t n_mimes, uint32_t *n_selected,
+        uint64_t **max_bytes) {
+    *n_selected = 0;
+    *max_bytes = NULL;
+    if (n_mimes == 0) return NULL;
+
+    // hash and compare in place, the key is only built on a miss
+    struct hash_state hash_state;
+    hash_init(&hash_state);
+    size_t key_len = 0;
+    for (uint32_t i = 0; i < n_mimes; i++) {
+        size_t len = strlen(mimes[i]) + 1;
+        hash_update(&hash_state, mimes[i], len);
+        key_len += len;
+    }
+    uint64_t hash = hash_digest(&hash_state);
+
+    for (uint32_t c = 0; c < MATCHER_CACHE_SIZE; c++) {
+        struct matcher_cache_entry *entry = &matcher->cache[c];
+        if (entry->key != NULL && entry->hash == hash && entry->key_len == key_len
+                && key_equals(entry->key, mimes, n_mimes)) {
+            *n_selected = entry->n_selected;
+            *max_bytes = entry->max_bytes;
+            return entry->selected;
+        }
+    }
+
+    ensure_scratch(matcher, n_mimes);
+    memset(matcher->leaf_results, -1, (size_t)n_mimes * matcher->n_leaves);
+    memset(matcher->avail, 1, n_mimes);
+    struct match_run run = {
+        .matcher = matcher,
+        .mimes = mimes,
+        .n_mimes = n_mimes,
+        .n_out = 0,
+    };
+    eval_node(&run, 0, 0);
+
+    char *key = malloc(key_len);
+    char *key_end = key;
+    for (uint32_t i = 0; i < n_mimes; i++) {
+        size_t len = strlen(mimes[i]) + 1;
+        memcpy(key_end, mimes[i], len);
+        key_end += len;
+    }
+
+    // evict round robin, the working set is a handful of apps
+    struct matcher_cache_entry *entry = &matcher->cache[matcher->cache_next];
+    matcher->cache_next = (matcher->cache_next + 1) % MATCHER_CACHE_SIZE;
+    cache_entry_clear(entry);
+    *entry = (struct matcher_cache_entry) {
+        .hash = hash,
+        .key = key,
+        .key_len = key_len,
+        .selected = malloc((run.n_out + 1) * sizeof *entry->selected),
+        .max_bytes = malloc((run.n_out + 1) * sizeof *entry->max_bytes),
+        .n_selected = run.n_out,
+    };
+    memcpy(entry->selected, matcher->out, run.n_out * sizeof *entry->selected);
+    memcpy(entry->max_bytes, matcher->out_max_bytes, run.n_out * sizeof *entry->max_bytes);
+    *n_selected = entry->n_selected;
+    *max_bytes = entry->max_bytes;
+    return entry->selected;
+}
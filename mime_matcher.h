@@ -0,0 +1,62 @@
+#ifndef MIME_MATCHER_H
+#define MIME_MATCHER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pref_parse.h"
+
+#define MATCHER_CACHE_SIZE 32
+
+// mime_pref flattened into preorder; a node's children directly follow it
+struct matcher_node {
+    enum mime_pref_type type;
+    // index one past the last node of this subtree
+    uint32_t end;
+    // SINGLE_MIME only
+    uint32_t leaf;
+    // the pref's own cap or the nearest enclosing one, 0 for none
+    uint64_t max_bytes;
+};
+
+// remembers the selection for an offered mime list, apps offer the same one every copy
+struct matcher_cache_entry {
+    uint64_t hash;
+    // offered mimes, each followed by its NUL
+    char *key;
+    size_t key_len;
+    // indexes into the offered list
+    uint32_t *selected;
+    // cap for each selected mime
+    uint64_t *max_bytes;
+    uint32_t n_selected;
+};
+
+struct mime_matcher {
+    struct matcher_node *nodes;
+    uint32_t n_nodes;
+    // owned by the mime_pref the matcher was built from
+    pcre2_code **leaves;
+    uint32_t n_leaves;
+    uint32_t depth;
+    pcre2_match_data *match_data;
+    struct matcher_cache_entry cache[MATCHER_CACHE_SIZE];
+    uint32_t cache_next;
+    // reused between matches
+    int8_t *leaf_results;
+    uint8_t *avail;
+    uint32_t *out;
+    uint64_t *out_max_bytes;
+    size_t scratch_mimes;
+};
+
+// pref must outlive the matcher
+void mime_matcher_build(struct mime_pref *pref, struct mime_matcher *matcher);
+void mime_matcher_free(struct mime_matcher *matcher);
+// same selection as matching_mimes, as indexes into mimes in selection order, plus each one's
+// size cap (0 for none); both arrays belong to the matcher and are valid until the next match
+uint32_t *mime_matcher_match(struct mime_matcher *matcher, char **mimes, uint32_t n_mimes, uint32_t *n_selected,
+        uint64_t **max_bytes);
+
+#endif
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#include "paste.h"
+#include "stats.h"
+
+#define PASTE_CHUNK (256 * 1024)
+
+struct paste_writer *pastes_in_flight;
+
+enum paste_status {
+    PASTE_DONE,
+    PASTE_BLOCKED,
+    PASTE_FAILED,
+};
+
+ssize_t paste_write_spilled(struct paste_writer *writer, size_t count) {
+    int fd = writer->source.fd;
+    // memfd -> pipe is a page reference move; targets that aren't pipes get sendfile
+    ssize_t written = splice(writer->item->fd, &writer->offset, fd, NULL, count, SPLICE_F_NONBLOCK);
+    if (written >= 0 || errno != EINVAL) return written;
+    return sendfile(fd, writer->item->fd, &writer->offset, count);
+}
+
+enum paste_status paste_write(struct paste_writer *writer) {
+    struct clip_item *item = writer->item;
+    while (writer->prefix_offset < writer->prefix_len || (size_t)writer->offset < item->len) {
+        size_t remaining = item->len - writer->offset;
+        size_t count = remaining < PASTE_CHUNK ? remaining : PASTE_CHUNK;
+        ssize_t written;
+        if (writer->prefix_offset < writer->prefix_len) {
+            written = write(writer->source.fd, writer->prefix + writer->prefix_offset,
+                    writer->prefix_len - writer->prefix_offset);
+            if (written > 0) writer->prefix_offset += written;
+        } else if (item->data != NULL) {
+            written = write(writer->source.fd, item->data + writer->offset, count);
+            if (written > 0) writer->offset += written;
+        } else {
+            // advances offset itself
+            written = paste_write_spilled(writer, count);
+        }
+
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return PASTE_BLOCKED;
+            // EPIPE when the target gave up on the paste
+            if (errno != EPIPE) perror("paste");
+            return PASTE_FAILED;
+        } else if (written == 0) {
+            // memfd shorter than recorded, shouldn't happen
+            return PASTE_FAILED;
+        }
+    }
+    return PASTE_DONE;
+}
+
+void paste_finish(struct paste_writer *writer, bool failed) {
+    struct mime_stats *mime_stats = stats_mime(writer->item->mime);
+    mime_stats->pastes++;
+    mime_stats->pasted_bytes += writer->offset;
+    stats.pastes++;
+    if (failed) stats.pastes_failed++;
+    stats.pasted_bytes += writer->offset;
+    histogram_add(&stats.paste_ns, stats_now_ns() - writer->start_ns);
+
+    if (writer->prev != NULL) {
+        writer->prev->next = writer->next;
+    } else {
+        pastes_in_flight = writer->next;
+    }
+    if (writer->next != NULL) writer->next->prev = writer->prev;
+    close(writer->source.fd);
+    clip_unref(writer->clip);
+    free(writer);
+}
+
+void paste_drop_all(void) {
+    while (pastes_in_flight != NULL) {
+        paste_finish(pastes_in_flight, true);
+    }
+}
+
+// io_uring: whatever is left goes in one write, queued with everything else
+enum paste_status paste_queue_write(struct paste_writer *writer) {
+    struct clip_item *item = writer->item;
+    bool ok;
+    if (writer->prefix_offset < writer->prefix_len) {
+        ok = event_loop_write(writer->loop, &writer->source, writer->prefix + writer->prefix_offset,
+                writer->prefix_len - writer->prefix_offset);
+    } else if ((size_t)writer->offset < item->len) {
+        ok = event_loop_write(writer->loop, &writer->source, item->data + writer->offset, item->len - writer->offset);
+    } else {
+        return PASTE_DONE;
+    }
+    return ok ? PASTE_BLOCKED : PASTE_FAILED;
+}
+
+enum paste_status paste_write_done(struct paste_writer *writer, int32_t result) {
+    if (result > 0) {
+        if (writer->prefix_offset < writer->prefix_len) {
+            writer->prefix_offset += result;
+        } else {
+            writer->offset += result;
+        }
+        return paste_queue_write(writer);
+    } else if (result == -EINTR) {
+        return paste_queue_write(writer);
+    } else if (result == -EAGAIN) {
+        // the target's end came non-blocking, wait for room like on epoll
+        event_loop_remove(writer->loop, &writer->source);
+        fcntl(writer->source.fd, F_SETFL, fcntl(writer->source.fd, F_GETFL) | O_NONBLOCK);
+        return event_loop_add(writer->loop, &writer->source, EPOLLOUT) ? PASTE_BLOCKED : PASTE_FAILED;
+    }
+    if (result != -EPIPE) {
+        errno = -result;
+        perror("paste");
+    }
+    return PASTE_FAILED;
+}
+
+void paste_writable(struct event_source *source, uint32_t events) {
+    struct paste_writer *writer = source->data;
+    enum paste_status status = events & EVENT_LOOP_DONE
+        ? paste_write_done(writer, source->result)
+        : paste_write(writer);
+    if (status == PASTE_BLOCKED) return;
+    event_loop_remove(writer->loop, source);
+    paste_finish(writer, status == PASTE_FAILED);
+}
+
+void paste_start(struct event_loop *loop, struct clip *clip, struct clip_item *item, int fd,
+        const void *prefix, size_t prefix_len) {
+    // io_uring writes from memory wait in the kernel; spilled items splice on readiness
+    bool queued = loop->uring != NULL && item->data != NULL;
+    if (!queued) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    struct paste_writer *writer = malloc(sizeof *writer);
+    *writer = (struct paste_writer) {
+        .source = {
+            .fd = fd,
+            .callback = &paste_writable,
+            .data = writer,
+        },
+        .loop = loop,
+        .clip = clip_ref(clip),
+        .item = item,
+        .prefix_len = prefix_len,
+        .prefix_offset = 0,
+        .offset = 0,
+        .start_ns = stats_now_ns(),
+        .prev = NULL,
+        .next = pastes_in_flight,
+    };
+    if (prefix_len > 0) memcpy(writer->prefix, prefix, prefix_len);
+    if (pastes_in_flight != NULL) pastes_in_flight->prev = writer;
+    pastes_in_flight = writer;
+
+    if (queued) {
+        enum paste_status status = paste_queue_write(writer);
+        if (status != PASTE_BLOCKED) paste_finish(writer, status == PASTE_FAILED);
+        return;
+    }
+    // most pastes fit in the pipe buffer and never touch the loop
+    enum paste_status status = paste_write(writer);
+    if (status != PASTE_BLOCKED) {
+        paste_finish(writer, status == PASTE_FAILED);
+    } else if (!event_loop_add(loop, &writer->source, EPOLLOUT)) {
+        paste_finish(writer, true);
+    }
+}
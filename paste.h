@@ -0,0 +1,41 @@
+#ifndef PASTE_H
+#define PASTE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "clip_item.h"
+#include "event_loop.h"
+
+// bytes a paste can be preceded by, enough for a control reply header
+#define PASTE_PREFIX_MAX 32
+
+// one paste request being written out to a (possibly slow) target
+struct paste_writer {
+    struct event_source source;
+    struct event_loop *loop;
+    // holds a reference to clip for as long as the write is in flight
+    struct clip *clip;
+    struct clip_item *item;
+    // written ahead of the payload, counted apart from it
+    char prefix[PASTE_PREFIX_MAX];
+    size_t prefix_len;
+    size_t prefix_offset;
+    off_t offset;
+    uint64_t start_ns;
+    // every writer in flight, so the ones left at exit can be dropped
+    struct paste_writer *prev;
+    struct paste_writer *next;
+};
+
+// takes ownership of fd; writes prefix_len bytes of prefix (copied, may be NULL for none) and then
+// the payload, as much as possible right away and the rest from the event loop, so slow readers
+// never block the daemon
+void paste_start(struct event_loop *loop, struct clip *clip, struct clip_item *item, int fd,
+        const void *prefix, size_t prefix_len);
+// closes and counts as failed the pastes still going; only once the loop is finished, when the
+// kernel is done with their buffers
+void paste_drop_all(void);
+
+#endif
@@ -1,4 +1,6 @@
+#include <errno.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -49,7 +51,7 @@ bool take_whitespace(struct parse_state *state) {
 bool try_string(struct parse_state *state, char **string_ret) {
     size_t string_len = 0;
     while (!is_eof(state)
-            && !string_contains("[]()", peek_char(state))
+            && !string_contains("[]()<", peek_char(state))
             && !string_contains(whitespace, peek_char(state))) {
         string_len++;
         state->idx++;
@@ -65,13 +67,42 @@ bool try_string(struct parse_state *state, char **string_ret) {
     }
 }
 
+bool parse_size(const char *str, char **end, uint64_t *size) {
+    // strtoull would also take leading whitespace and a sign, wrapping "-1" around to huge
+    if (str[0] < '0' || str[0] > '9') return false;
+    errno = 0;
+    unsigned long long value = strtoull(str, end, 10);
+    if (errno != 0 || *end == str) return false;
+    int shift = 0;
+    if (**end == 'k') {
+        shift = 10;
+    } else if (**end == 'M') {
+        shift = 20;
+    } else if (**end == 'G') {
+        shift = 30;
+    }
+    if (shift != 0) (*end)++;
+    if (value > UINT64_MAX >> shift) return false;
+    *size = (uint64_t)value << shift;
+    return true;
+}
+
+bool try_size(struct parse_state *state, uint64_t *size) {
+    char *start = state->text + state->idx;
+    char *end;
+    if (!parse_size(start, &end, size)) return false;
+    state->idx += end - start;
+    take_whitespace(state);
+    return true;
+}
+
 void free_pref(struct mime_pref *);
 
 void free_pref_void(void *prefs) {
     free_pref(prefs);
 }
 
-void free_pref(struct mime_pref *prefs) {
+void free_pref_contents(struct mime_pref *prefs) {
     switch (prefs->type) {
         case SINGLE_MIME:
             pcre2_code_free(prefs->inner.regex.code);
@@ -82,6 +113,10 @@ void free_pref(struct mime_pref *prefs) {
             zzz_list_free(prefs->inner.subprefs, free_pref_void);
         }
     }
+}
+
+void free_pref(struct mime_pref *prefs) {
+    free_pref_contents(prefs);
     free(prefs);
 }
 
@@ -91,15 +126,22 @@ bool try_mime_pref(struct parse_state *, struct mime_pref *);
 bool try_paren_pref(struct parse_state *state, char *paren_chars, struct zzz_list **subprefs) {
     size_t starting_idx = state->idx;
     if (!try_char(state, paren_chars[0])) return false;
+    if (state->depth == PREF_MAX_DEPTH) {
+        fputs("brackets nested too deep\n", stderr);
+        state->idx = starting_idx;
+        return false;
+    }
     take_whitespace(state);
 
     *subprefs = NULL;
     struct mime_pref curr_subpref;
+    state->depth++;
     while (try_mime_pref(state, &curr_subpref)) {
         struct mime_pref *allocated = malloc(sizeof(*allocated));
         *allocated = curr_subpref;
         zzz_list_prepend(subprefs, allocated);
     }
+    state->depth--;
     zzz_list_reverse(subprefs);
 
     if (try_char(state, paren_chars[1])) {
@@ -126,14 +168,31 @@ bool try_mime_pref(struct parse_state *state, struct mime_pref *mime_pref) {
             .inner.subprefs = subprefs,
         };
     } else if (try_string(state, &regex)) {
-        int err_code;
-        size_t err_offset;
-        pcre2_code *compiled_regex = pcre2_compile(
-                (PCRE2_SPTR8)regex,
-                PCRE2_ZERO_TERMINATED,
-                PCRE2_CASELESS | PCRE2_ANCHORED | PCRE2_ENDANCHORED,
-                &err_code, &err_offset, NULL
-        );
+        pcre2_code *compiled_regex;
+        struct pattern_cache *patterns = state->patterns;
+        if (patterns != NULL && patterns->taken < patterns->n_codes) {
+            compiled_regex = patterns->codes[patterns->taken++];
+        } else {
+            int err_code;
+            size_t err_offset;
+            compiled_regex = pcre2_compile(
+                    (PCRE2_SPTR8)regex,
+                    PCRE2_ZERO_TERMINATED,
+                    PCRE2_CASELESS | PCRE2_ANCHORED | PCRE2_ENDANCHORED,
+                    &err_code, &err_offset, NULL
+            );
+            if (compiled_regex == NULL) {
+                PCRE2_UCHAR message[256];
+                pcre2_get_error_message(err_code, message, sizeof message);
+                fprintf(stderr, "bad regex %s at offset %zu: %s\n", regex, err_offset, (char *)message);
+                free(regex);
+                return false;
+            }
+        }
+        // matched against every offered mime on every copy, worth compiling to machine code.
+        // fails harmlessly where JIT is unsupported, pcre2_match falls back to the interpreter.
+        // serialized patterns carry no JIT code, so cached ones go through this too
+        pcre2_jit_compile(compiled_regex, PCRE2_JIT_COMPLETE);
         pcre2_match_data *match_data = pcre2_match_data_create_from_pattern(compiled_regex, NULL);
         free(regex);
         *mime_pref = (struct mime_pref) {
@@ -146,15 +205,36 @@ bool try_mime_pref(struct parse_state *state, struct mime_pref *mime_pref) {
     } else {
         return false;
     }
+    mime_pref->max_bytes = 0;
+    if (try_char(state, '<')) {
+        if (!try_size(state, &mime_pref->max_bytes) || mime_pref->max_bytes == 0) {
+            fputs("expected a size after <\n", stderr);
+            free_pref_contents(mime_pref);
+            return false;
+        }
+    }
     return true;
 }
 
-bool parse_mime_prefs(char *text, struct mime_pref *mime_pref) {
+bool parse_mime_prefs(char *text, struct mime_pref *mime_pref, uint64_t *clip_budget, struct pattern_cache *patterns) {
     struct parse_state state = (struct parse_state) {
         .text = text,
         .text_len = strlen(text),
-        .idx = 0
+        .idx = 0,
+        .depth = 0,
+        .patterns = patterns,
     };
     take_whitespace(&state);
+    *clip_budget = 0;
+    size_t keyword_len = strlen("budget");
+    if (strncmp(text + state.idx, "budget", keyword_len) == 0
+            && string_contains(whitespace, text[state.idx + keyword_len])) {
+        state.idx += keyword_len;
+        take_whitespace(&state);
+        if (!try_size(&state, clip_budget) || *clip_budget == 0) {
+            fputs("expected a size after budget\n", stderr);
+            return false;
+        }
+    }
     return try_mime_pref(&state, mime_pref);
 }
@@ -1,10 +1,17 @@
+#ifndef PREF_PARSE_H
+#define PREF_PARSE_H
+
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 
 #include "zzz_list.h"
 
+// brackets nested any deeper fail to parse; the parser and matching_mimes recurse per level
+#define PREF_MAX_DEPTH 32
+
 enum mime_pref_type {
     SINGLE_MIME,
     STORE_FIRST_MATCHING,
@@ -18,16 +25,37 @@ struct regex_with_match_data {
 
 struct mime_pref {
     enum mime_pref_type type;
+    // cap on each mime selected through this pref, from a trailing <SIZE; 0 inherits the enclosing one
+    uint64_t max_bytes;
     union {
         struct regex_with_match_data regex;
         struct zzz_list *subprefs;
     } inner;
 };
 
+// regexes compiled from the same text before, in the order they appear in it
+struct pattern_cache {
+    pcre2_code **codes;
+    uint32_t n_codes;
+    // codes[0..taken) now belong to the parsed pref, the caller frees the rest
+    uint32_t taken;
+};
+
 struct parse_state {
     char *text;
     size_t text_len;
     size_t idx;
+    // brackets open around idx
+    uint32_t depth;
+    // NULL to compile every regex
+    struct pattern_cache *patterns;
 };
 
-bool parse_mime_prefs(char *text, struct mime_pref *mime_pref);
+// digits with an optional k/M/G suffix; end is left after the suffix
+bool parse_size(const char *str, char **end, uint64_t *size);
+// clip_budget is the "budget SIZE" the text may start with, 0 without one
+bool parse_mime_prefs(char *text, struct mime_pref *mime_pref, uint64_t *clip_budget, struct pattern_cache *patterns);
+// the pref itself is not freed
+void free_pref_contents(struct mime_pref *prefs);
+
+#endif
@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "preview.h"
+
+bool preview_open(struct preview_cache *cache, const char *dir, bool writable, uint64_t n_entries) {
+    *cache = (struct preview_cache) {
+        .index_fd = -1,
+        .data_fd = -1,
+        .writable = writable,
+        .data_end = 0,
+    };
+    char *index_path;
+    char *data_path;
+    if (asprintf(&index_path, "%s/previews.idx", dir) < 0) return false;
+    if (asprintf(&data_path, "%s/previews", dir) < 0) {
+        free(index_path);
+        return false;
+    }
+    int flags = (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC;
+    cache->index_fd = open(index_path, flags, 0600);
+    cache->data_fd = open(data_path, flags, 0600);
+    free(index_path);
+    free(data_path);
+    if (cache->index_fd < 0 || cache->data_fd < 0) {
+        // nothing was ever stored with previews
+        bool missing = !writable && errno == ENOENT;
+        if (!missing) perror("preview cache");
+        preview_close(cache);
+        return missing;
+    }
+    if (!writable) return true;
+
+    struct stat st;
+    if (fstat(cache->index_fd, &st) < 0) goto fail;
+    uint64_t n_recs = st.st_size / sizeof(struct preview_rec);
+    if (n_recs > n_entries) n_recs = n_entries;
+    if ((uint64_t)st.st_size > n_recs * sizeof(struct preview_rec)
+            && ftruncate(cache->index_fd, n_recs * sizeof(struct preview_rec)) < 0) {
+        goto fail;
+    }
+    if (fstat(cache->data_fd, &st) < 0) goto fail;
+    uint64_t data_size = st.st_size;
+    // the newest record whose preview made it to disk ends the data, anything after it is torn
+    while (n_recs > 0) {
+        struct preview_rec rec;
+        if (pread(cache->index_fd, &rec, sizeof rec, (n_recs - 1) * sizeof rec) != sizeof rec) goto fail;
+        n_recs--;
+        if (rec.kind == PREVIEW_NONE) continue;
+        if (rec.offset <= data_size && rec.length <= data_size - rec.offset) {
+            cache->data_end = rec.offset + rec.length;
+            break;
+        }
+        struct preview_rec none = {0};
+        if (pwrite(cache->index_fd, &none, sizeof none, n_recs * sizeof none) != sizeof none) goto fail;
+    }
+    if (data_size > cache->data_end && ftruncate(cache->data_fd, cache->data_end) < 0) goto fail;
+    return true;
+
+fail:
+    perror("preview cache");
+    preview_close(cache);
+    return false;
+}
+
+void preview_close(struct preview_cache *cache) {
+    if (cache->index_fd >= 0) close(cache->index_fd);
+    if (cache->data_fd >= 0) close(cache->data_fd);
+    cache->index_fd = -1;
+    cache->data_fd = -1;
+}
+
+bool mime_is_plain_text(const char *mime) {
+    // the last three are what X11 apps offer through Xwayland
+    return strncmp(mime, "text/plain", strlen("text/plain")) == 0 || strcmp(mime, "UTF8_STRING") == 0
+        || strcmp(mime, "STRING") == 0 || strcmp(mime, "TEXT") == 0;
+}
+
+bool mime_is_html(const char *mime) {
+    return strncmp(mime, "text/html", strlen("text/html")) == 0;
+}
+
+// up to len leading bytes of the payload, wherever it lives
+ssize_t item_prefix(struct clip_item *item, char *buf, size_t len) {
+    if (len > item->len) len = item->len;
+    if (item->data != NULL) {
+        memcpy(buf, item->data, len);
+        return len;
+    }
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = pread(item->fd, buf + got, len - got, got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return n < 0 ? -1 : (ssize_t)got;
+        got += n;
+    }
+    return got;
+}
+
+// the first line with anything but whitespace on it, cut to PREVIEW_TEXT_BYTES
+bool first_line(const char *text, size_t len, struct preview *preview) {
+    size_t start = 0;
+    while (start < len) {
+        size_t end = start;
+        while (end < len && text[end] != '\n') end++;
+        size_t line = start;
+        while (line < end && (text[line] == ' ' || text[line] == '\t' || text[line] == '\r')) line++;
+        size_t line_end = end;
+        while (line_end > line && (text[line_end - 1] == ' ' || text[line_end - 1] == '\t'
+                    || text[line_end - 1] == '\r')) {
+            line_end--;
+        }
+        if (line_end > line) {
+            size_t line_len = line_end - line;
+            if (line_len > PREVIEW_TEXT_BYTES) {
+                line_len = PREVIEW_TEXT_BYTES;
+                while (line_len > 0 && ((unsigned char)text[line + line_len] & 0xc0) == 0x80) line_len--;
+            }
+            preview->kind = PREVIEW_TEXT;
+            preview->data = malloc(line_len + 1);
+            preview->len = line_len;
+            for (size_t i = 0; i < line_len; i++) {
+                unsigned char c = text[line + i];
+                preview->data[i] = c < 0x20 || c == 0x7f ? ' ' : c;
+            }
+            preview->data[line_len] = '\0';
+            return true;
+        }
+        start = end + 1;
+    }
+    return false;
+}
+
+size_t put_utf8(char *out, uint32_t code) {
+    if (code < 0x80) {
+        out[0] = code;
+        return 1;
+    } else if (code < 0x800) {
+        out[0] = 0xc0 | code >> 6;
+        out[1] = 0x80 | (code & 0x3f);
+        return 2;
+    } else if (code < 0x10000) {
+        out[0] = 0xe0 | code >> 12;
+        out[1] = 0x80 | (code >> 6 & 0x3f);
+        out[2] = 0x80 | (code & 0x3f);
+        return 3;
+    } else if (code < 0x110000) {
+        out[0] = 0xf0 | code >> 18;
+        out[1] = 0x80 | (code >> 12 & 0x3f);
+        out[2] = 0x80 | (code >> 6 & 0x3f);
+        out[3] = 0x80 | (code & 0x3f);
+        return 4;
+    }
+    return 0;
+}
+
+struct html_entity {
+    const char *name;
+    const char *text;
+};
+
+struct html_entity html_entities[] = {
+    {"amp;", "&"}, {"lt;", "<"}, {"gt;", ">"}, {"quot;", "\""}, {"apos;", "'"}, {"nbsp;", " "},
+};
+
+// tags whose contents never show up as text
+const char *html_hidden[] = {"head", "script", "style", "title"};
+// tags that start a new line
+const char *html_blocks[] = {
+    "br", "p", "div", "li", "tr", "h1", "h2", "h3", "h4", "h5", "h6", "blockquote", "pre", "table", "ul", "ol",
+};
+
+bool tag_is(const char *tag, size_t tag_len, const char *name) {
+    return tag_len == strlen(name) && strncasecmp(tag, name, tag_len) == 0;
+}
+
+// the text browsers would render, roughly: markup, comments and hidden elements dropped,
+// entities decoded, runs of whitespace collapsed and block elements put on their own lines.
+// writes at most len bytes to out, which never needs more than the html itself
+size_t html_to_text(const char *html, size_t len, char *out) {
+    size_t n = 0;
+    bool space = true;
+    // the name of the hidden element being skipped, or NULL
+    const char *hidden = NULL;
+    size_t i = 0;
+    while (i < len) {
+        char c = html[i];
+        if (c == '<') {
+            if (len - i >= 4 && memcmp(html + i, "<!--", 4) == 0) {
+                char *end = memmem(html + i + 4, len - i - 4, "-->", 3);
+                i = end != NULL ? (size_t)(end - html) + 3 : len;
+                continue;
+            }
+            char *end = memchr(html + i, '>', len - i);
+            size_t tag_end = end != NULL ? (size_t)(end - html) : len;
+            bool closing = i + 1 < len && html[i + 1] == '/';
+            size_t name = i + 1 + closing;
+            size_t name_end = name;
+            while (name_end < tag_end && html[name_end] != ' ' && html[name_end] != '/' && html[name_end] != '\t'
+                    && html[name_end] != '\n' && html[name_end] != '\r') {
+                name_end++;
+            }
+            i = tag_end + 1;
+            if (hidden != NULL) {
+                if (closing && tag_is(html + name, name_end - name, hidden)) hidden = NULL;
+                continue;
+            }
+            for (size_t k = 0; !closing && k < sizeof html_hidden / sizeof *html_hidden; k++) {
+                if (tag_is(html + name, name_end - name, html_hidden[k])) hidden = html_hidden[k];
+            }
+            for (size_t k = 0; k < sizeof html_blocks / sizeof *html_blocks; k++) {
+                if (tag_is(html + name, name_end - name, html_blocks[k]) && n > 0 && out[n - 1] != '\n') {
+                    out[n++] = '\n';
+                    space = true;
+                }
+            }
+            continue;
+        }
+        i++;
+        if (hidden != NULL) continue;
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            if (!space) out[n++] = ' ';
+            space = true;
+            continue;
+        }
+        space = false;
+        if (c != '&') {
+            out[n++] = c;
+            continue;
+        }
+        // an entity is never shorter than what it decodes to, so out keeps up
+        if (i < len && html[i] == '#') {
+            char digits[16];
+            size_t d = 0;
+            size_t j = i + 1;
+            bool hex = j < len && (html[j] == 'x' || html[j] == 'X');
+            if (hex) j++;
+            while (j < len && d + 1 < sizeof digits && html[j] != ';') digits[d++] = html[j++];
+            digits[d] = '\0';
+            char *end;
+            unsigned long code = strtoul(digits, &end, hex ? 16 : 10);
+            if (d > 0 && *end == '\0' && j < len && html[j] == ';' && code > 0 && code < 0x110000) {
+                n += put_utf8(out + n, code == 0xa0 ? ' ' : code);
+                i = j + 1;
+                continue;
+            }
+        }
+        bool decoded = false;
+        for (size_t k = 0; k < sizeof html_entities / sizeof *html_entities && !decoded; k++) {
+            size_t name_len = strlen(html_entities[k].name);
+            if (len - i >= name_len && memcmp(html + i, html_entities[k].name, name_len) == 0) {
+                out[n++] = html_entities[k].text[0];
+                i += name_len;
+                decoded = true;
+            }
+        }
+        if (!decoded) out[n++] = '&';
+    }
+    return n;
+}
+
+bool preview_text(struct clip *clip, struct preview *preview) {
+    *preview = (struct preview) {
+        .kind = PREVIEW_NONE,
+        .data = NULL,
+    };
+    struct clip_item *plain = NULL;
+    struct clip_item *html = NULL;
+    for (uint32_t i = 0; i < clip->n_items; i++) {
+        struct clip_item *item = &clip->items[i];
+        if (plain == NULL && mime_is_plain_text(item->mime)) plain = item;
+        if (html == NULL && mime_is_html(item->mime)) html = item;
+    }
+    struct clip_item *item = plain != NULL ? plain : html;
+    if (item == NULL) return false;
+
+    // heap, not static: this runs on workers
+    char *text = malloc(PREVIEW_SCAN_BYTES);
+    ssize_t len = item_prefix(item, text, PREVIEW_SCAN_BYTES);
+    bool found = false;
+    if (len > 0 && item == html) {
+        char *plain_text = malloc(len);
+        found = first_line(plain_text, html_to_text(text, len, plain_text), preview);
+        free(plain_text);
+    } else if (len > 0) {
+        found = first_line(text, len, preview);
+    }
+    free(text);
+    return found;
+}
+
+bool preview_put(struct preview_cache *cache, uint64_t number, struct preview *preview) {
+    if (!cache->writable || cache->index_fd < 0 || preview->kind == PREVIEW_NONE) return false;
+    struct preview_rec rec = {
+        .offset = cache->data_end,
+        .length = preview->len,
+        .kind = preview->kind,
+        .width = preview->width,
+        .height = preview->height,
+    };
+    // the preview before the record that points at it, a reader never finds one half there
+    if (pwrite(cache->data_fd, preview->data, preview->len, rec.offset) != (ssize_t)preview->len
+            || pwrite(cache->index_fd, &rec, sizeof rec, number * sizeof rec) != sizeof rec) {
+        perror("preview cache");
+        return false;
+    }
+    cache->data_end += preview->len;
+    return true;
+}
+
+bool preview_get(struct preview_cache *cache, uint64_t number, struct preview_rec *rec) {
+    *rec = (struct preview_rec) {
+        .kind = PREVIEW_NONE,
+    };
+    if (cache->index_fd < 0) return true;
+    // past the end of the file is an entry without one
+    ssize_t n = pread(cache->index_fd, rec, sizeof *rec, number * sizeof *rec);
+    if (n < 0) return false;
+    if (n != sizeof *rec) rec->kind = PREVIEW_NONE;
+    return true;
+}
+
+char *preview_load(struct preview_cache *cache, struct preview_rec *rec) {
+    if (cache->data_fd < 0 || rec->kind == PREVIEW_NONE) return NULL;
+    char *data = malloc(rec->length + 1);
+    if (pread(cache->data_fd, data, rec->length, rec->offset) != (ssize_t)rec->length) {
+        free(data);
+        return NULL;
+    }
+    data[rec->length] = '\0';
+    return data;
+}
+
+void preview_free(struct preview *preview) {
+    free(preview->data);
+    preview->data = NULL;
+    preview->kind = PREVIEW_NONE;
+}
@@ -0,0 +1,72 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clip_item.h"
+
+// what a picker shows for each entry, made when the entry is stored so listing the history never
+// touches the payloads. kept in the store's directory:
+//   previews.idx  a preview_rec per entry number, all zero for an entry without a preview
+//   previews      the previews themselves, where the records point
+// only a cache: records a crash lost, or entries stored before there were previews, read as none
+
+// of the first line of text, cut on a UTF-8 boundary
+#define PREVIEW_TEXT_BYTES 160
+// leading bytes of a text payload looked at for that line
+#define PREVIEW_SCAN_BYTES (16 * 1024)
+
+enum preview_kind {
+    PREVIEW_NONE,
+    // one line of plain text, without a newline or NUL
+    PREVIEW_TEXT,
+    // a PNG at most THUMBNAIL_SIZE pixels on its longer side
+    PREVIEW_THUMBNAIL,
+};
+
+struct preview_rec {
+    // in previews
+    uint64_t offset;
+    uint32_t length;
+    uint32_t kind;
+    // of the image a thumbnail was made from, 0 for text
+    uint32_t width;
+    uint32_t height;
+};
+
+struct preview {
+    enum preview_kind kind;
+    // malloc'd
+    char *data;
+    size_t len;
+    uint32_t width;
+    uint32_t height;
+};
+
+struct preview_cache {
+    // -1 when the files aren't there; a read-only cache then has no previews at all
+    int index_fd;
+    int data_fd;
+    bool writable;
+    // where the next preview goes, writable caches only
+    uint64_t data_end;
+};
+
+// a writable cache is cut back to n_entries records and the previews they point at, so it can't
+// outlast entries the store dropped
+bool preview_open(struct preview_cache *cache, const char *dir, bool writable, uint64_t n_entries);
+void preview_close(struct preview_cache *cache);
+// the first line of the entry's plain text, or of its text/html with the markup taken out;
+// false if it has neither
+bool preview_text(struct clip *clip, struct preview *preview);
+// number is the entry's; appending in entry order keeps the data file in that order too
+bool preview_put(struct preview_cache *cache, uint64_t number, struct preview *preview);
+// a PREVIEW_NONE record if there is none
+bool preview_get(struct preview_cache *cache, uint64_t number, struct preview_rec *rec);
+// the record's previews bytes, malloc'd and NUL terminated; NULL if they can't be read
+char *preview_load(struct preview_cache *cache, struct preview_rec *rec);
+void preview_free(struct preview *preview);
+
+#endif
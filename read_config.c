@@ -1,4 +1,7 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,6 +9,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "hash.h"
 #include "read_config.h"
 
 char *config_path(void) {
@@ -19,6 +23,7 @@ char *config_path(void) {
         }
         char *config_dirname = "/.config";
         char *final = malloc(strlen(home) + strlen(config_dirname) + strlen(filename) + 1);
+        final[0] = '\0';
         strcat(final, home);
         strcat(final, config_dirname);
         strcat(final, filename);
@@ -32,48 +37,201 @@ char *config_path(void) {
     }
 }
 
-struct mime_pref get_config(void) {
-    char *path = config_path();
-    int config_fd = open(path, O_RDWR);
-    free(path);
+// $XDG_CACHE_HOME/zzz_clip/patterns, NULL without either that or $HOME
+char *pattern_cache_path(void) {
+    char *cache_home = getenv("XDG_CACHE_HOME");
+    char *path;
+    int len;
+    if (cache_home == NULL || cache_home[0] == '\0') {
+        char *home = getenv("HOME");
+        if (home == NULL) return NULL;
+        len = asprintf(&path, "%s/.cache/zzz_clip/patterns", home);
+    } else {
+        len = asprintf(&path, "%s/zzz_clip/patterns", cache_home);
+    }
+    return len < 0 ? NULL : path;
+}
 
-    if (config_fd >= 0) {
-        size_t chunk_size = 1;
-        size_t config_text_cap = chunk_size + 1;
-        size_t config_text_len = 0;
-        char *config_text = malloc(config_text_cap);
-        while (true) {
-            if (config_text_len + chunk_size + 1 > config_text_cap) {
-                config_text = realloc(config_text, config_text_cap *= 2);
-            }
-            ssize_t bytes_read = read(config_fd, config_text + config_text_len, chunk_size);
-            config_text_len += bytes_read;
-            if (bytes_read != (ssize_t)chunk_size) {
-                break;
-            }
+// whole file in one buffer, NULL if it can't be read
+char *read_file(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    // sized from fstat, but read to EOF in case the file grows under us
+    size_t cap = (size_t)st.st_size + 1;
+    size_t len = 0;
+    char *text = malloc(cap);
+    while (true) {
+        if (len + 1 == cap) text = realloc(text, cap *= 2);
+        ssize_t bytes_read = read(fd, text + len, cap - len - 1);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        if (bytes_read < 0) {
+            close(fd);
+            free(text);
+            return NULL;
         }
-        close(config_fd);
-        config_text[config_text_len] = '\0';
+        if (bytes_read == 0) break;
+        len += bytes_read;
+    }
+    close(fd);
+    text[len] = '\0';
+    return text;
+}
+
+// prefixes the pcre2_serialize_encode output
+struct pattern_cache_header {
+    uint32_t magic;
+    uint32_t n_codes;
+    uint64_t config_hash;
+    uint64_t size;
+};
+
+#define PATTERN_CACHE_MAGIC 0x7a7a7a70
 
-        struct mime_pref pref;
-        if (parse_mime_prefs(config_text, &pref)) {
-            free(config_text);
-            return pref;
+// false on anything short of a usable cache for this exact text
+bool pattern_cache_load(uint64_t config_hash, struct pattern_cache *patterns) {
+    char *path = pattern_cache_path();
+    if (path == NULL) return false;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd < 0) return false;
+    struct pattern_cache_header header;
+    struct stat st;
+    // a size that isn't the rest of the file is a torn or foreign cache, not something to allocate
+    bool ok = read(fd, &header, sizeof header) == sizeof header
+            && header.magic == PATTERN_CACHE_MAGIC
+            && header.config_hash == config_hash
+            && header.n_codes > 0
+            && fstat(fd, &st) == 0
+            && header.size > 0
+            && header.size == (uint64_t)st.st_size - sizeof header;
+    uint8_t *bytes = NULL;
+    if (ok) {
+        bytes = malloc(header.size);
+        ok = read(fd, bytes, header.size) == (ssize_t)header.size
+                && pcre2_serialize_get_number_of_codes(bytes) == (int32_t)header.n_codes;
+    }
+    close(fd);
+    if (ok) {
+        patterns->codes = malloc(header.n_codes * sizeof *patterns->codes);
+        // fails on a cache written by another pcre2 version or build
+        ok = pcre2_serialize_decode(patterns->codes, header.n_codes, bytes, NULL) == (int32_t)header.n_codes;
+        if (ok) {
+            patterns->n_codes = header.n_codes;
+            patterns->taken = 0;
         } else {
-            fputs("corrupt config file\n", stderr);
-            exit(EXIT_FAILURE);
+            free(patterns->codes);
         }
+    }
+    free(bytes);
+    return ok;
+}
+
+// preorder, the order the regexes appear in the text
+uint32_t collect_patterns(struct mime_pref *pref, const pcre2_code **codes, uint32_t n_codes) {
+    if (pref->type == SINGLE_MIME) {
+        if (codes != NULL) codes[n_codes] = pref->inner.regex.code;
+        return n_codes + 1;
+    }
+    for (struct zzz_list *curr = pref->inner.subprefs; curr != NULL; curr = curr->next) {
+        n_codes = collect_patterns(curr->value, codes, n_codes);
+    }
+    return n_codes;
+}
+
+// best effort, startup just compiles again without it
+void pattern_cache_store(uint64_t config_hash, struct mime_pref *pref) {
+    uint32_t n_codes = collect_patterns(pref, NULL, 0);
+    if (n_codes == 0) return;
+    const pcre2_code **codes = malloc(n_codes * sizeof *codes);
+    collect_patterns(pref, codes, 0);
+    uint8_t *bytes;
+    PCRE2_SIZE size;
+    int32_t encoded = pcre2_serialize_encode(codes, n_codes, &bytes, &size, NULL);
+    free(codes);
+    if (encoded < 0) return;
+
+    char *path = pattern_cache_path();
+    char *tmp_path = NULL;
+    if (path == NULL || asprintf(&tmp_path, "%s.tmp", path) < 0) {
+        tmp_path = NULL;
+        goto done;
+    }
+    // the cache dir and possibly ~/.cache itself
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    char *parent_slash = strrchr(path, '/');
+    *parent_slash = '\0';
+    mkdir(path, 0700);
+    *parent_slash = '/';
+    mkdir(path, 0700);
+    *slash = '/';
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) goto done;
+    struct pattern_cache_header header = {
+        .magic = PATTERN_CACHE_MAGIC,
+        .n_codes = n_codes,
+        .config_hash = config_hash,
+        .size = size,
+    };
+    bool ok = write(fd, &header, sizeof header) == sizeof header
+            && write(fd, bytes, size) == (ssize_t)size;
+    close(fd);
+    // a reader never sees a half written cache
+    if (!ok || rename(tmp_path, path) < 0) unlink(tmp_path);
+done:
+    pcre2_serialize_free(bytes);
+    free(tmp_path);
+    free(path);
+}
+
+bool compile_config(char *text, struct mime_pref *pref, uint64_t *clip_budget) {
+    uint64_t config_hash = hash_bytes(text, strlen(text));
+    struct pattern_cache patterns;
+    bool cached = pattern_cache_load(config_hash, &patterns);
+    bool ok = parse_mime_prefs(text, pref, clip_budget, cached ? &patterns : NULL);
+    if (cached) {
+        for (uint32_t i = patterns.taken; i < patterns.n_codes; i++) {
+            pcre2_code_free(patterns.codes[i]);
+        }
+        free(patterns.codes);
+    }
+    if (ok && (!cached || patterns.taken != patterns.n_codes)) pattern_cache_store(config_hash, pref);
+    return ok;
+}
+
+bool load_config(struct mime_pref *pref, uint64_t *clip_budget) {
+    char *path = config_path();
+    char *config_text = read_file(path);
+    free(path);
+
+    if (config_text != NULL) {
+        bool ok = compile_config(config_text, pref, clip_budget);
+        free(config_text);
+        if (!ok) fputs("corrupt config file\n", stderr);
+        return ok;
     } else {
         // couldn't access read config file, use default
-        char *default_text =
+        char default_text[] =
             "[(image/png image/jpeg image/.*)"
             "(UTF8_STRING text/plain;charset=utf8 TEXT text/plain)]";
-        struct mime_pref pref;
-        assert(parse_mime_prefs(default_text, &pref));
-        return pref;
+        bool ok = compile_config(default_text, pref, clip_budget);
+        assert(ok);
+        return ok;
     }
 }
 
+struct mime_pref get_config(uint64_t *clip_budget) {
+    struct mime_pref pref;
+    if (!load_config(&pref, clip_budget)) exit(EXIT_FAILURE);
+    return pref;
+}
+
 struct zzz_list *matching_mimes(struct mime_pref pref, struct zzz_list *available_mimes) {
     switch (pref.type) {
         case SINGLE_MIME: {
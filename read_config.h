@@ -1,4 +1,16 @@
+#ifndef READ_CONFIG_H
+#define READ_CONFIG_H
+
 #include "pref_parse.h"
 
-struct mime_pref get_config(void);
+// $XDG_CONFIG_HOME/zzzclip or ~/.config/zzzclip, malloc'd
+char *config_path(void);
+// the config file, or the default without one; regexes come from the pattern cache when it was
+// written for the same text. false leaves pref untouched on a corrupt file
+// clip_budget is 0 unless the config sets one
+bool load_config(struct mime_pref *pref, uint64_t *clip_budget);
+// exits on a corrupt config
+struct mime_pref get_config(uint64_t *clip_budget);
 struct zzz_list *matching_mimes(struct mime_pref pref, struct zzz_list *available_mimes);
+
+#endif
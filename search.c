@@ -0,0 +1,434 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "codec.h"
+#include "search.h"
+
+void search_init(struct search_index *index) {
+    *index = (struct search_index) {0};
+}
+
+void search_free(struct search_index *index) {
+    for (size_t i = 0; i < index->lists_capacity; i++) {
+        free(index->lists[i].entries);
+    }
+    free(index->lists);
+    free(index->metas);
+    free(index->previews);
+    *index = (struct search_index) {0};
+}
+
+char fold(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+void fold_copy(char *dest, const char *src, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        dest[i] = fold(src[i]);
+    }
+}
+
+// of already folded text
+uint32_t trigram_at(const char *text) {
+    const unsigned char *bytes = (const unsigned char *)text;
+    return (uint32_t)bytes[0] << 16 | (uint32_t)bytes[1] << 8 | bytes[2];
+}
+
+size_t trigram_slot(uint32_t trigram, size_t mask) {
+    uint32_t hash = trigram * 0x9e3779b1;
+    return (hash ^ hash >> 15) & mask;
+}
+
+void posting_table_grow(struct search_index *index) {
+    struct posting_list *old = index->lists;
+    size_t old_capacity = index->lists_capacity;
+    index->lists_capacity = old_capacity == 0 ? 4096 : old_capacity * 2;
+    index->lists = calloc(index->lists_capacity, sizeof *index->lists);
+    size_t mask = index->lists_capacity - 1;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].entries == NULL) continue;
+        size_t slot = trigram_slot(old[i].trigram, mask);
+        while (index->lists[slot].entries != NULL) {
+            slot = (slot + 1) & mask;
+        }
+        index->lists[slot] = old[i];
+    }
+    free(old);
+}
+
+// NULL if the trigram was never seen and create is false
+struct posting_list *posting_list_find(struct search_index *index, uint32_t trigram, bool create) {
+    if (create && (index->n_lists + 1) * 4 > index->lists_capacity * 3) {
+        posting_table_grow(index);
+    }
+    if (index->lists_capacity == 0) return NULL;
+    size_t mask = index->lists_capacity - 1;
+    size_t slot = trigram_slot(trigram, mask);
+    // every list in the table holds at least one entry, so entries doubles as the occupied flag
+    while (index->lists[slot].entries != NULL) {
+        if (index->lists[slot].trigram == trigram) return &index->lists[slot];
+        slot = (slot + 1) & mask;
+    }
+    if (!create) return NULL;
+    struct posting_list *list = &index->lists[slot];
+    *list = (struct posting_list) {
+        .trigram = trigram,
+        .n_entries = 0,
+        .capacity = 4,
+        .entries = malloc(4 * sizeof *list->entries),
+    };
+    index->n_lists++;
+    return list;
+}
+
+bool posting_list_contains(struct posting_list *list, uint32_t number) {
+    uint32_t lo = 0;
+    uint32_t hi = list->n_entries;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (list->entries[mid] < number) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < list->n_entries && list->entries[lo] == number;
+}
+
+int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// distinct trigrams of folded text, sorted; malloc'd
+uint32_t *distinct_trigrams(const char *text, size_t len, size_t *n_trigrams) {
+    size_t n = len >= 3 ? len - 2 : 0;
+    uint32_t *trigrams = malloc(n * sizeof *trigrams + 1);
+    for (size_t i = 0; i < n; i++) {
+        trigrams[i] = trigram_at(text + i);
+    }
+    qsort(trigrams, n, sizeof *trigrams, &compare_u32);
+    size_t distinct = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (distinct == 0 || trigrams[distinct - 1] != trigrams[i]) trigrams[distinct++] = trigrams[i];
+    }
+    *n_trigrams = distinct;
+    return trigrams;
+}
+
+void search_index_trigrams(struct search_index *index, uint32_t number, uint32_t *trigrams, size_t n_trigrams) {
+    for (size_t i = 0; i < n_trigrams; i++) {
+        struct posting_list *list = posting_list_find(index, trigrams[i], true);
+        if (list->n_entries == list->capacity) {
+            list->capacity *= 2;
+            list->entries = realloc(list->entries, list->capacity * sizeof *list->entries);
+        }
+        // entries are indexed in order, lists stay sorted
+        list->entries[list->n_entries++] = number;
+    }
+}
+
+// up to len leading bytes of the payload; -1 if it can't be read
+ssize_t read_prefix(struct history_store *history, uint64_t blob_id, char *buf, size_t len) {
+    struct history_blob_rec blob;
+    struct history_reader reader;
+    if (!history_get_blob(history, blob_id, &blob) || !history_reader_open(history, &blob, &reader)) return -1;
+    size_t got = 0;
+    ssize_t n = 0;
+    while (got < len && (n = history_reader_read(&reader, buf + got, len - got)) > 0) {
+        got += n;
+    }
+    history_reader_close(&reader);
+    return n < 0 ? -1 : (ssize_t)got;
+}
+
+void search_add_meta(struct search_index *index, struct search_meta *meta) {
+    if (index->n_entries == index->metas_capacity) {
+        index->metas_capacity = index->metas_capacity == 0 ? 1024 : index->metas_capacity * 2;
+        index->metas = realloc(index->metas, index->metas_capacity * sizeof *index->metas);
+    }
+    index->metas[index->n_entries++] = *meta;
+}
+
+void search_add_preview(struct search_index *index, struct search_meta *meta, const char *text, size_t len) {
+    if (len > SEARCH_PREVIEW_BYTES) len = SEARCH_PREVIEW_BYTES;
+    if (index->previews_len + len > index->previews_capacity) {
+        index->previews_capacity = index->previews_capacity == 0 ? 64 * 1024 : index->previews_capacity * 2;
+        index->previews = realloc(index->previews, index->previews_capacity);
+    }
+    memcpy(index->previews + index->previews_len, text, len);
+    meta->preview_offset = index->previews_len;
+    meta->preview_len = len;
+    index->previews_len += len;
+}
+
+bool search_prepare(struct history_store *history, uint64_t number, struct search_entry *prepared) {
+    *prepared = (struct search_entry) {
+        .number = number,
+        .meta = {
+            .text_blob = SEARCH_NO_TEXT,
+            .first_mime = UINT32_MAX,
+        },
+    };
+    struct search_meta *meta = &prepared->meta;
+    struct history_entry_rec entry;
+    if (!history_get_entry(history, number, &entry)) return false;
+    meta->timestamp = entry.timestamp;
+    for (uint32_t i = 0; i < entry.n_items; i++) {
+        struct history_item_rec item;
+        struct history_blob_rec blob;
+        if (!history_get_item(history, entry.first_item + i, &item) || !history_get_blob(history, item.blob, &blob)) {
+            break;
+        }
+        uint64_t size = history_payload_size(history, &blob);
+        if (size != UINT64_MAX) meta->size += size;
+        if (item.mime_id < 64) meta->mime_set |= (uint64_t)1 << item.mime_id;
+        if (i == 0) meta->first_mime = item.mime_id;
+        char *mime = history_mime(history, item.mime_id);
+        if (meta->text_blob == SEARCH_NO_TEXT && mime != NULL && payload_class(mime, NULL, 0) == PAYLOAD_TEXT) {
+            meta->text_blob = item.blob;
+        }
+    }
+    if (meta->text_blob == SEARCH_NO_TEXT) return true;
+
+    // heap, not static: this runs on workers as well
+    char *text = malloc(SEARCH_INDEX_BYTES);
+    ssize_t len = read_prefix(history, meta->text_blob, text, SEARCH_INDEX_BYTES);
+    if (len < 0) {
+        meta->text_blob = SEARCH_NO_TEXT;
+        free(text);
+        return true;
+    }
+    prepared->preview_len = len < SEARCH_PREVIEW_BYTES ? len : SEARCH_PREVIEW_BYTES;
+    prepared->preview = malloc(prepared->preview_len + 1);
+    memcpy(prepared->preview, text, prepared->preview_len);
+    fold_copy(text, text, len);
+    prepared->trigrams = distinct_trigrams(text, len, &prepared->n_trigrams);
+    free(text);
+    return true;
+}
+
+bool search_add(struct search_index *index, struct search_entry *prepared) {
+    if (prepared->number != index->n_entries) return false;
+    if (prepared->meta.text_blob != SEARCH_NO_TEXT) {
+        search_add_preview(index, &prepared->meta, prepared->preview, prepared->preview_len);
+        search_index_trigrams(index, prepared->number, prepared->trigrams, prepared->n_trigrams);
+    }
+    search_add_meta(index, &prepared->meta);
+    return true;
+}
+
+void search_entry_free(struct search_entry *prepared) {
+    free(prepared->preview);
+    free(prepared->trigrams);
+    prepared->preview = NULL;
+    prepared->trigrams = NULL;
+}
+
+void search_update(struct search_index *index, struct history_store *history) {
+    uint64_t count = history_count(history);
+    while (index->n_entries < count) {
+        struct search_entry prepared;
+        // an unreadable entry still gets its (empty) meta, numbers have to line up
+        search_prepare(history, index->n_entries, &prepared);
+        search_add(index, &prepared);
+        search_entry_free(&prepared);
+    }
+}
+
+void results_append(struct search_results *results, const char *data, size_t len) {
+    if (results->len + len > results->capacity) {
+        results->capacity = results->capacity == 0 ? 4096 : results->capacity * 2;
+        if (results->capacity < results->len + len) results->capacity = results->len + len;
+        results->rows = realloc(results->rows, results->capacity);
+    }
+    memcpy(results->rows + results->len, data, len);
+    results->len += len;
+}
+
+void format_size(char *buf, size_t buf_len, uint64_t size) {
+    if (size < 1024) {
+        snprintf(buf, buf_len, "%llu B", (unsigned long long)size);
+    } else if (size < 1024 * 1024) {
+        snprintf(buf, buf_len, "%.1f KiB", size / 1024.0);
+    } else {
+        snprintf(buf, buf_len, "%.1f MiB", size / (1024.0 * 1024.0));
+    }
+}
+
+// one line of text, cut on a UTF-8 boundary; mime and size for entries without text
+void search_add_row(struct search_index *index, struct history_store *history, uint32_t number,
+        struct search_results *results) {
+    struct search_meta *meta = &index->metas[number];
+    char row[64 + SEARCH_ROW_PREVIEW * 2];
+    int len = snprintf(row, sizeof row, "%lu\t", (unsigned long)number);
+    if (meta->text_blob != SEARCH_NO_TEXT) {
+        const char *preview = index->previews + meta->preview_offset;
+        size_t preview_len = meta->preview_len;
+        if (preview_len > SEARCH_ROW_PREVIEW) {
+            preview_len = SEARCH_ROW_PREVIEW;
+            while (preview_len > 0 && ((unsigned char)preview[preview_len] & 0xc0) == 0x80) preview_len--;
+        }
+        // leading whitespace would make rows look empty
+        size_t start = 0;
+        while (start < preview_len && (preview[start] == ' ' || preview[start] == '\n' || preview[start] == '\t')) {
+            start++;
+        }
+        for (size_t i = start; i < preview_len; i++) {
+            unsigned char c = preview[i];
+            row[len++] = c < 0x20 || c == 0x7f ? ' ' : c;
+        }
+        row[len] = '\0';
+    } else {
+        char *mime = meta->first_mime != UINT32_MAX ? history_mime(history, meta->first_mime) : NULL;
+        char size[32];
+        format_size(size, sizeof size, meta->size);
+        len += snprintf(row + len, sizeof row - len, "[%.*s, %s]", SEARCH_ROW_PREVIEW, mime != NULL ? mime : "?", size);
+    }
+    results_append(results, row, len + 1);
+    results->n_rows++;
+}
+
+// what short and fuzzy queries look at: the preview, or the mime for entries without text
+size_t haystack(struct search_index *index, struct history_store *history, uint32_t number, char *buf) {
+    struct search_meta *meta = &index->metas[number];
+    if (meta->text_blob != SEARCH_NO_TEXT) {
+        fold_copy(buf, index->previews + meta->preview_offset, meta->preview_len);
+        return meta->preview_len;
+    }
+    char *mime = meta->first_mime != UINT32_MAX ? history_mime(history, meta->first_mime) : NULL;
+    if (mime == NULL) return 0;
+    size_t len = strlen(mime);
+    if (len > SEARCH_PREVIEW_BYTES) len = SEARCH_PREVIEW_BYTES;
+    fold_copy(buf, mime, len);
+    return len;
+}
+
+// the preview settles most candidates, the rest need the indexed text
+bool search_verify(struct search_index *index, struct history_store *history, uint32_t number,
+        const char *query, size_t query_len) {
+    struct search_meta *meta = &index->metas[number];
+    char preview[SEARCH_PREVIEW_BYTES];
+    fold_copy(preview, index->previews + meta->preview_offset, meta->preview_len);
+    if (memmem(preview, meta->preview_len, query, query_len) != NULL) return true;
+    if (meta->preview_len < SEARCH_PREVIEW_BYTES) return false;
+
+    static char text[SEARCH_INDEX_BYTES];
+    ssize_t len = read_prefix(history, meta->text_blob, text, sizeof text);
+    if (len < 0) return false;
+    fold_copy(text, text, len);
+    return memmem(text, len, query, query_len) != NULL;
+}
+
+void search_substring(struct search_index *index, struct history_store *history, const char *query,
+        uint32_t max_results, struct search_results *results) {
+    size_t query_len = strlen(query);
+    char *folded = malloc(query_len + 1);
+    fold_copy(folded, query, query_len);
+
+    if (query_len < 3) {
+        char buf[SEARCH_PREVIEW_BYTES];
+        for (uint64_t number = index->n_entries; number > 0 && results->n_rows < max_results; number--) {
+            size_t len = haystack(index, history, number - 1, buf);
+            if (query_len == 0 || memmem(buf, len, folded, query_len) != NULL) {
+                search_add_row(index, history, number - 1, results);
+            }
+        }
+        free(folded);
+        return;
+    }
+
+    size_t n_trigrams;
+    uint32_t *trigrams = distinct_trigrams(folded, query_len, &n_trigrams);
+    struct posting_list **lists = malloc(n_trigrams * sizeof *lists);
+    struct posting_list *shortest = NULL;
+    for (size_t i = 0; i < n_trigrams; i++) {
+        lists[i] = posting_list_find(index, trigrams[i], false);
+        if (lists[i] == NULL) {
+            shortest = NULL;
+            break;
+        }
+        if (shortest == NULL || lists[i]->n_entries < shortest->n_entries) shortest = lists[i];
+    }
+
+    // walk the rarest trigram newest first, every other one has to be there too
+    for (uint32_t i = shortest != NULL ? shortest->n_entries : 0; i > 0 && results->n_rows < max_results; i--) {
+        uint32_t number = shortest->entries[i - 1];
+        bool candidate = true;
+        for (size_t j = 0; j < n_trigrams && candidate; j++) {
+            candidate = lists[j] == shortest || posting_list_contains(lists[j], number);
+        }
+        if (candidate && search_verify(index, history, number, folded, query_len)) {
+            search_add_row(index, history, number, results);
+        }
+    }
+    free(lists);
+    free(trigrams);
+    free(folded);
+}
+
+struct fuzzy_match {
+    uint32_t number;
+    uint32_t score;
+};
+
+// characters between the first and last matched one, leftmost match then shrunk from the
+// right end; UINT32_MAX if query isn't a subsequence of text
+uint32_t fuzzy_score(const char *text, size_t len, const char *query, size_t query_len) {
+    size_t q = 0;
+    size_t end = 0;
+    for (size_t i = 0; i < len && q < query_len; i++) {
+        if (text[i] == query[q]) {
+            q++;
+            end = i;
+        }
+    }
+    if (q < query_len) return UINT32_MAX;
+    size_t start = end + 1;
+    for (size_t i = end + 1; i > 0 && q > 0; i--) {
+        if (text[i - 1] == query[q - 1]) {
+            q--;
+            start = i - 1;
+        }
+    }
+    return end + 1 - start - query_len;
+}
+
+int compare_fuzzy(const void *a, const void *b) {
+    const struct fuzzy_match *x = a;
+    const struct fuzzy_match *y = b;
+    if (x->score != y->score) return x->score < y->score ? -1 : 1;
+    // newer first among equals
+    return x->number > y->number ? -1 : x->number < y->number;
+}
+
+void search_fuzzy(struct search_index *index, struct history_store *history, const char *query,
+        uint32_t max_results, struct search_results *results) {
+    size_t query_len = strlen(query);
+    char *folded = malloc(query_len + 1);
+    fold_copy(folded, query, query_len);
+
+    struct fuzzy_match *matches = malloc(index->n_entries * sizeof *matches + 1);
+    size_t n_matches = 0;
+    char buf[SEARCH_PREVIEW_BYTES];
+    for (uint64_t number = 0; number < index->n_entries; number++) {
+        size_t len = haystack(index, history, number, buf);
+        uint32_t score = fuzzy_score(buf, len, folded, query_len);
+        if (score != UINT32_MAX) matches[n_matches++] = (struct fuzzy_match) {.number = number, .score = score};
+    }
+    qsort(matches, n_matches, sizeof *matches, &compare_fuzzy);
+    for (size_t i = 0; i < n_matches && results->n_rows < max_results; i++) {
+        search_add_row(index, history, matches[i].number, results);
+    }
+    free(matches);
+    free(folded);
+}
+
+void search_results_free(struct search_results *results) {
+    free(results->rows);
+    *results = (struct search_results) {0};
+}
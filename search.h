@@ -0,0 +1,94 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "history.h"
+
+// leading bytes of an entry's text that get indexed and searched
+#define SEARCH_INDEX_BYTES (16 * 1024)
+// kept in memory per entry for short and fuzzy queries, and for the rows
+#define SEARCH_PREVIEW_BYTES 256
+// of the preview in a result row
+#define SEARCH_ROW_PREVIEW 96
+#define SEARCH_NO_TEXT UINT64_MAX
+
+// what is known about an entry without reading its payloads
+struct search_meta {
+    int64_t timestamp;
+    // decoded bytes across all items
+    uint64_t size;
+    // bit i set for mime id i, ids past 63 aren't tracked
+    uint64_t mime_set;
+    // blob of the item that was indexed, SEARCH_NO_TEXT if the entry has no text
+    uint64_t text_blob;
+    uint32_t preview_offset;
+    uint32_t preview_len;
+    // mime id of the first item, shown for entries without text
+    uint32_t first_mime;
+};
+
+// entry numbers containing a trigram, ascending
+struct posting_list {
+    uint32_t trigram;
+    uint32_t n_entries;
+    uint32_t capacity;
+    uint32_t *entries;
+};
+
+// trigrams over the leading text of every entry, lower cased, plus per entry metadata;
+// entries only ever get appended so it is kept up to date by indexing whatever is new
+struct search_index {
+    struct search_meta *metas;
+    uint64_t n_entries;
+    uint64_t metas_capacity;
+    char *previews;
+    size_t previews_len;
+    size_t previews_capacity;
+    // open addressing on the trigram
+    struct posting_list *lists;
+    size_t lists_capacity;
+    size_t n_lists;
+};
+
+// one entry's worth of search_update, minus touching the index; prepared by whoever appended
+// the entry, on whatever thread, then added on the one that owns the index
+struct search_entry {
+    uint64_t number;
+    struct search_meta meta;
+    // leading SEARCH_PREVIEW_BYTES of the text, and the distinct trigrams of its indexed part
+    char *preview;
+    size_t preview_len;
+    uint32_t *trigrams;
+    size_t n_trigrams;
+};
+
+struct search_results {
+    // "<number>\t<preview>\0" rows, newest or best match first
+    char *rows;
+    size_t len;
+    size_t capacity;
+    uint32_t n_rows;
+};
+
+void search_init(struct search_index *index);
+void search_free(struct search_index *index);
+// indexes entries appended to the store since the last call
+void search_update(struct search_index *index, struct history_store *history);
+// false if the entry can't be read, prepared is then an entry without text
+bool search_prepare(struct history_store *history, uint64_t number, struct search_entry *prepared);
+// false unless prepared is the next entry the index expects, search_update catches up then
+bool search_add(struct search_index *index, struct search_entry *prepared);
+void search_entry_free(struct search_entry *prepared);
+// substring match, case insensitive for ASCII; candidates are checked against the indexed text.
+// queries shorter than a trigram only look at previews
+void search_substring(struct search_index *index, struct history_store *history, const char *query,
+        uint32_t max_results, struct search_results *results);
+// query characters in order with anything in between, over the previews; tighter matches first
+void search_fuzzy(struct search_index *index, struct history_store *history, const char *query,
+        uint32_t max_results, struct search_results *results);
+void search_results_free(struct search_results *results);
+
+#endif
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "stats.h"
+
+struct stats stats;
+
+char *stats_path(void) {
+    char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    char *path;
+    if (runtime_dir != NULL && runtime_dir[0] != '\0') {
+        if (asprintf(&path, "%s/zzz_stats.json", runtime_dir) < 0) return NULL;
+        return path;
+    }
+    char *dir = history_dir();
+    if (dir == NULL) return NULL;
+    int result = asprintf(&path, "%s/stats.json", dir);
+    free(dir);
+    return result < 0 ? NULL : path;
+}
+
+uint64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_init(void) {
+    stats = (struct stats) {0};
+    stats.start_ns = stats_now_ns();
+}
+
+void stats_free(void) {
+    for (uint32_t i = 0; i < stats.n_mimes; i++) {
+        free(stats.mimes[i].mime);
+    }
+    free(stats.mimes);
+    stats.mimes = NULL;
+    stats.n_mimes = 0;
+}
+
+void histogram_add(struct histogram *histogram, uint64_t value) {
+    uint32_t bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    if (bucket >= HISTOGRAM_BUCKETS) bucket = HISTOGRAM_BUCKETS - 1;
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value > histogram->max) histogram->max = value;
+}
+
+struct mime_stats *stats_mime(const char *mime) {
+    // a few dozen distinct mimes in practice, a scan is fine
+    for (uint32_t i = 0; i < stats.n_mimes; i++) {
+        if (strcmp(stats.mimes[i].mime, mime) == 0) return &stats.mimes[i];
+    }
+    if (stats.n_mimes == STATS_MAX_MIMES) return &stats.other_mimes;
+    if (stats.mimes == NULL) {
+        stats.mimes = malloc(STATS_MAX_MIMES * sizeof *stats.mimes);
+    }
+    struct mime_stats *mime_stats = &stats.mimes[stats.n_mimes++];
+    *mime_stats = (struct mime_stats) {0};
+    mime_stats->mime = strdup(mime);
+    return mime_stats;
+}
+
+void json_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *)str; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(out, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// buckets as [upper bound, count] pairs, empty ones left out
+void json_histogram(FILE *out, struct histogram *histogram) {
+    fprintf(out, "{\"count\":%llu,\"sum\":%llu,\"max\":%llu,\"buckets\":[",
+            (unsigned long long)histogram->count, (unsigned long long)histogram->sum,
+            (unsigned long long)histogram->max);
+    bool first = true;
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (histogram->buckets[i] == 0) continue;
+        fprintf(out, "%s[%llu,%llu]", first ? "" : ",",
+                i == 0 ? 0ULL : (unsigned long long)1 << i, (unsigned long long)histogram->buckets[i]);
+        first = false;
+    }
+    fputs("]}", out);
+}
+
+void json_mime(FILE *out, struct mime_stats *mime_stats) {
+    fputs("{\"mime\":", out);
+    if (mime_stats->mime != NULL) {
+        json_string(out, mime_stats->mime);
+    } else {
+        fputs("null", out);
+    }
+    fprintf(out, ",\"offered\":%llu,\"selected\":%llu,\"receives\":%llu,\"receives_failed\":%llu"
+            ",\"receives_capped\":%llu,\"received_bytes\":%llu,\"pastes\":%llu,\"pasted_bytes\":%llu,\"receive_ns\":",
+            (unsigned long long)mime_stats->offered, (unsigned long long)mime_stats->selected,
+            (unsigned long long)mime_stats->receives, (unsigned long long)mime_stats->receives_failed,
+            (unsigned long long)mime_stats->receives_capped, (unsigned long long)mime_stats->received_bytes, (unsigned long long)mime_stats->pastes,
+            (unsigned long long)mime_stats->pasted_bytes);
+    json_histogram(out, &mime_stats->receive_ns);
+    fputc('}', out);
+}
+
+void json_stats(FILE *out, struct history_store *history) {
+    size_t arena_live;
+    size_t arena_peak;
+    arena_usage(&arena_live, &arena_peak);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    fprintf(out, "{\"uptime_ns\":%llu,\"offers\":%llu,\"mimes_offered\":%llu,\"mimes_selected\":%llu",
+            (unsigned long long)(stats_now_ns() - stats.start_ns), (unsigned long long)stats.offers,
+            (unsigned long long)stats.mimes_offered, (unsigned long long)stats.mimes_selected);
+    fputs(",\"selection_ns\":", out);
+    json_histogram(out, &stats.selection_ns);
+    fputs(",\"match_ns\":", out);
+    json_histogram(out, &stats.match_ns);
+
+    fprintf(out, ",\"captures\":%llu,\"captures_stored\":%llu,\"captures_empty\":%llu,\"captures_superseded\":%llu",
+            (unsigned long long)stats.captures, (unsigned long long)stats.captures_stored,
+            (unsigned long long)stats.captures_empty, (unsigned long long)stats.captures_superseded);
+    fputs(",\"capture_ns\":", out);
+    json_histogram(out, &stats.capture_ns);
+    fputs(",\"store_ns\":", out);
+    json_histogram(out, &stats.store_ns);
+    fprintf(out, ",\"previews\":%llu,\"preview_ns\":", (unsigned long long)stats.previews);
+    json_histogram(out, &stats.preview_ns);
+    fputs(",\"clip_bytes\":", out);
+    json_histogram(out, &stats.clip_bytes);
+
+    fprintf(out, ",\"pastes\":%llu,\"pastes_failed\":%llu,\"pasted_bytes\":%llu,\"paste_ns\":",
+            (unsigned long long)stats.pastes, (unsigned long long)stats.pastes_failed,
+            (unsigned long long)stats.pasted_bytes);
+    json_histogram(out, &stats.paste_ns);
+
+    fprintf(out, ",\"primary\":{\"offers\":%llu,\"captures\":%llu,\"stored\":%llu}",
+            (unsigned long long)stats.primary_offers, (unsigned long long)stats.primary_captures,
+            (unsigned long long)stats.primary_stored);
+    fprintf(out, ",\"sync\":{\"syncs\":%llu,\"failed\":%llu,\"sync_ns\":",
+            (unsigned long long)stats.syncs, (unsigned long long)stats.syncs_failed);
+    json_histogram(out, &stats.sync_ns);
+    fputc('}', out);
+    fprintf(out, ",\"config\":{\"reloads\":%llu,\"rejected\":%llu}",
+            (unsigned long long)stats.config_reloads, (unsigned long long)stats.config_rejected);
+    fprintf(out, ",\"cache\":{\"hits\":%llu,\"misses\":%llu,\"evictions\":%llu,\"pressure_events\":%llu"
+            ",\"entries\":%llu,\"bytes\":%llu}",
+            (unsigned long long)stats.cache_hits, (unsigned long long)stats.cache_misses,
+            (unsigned long long)stats.cache_evictions, (unsigned long long)stats.cache_pressure_events,
+            (unsigned long long)stats.cache_entries, (unsigned long long)stats.cache_bytes);
+    fprintf(out, ",\"memory\":{\"arena_bytes\":%zu,\"arena_peak_bytes\":%zu,\"rss_peak_kib\":%ld}",
+            arena_live, arena_peak, usage.ru_maxrss);
+    if (history != NULL) {
+        history_refresh(history);
+        fprintf(out, ",\"history\":{\"entries\":%llu,\"items\":%llu,\"blobs\":%llu,\"disk_bytes\":%llu}",
+                (unsigned long long)history->n_entries, (unsigned long long)history->n_items,
+                (unsigned long long)history->n_blobs, (unsigned long long)history_disk_usage(history));
+    }
+
+    fputs(",\"mimes\":[", out);
+    for (uint32_t i = 0; i < stats.n_mimes; i++) {
+        if (i > 0) fputc(',', out);
+        json_mime(out, &stats.mimes[i]);
+    }
+    if (stats.other_mimes.offered > 0) {
+        if (stats.n_mimes > 0) fputc(',', out);
+        json_mime(out, &stats.other_mimes);
+    }
+    fputs("]}\n", out);
+}
+
+bool stats_dump(const char *path, struct history_store *history) {
+    char *tmp_path;
+    if (asprintf(&tmp_path, "%s.tmp", path) < 0) return false;
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        perror(tmp_path);
+        free(tmp_path);
+        return false;
+    }
+    json_stats(out, history);
+    bool ok = fclose(out) == 0;
+    // readers never see a half written dump
+    if (ok && rename(tmp_path, path) < 0) {
+        perror(path);
+        ok = false;
+    }
+    if (!ok) unlink(tmp_path);
+    free(tmp_path);
+    return ok;
+}
@@ -0,0 +1,97 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "history.h"
+
+// log2 buckets; bucket i holds values below 2^i, bucket 0 holds 0
+#define HISTOGRAM_BUCKETS 48
+// distinct mimes tracked individually, the rest are lumped together
+#define STATS_MAX_MIMES 256
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+struct mime_stats {
+    // NULL for the catch-all entry
+    char *mime;
+    uint64_t offered;
+    uint64_t selected;
+    uint64_t receives;
+    uint64_t receives_failed;
+    // went over its cap or was dropped for the clip budget
+    uint64_t receives_capped;
+    uint64_t received_bytes;
+    struct histogram receive_ns;
+    uint64_t pastes;
+    uint64_t pasted_bytes;
+};
+
+// counters for the capture and paste paths; durations are in ns
+struct stats {
+    uint64_t start_ns;
+    uint64_t offers;
+    uint64_t mimes_offered;
+    uint64_t mimes_selected;
+    // mime matching plus starting the receives, i.e. the time spent in device_selection
+    struct histogram selection_ns;
+    struct histogram match_ns;
+    uint64_t captures;
+    uint64_t captures_stored;
+    uint64_t captures_empty;
+    uint64_t captures_superseded;
+    // selection event to every transfer done
+    struct histogram capture_ns;
+    struct histogram store_ns;
+    // previews made for stored captures, and making them, on the worker after the append
+    uint64_t previews;
+    struct histogram preview_ns;
+    struct histogram clip_bytes;
+    uint64_t pastes;
+    uint64_t pastes_failed;
+    uint64_t pasted_bytes;
+    struct histogram paste_ns;
+    // primary selection offers seen, captures started once they settled, and stored
+    uint64_t primary_offers;
+    uint64_t primary_captures;
+    uint64_t primary_stored;
+    // group commits of the history stores, and how long each took on its worker
+    uint64_t syncs;
+    uint64_t syncs_failed;
+    struct histogram sync_ns;
+    // config file changes swapped in, and ones that failed to parse
+    uint64_t config_reloads;
+    uint64_t config_rejected;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_evictions;
+    uint64_t cache_pressure_events;
+    // current, not cumulative
+    uint64_t cache_entries;
+    uint64_t cache_bytes;
+    struct mime_stats *mimes;
+    uint32_t n_mimes;
+    struct mime_stats other_mimes;
+};
+
+extern struct stats stats;
+
+// $XDG_RUNTIME_DIR/zzz_stats.json, or next to the history store without one; malloc'd
+char *stats_path(void);
+uint64_t stats_now_ns(void);
+void stats_init(void);
+void stats_free(void);
+void histogram_add(struct histogram *histogram, uint64_t value);
+// never NULL, mimes past STATS_MAX_MIMES share one entry
+struct mime_stats *stats_mime(const char *mime);
+// writes everything as one JSON object, replacing path atomically
+bool stats_dump(const char *path, struct history_store *history);
+
+#endif
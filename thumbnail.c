@@ -0,0 +1,114 @@
+#include <png.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "thumbnail.h"
+
+// averages each box of source pixels into one, weighted by alpha so transparent pixels don't
+// darken the edges they border
+void box_scale(const unsigned char *src, uint32_t width, uint32_t height, unsigned char *dest,
+        uint32_t dest_width, uint32_t dest_height) {
+    for (uint32_t dy = 0; dy < dest_height; dy++) {
+        uint32_t y0 = (uint64_t)dy * height / dest_height;
+        uint32_t y1 = (uint64_t)(dy + 1) * height / dest_height;
+        if (y1 == y0) y1 = y0 + 1;
+        for (uint32_t dx = 0; dx < dest_width; dx++) {
+            uint32_t x0 = (uint64_t)dx * width / dest_width;
+            uint32_t x1 = (uint64_t)(dx + 1) * width / dest_width;
+            if (x1 == x0) x1 = x0 + 1;
+            uint64_t sums[4] = {0};
+            for (uint32_t y = y0; y < y1; y++) {
+                const unsigned char *px = src + ((uint64_t)y * width + x0) * 4;
+                for (uint32_t x = x0; x < x1; x++, px += 4) {
+                    sums[0] += px[0] * px[3];
+                    sums[1] += px[1] * px[3];
+                    sums[2] += px[2] * px[3];
+                    sums[3] += px[3];
+                }
+            }
+            unsigned char *out = dest + ((uint64_t)dy * dest_width + dx) * 4;
+            uint64_t n = (uint64_t)(x1 - x0) * (y1 - y0);
+            for (int c = 0; c < 3; c++) {
+                out[c] = sums[3] > 0 ? sums[c] / sums[3] : 0;
+            }
+            out[3] = sums[3] / n;
+        }
+    }
+}
+
+bool thumbnail_encode(unsigned char *pixels, uint32_t width, uint32_t height, struct preview *preview) {
+    png_image image;
+    memset(&image, 0, sizeof image);
+    image.version = PNG_IMAGE_VERSION;
+    image.width = width;
+    image.height = height;
+    image.format = PNG_FORMAT_RGBA;
+    png_alloc_size_t size = 0;
+    // sized first, then written
+    if (!png_image_write_to_memory(&image, NULL, &size, 0, pixels, 0, NULL)) return false;
+    preview->data = malloc(size);
+    if (!png_image_write_to_memory(&image, preview->data, &size, 0, pixels, 0, NULL)) {
+        free(preview->data);
+        preview->data = NULL;
+        return false;
+    }
+    preview->kind = PREVIEW_THUMBNAIL;
+    preview->len = size;
+    return true;
+}
+
+bool thumbnail_make(struct clip *clip, struct preview *preview) {
+    *preview = (struct preview) {
+        .kind = PREVIEW_NONE,
+        .data = NULL,
+    };
+    struct clip_item *item = NULL;
+    for (uint32_t i = 0; i < clip->n_items && item == NULL; i++) {
+        if (strcmp(clip->items[i].mime, "image/png") == 0 && clip->items[i].len > 0) item = &clip->items[i];
+    }
+    if (item == NULL) return false;
+    // a spilled image is read in place rather than copied out of its memfd
+    const void *png = item->data;
+    if (png == NULL) {
+        png = mmap(NULL, item->len, PROT_READ, MAP_PRIVATE, item->fd, 0);
+        if (png == MAP_FAILED) return false;
+    }
+
+    bool made = false;
+    unsigned char *pixels = NULL;
+    unsigned char *scaled = NULL;
+    png_image image;
+    memset(&image, 0, sizeof image);
+    image.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_memory(&image, png, item->len)) goto done;
+    if ((uint64_t)image.width * image.height > THUMBNAIL_MAX_PIXELS) {
+        png_image_free(&image);
+        goto done;
+    }
+    image.format = PNG_FORMAT_RGBA;
+    pixels = malloc(PNG_IMAGE_SIZE(image));
+    if (!png_image_finish_read(&image, NULL, pixels, 0, NULL)) goto done;
+
+    uint32_t longer = image.width > image.height ? image.width : image.height;
+    uint32_t width = image.width;
+    uint32_t height = image.height;
+    if (longer > THUMBNAIL_SIZE) {
+        width = (uint64_t)image.width * THUMBNAIL_SIZE / longer;
+        height = (uint64_t)image.height * THUMBNAIL_SIZE / longer;
+        if (width == 0) width = 1;
+        if (height == 0) height = 1;
+        scaled = malloc((size_t)width * height * 4);
+        box_scale(pixels, image.width, image.height, scaled, width, height);
+    }
+    made = thumbnail_encode(scaled != NULL ? scaled : pixels, width, height, preview);
+    preview->width = image.width;
+    preview->height = image.height;
+
+done:
+    free(pixels);
+    free(scaled);
+    if (item->data == NULL) munmap((void *)png, item->len);
+    return made;
+}
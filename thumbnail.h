@@ -0,0 +1,17 @@
+#ifndef THUMBNAIL_H
+#define THUMBNAIL_H
+
+#include <stdbool.h>
+
+#include "clip_item.h"
+#include "preview.h"
+
+// longer side of a thumbnail in pixels, small enough that a screenful of them is a few KB each
+#define THUMBNAIL_SIZE 64
+// larger images aren't decoded, that alone would take this many times 4 bytes
+#define THUMBNAIL_MAX_PIXELS (16 * 1024 * 1024)
+
+// a PREVIEW_THUMBNAIL of the clip's image/png; false if it has none, or it doesn't decode
+bool thumbnail_make(struct clip *clip, struct preview *preview);
+
+#endif
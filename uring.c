@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+bool uring_off = false;
+
+bool uring_init(struct uring *ring, unsigned entries, unsigned flags) {
+    if (uring_off) return false;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    params.flags = flags;
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0 && errno == EINVAL && flags != 0) {
+        memset(&params, 0, sizeof params);
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (fd < 0) return false;
+
+    *ring = (struct uring) {
+        .fd = fd,
+        .features = params.features,
+        .sq_entries = params.sq_entries,
+        .sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned),
+        .cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe),
+        .sqes_size = params.sq_entries * sizeof(struct io_uring_sqe),
+    };
+    // both rings in one mapping since 5.4
+    bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_map) {
+        if (ring->cq_map_size > ring->sq_map_size) ring->sq_map_size = ring->cq_map_size;
+        ring->cq_map_size = ring->sq_map_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, IORING_OFF_SQ_RING);
+    ring->cq_map = single_map ? ring->sq_map : mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq_map != MAP_FAILED) munmap(ring->sq_map, ring->sq_map_size);
+        if (!single_map && ring->cq_map != MAP_FAILED) munmap(ring->cq_map, ring->cq_map_size);
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+        close(fd);
+        return false;
+    }
+
+    char *sq = ring->sq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_queued_tail = *ring->sq_tail;
+    // sqes are always used in ring order, so the indirection array is the identity
+    unsigned *array = (unsigned *)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+    char *cq = ring->cq_map;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+void uring_finish(struct uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_size);
+    munmap(ring->sq_map, ring->sq_map_size);
+    // the kernel cancels whatever is still in flight
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *ring) {
+    if (ring->sq_queued_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+        uring_enter(ring, 0, -1);
+        if (ring->sq_queued_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_queued_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    ring->sq_queued_tail++;
+    return sqe;
+}
+
+int uring_enter(struct uring *ring, unsigned wait_nr, int timeout) {
+    // the sqes are written before the kernel can see the new tail
+    __atomic_store_n(ring->sq_tail, ring->sq_queued_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sq_queued_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    void *argp = NULL;
+    size_t argsz = 0;
+    if (wait_nr > 0 && timeout >= 0) {
+        ts = (struct __kernel_timespec) {
+            .tv_sec = timeout / 1000,
+            .tv_nsec = (timeout % 1000) * 1000000ll,
+        };
+        arg = (struct io_uring_getevents_arg) {
+            .sigmask = 0,
+            .sigmask_sz = _NSIG / 8,
+            .ts = (uintptr_t)&ts,
+        };
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof arg;
+    }
+    int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, flags, argp, argsz);
+    return ret < 0 ? -errno : ret;
+}
+
+struct io_uring_cqe *uring_peek(struct uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_seen(struct uring *ring) {
+    // done reading the cqe before the kernel may reuse it
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
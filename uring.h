@@ -0,0 +1,49 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// an io_uring set up with the raw syscalls; one thread at a time
+struct uring {
+    int fd;
+    unsigned features;
+    // submission queue; tail is only published to the kernel on uring_enter
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_queued_tail;
+    struct io_uring_sqe *sqes;
+    // completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+};
+
+// set before anything opens a ring to keep everything on plain syscalls and epoll
+extern bool uring_off;
+
+// false, quietly, where io_uring is unavailable (old kernel, seccomp, sysctl) or turned off;
+// flags are io_uring_setup's, retried without them if the kernel doesn't know them
+bool uring_init(struct uring *ring, unsigned entries, unsigned flags);
+void uring_finish(struct uring *ring);
+// zeroed; a full queue is handed to the kernel first, NULL if even that failed
+struct io_uring_sqe *uring_sqe(struct uring *ring);
+// submits what's queued and, with wait_nr > 0, waits for that many completions for up to
+// timeout ms (-1 forever; needs IORING_FEAT_EXT_ARG otherwise)
+// returns the number submitted or -errno, -ETIME on timeout
+int uring_enter(struct uring *ring, unsigned wait_nr, int timeout);
+// the oldest completion not yet seen, NULL if there is none
+struct io_uring_cqe *uring_peek(struct uring *ring);
+// hands the slot of the completion from uring_peek back to the kernel
+void uring_seen(struct uring *ring);
+
+#endif
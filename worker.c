@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "worker.h"
+
+bool ring_push(struct worker_ring *ring, struct worker_job *job) {
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == WORKER_QUEUE_SIZE) return false;
+    ring->slots[tail % WORKER_QUEUE_SIZE] = job;
+    // the slot, and everything the job points at, is visible before the new tail
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+struct worker_job *ring_pop(struct worker_ring *ring) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) return NULL;
+    struct worker_job *job = ring->slots[head % WORKER_QUEUE_SIZE];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return job;
+}
+
+void eventfd_bump(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof one) < 0) perror("eventfd");
+}
+
+void *worker_main(void *data) {
+    struct worker_lane *lane = data;
+    struct worker_pool *pool = lane->pool;
+    while (true) {
+        struct worker_job *job = ring_pop(&lane->in);
+        if (job != NULL) {
+            job->run(job);
+            ring_push(&lane->out, job);
+            eventfd_bump(pool->done.fd);
+            continue;
+        }
+        // drains the queue before stopping, stores get everything that was captured
+        if (__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE)) break;
+        // a push after the pop above has already bumped wake_fd, so this returns right away
+        uint64_t wakes;
+        if (read(lane->wake_fd, &wakes, sizeof wakes) < 0) perror("worker eventfd");
+    }
+    return NULL;
+}
+
+// backlogged jobs go in as room frees up
+void lane_flush_backlog(struct worker_lane *lane) {
+    bool pushed = false;
+    while (lane->backlog != NULL && lane->in_flight < WORKER_QUEUE_SIZE) {
+        struct worker_job *job = lane->backlog;
+        lane->backlog = job->next;
+        ring_push(&lane->in, job);
+        lane->in_flight++;
+        pushed = true;
+    }
+    if (pushed) eventfd_bump(lane->wake_fd);
+}
+
+void lane_collect(struct worker_lane *lane) {
+    struct worker_job *job;
+    while ((job = ring_pop(&lane->out)) != NULL) {
+        lane->in_flight--;
+        job->done(job);
+    }
+    lane_flush_backlog(lane);
+}
+
+void worker_pool_done(struct event_source *source, uint32_t events) {
+    (void) events;
+    struct worker_pool *pool = source->data;
+    uint64_t finished;
+    if (read(source->fd, &finished, sizeof finished) < 0) return;
+    for (uint32_t i = 0; i < WORKER_THREADS; i++) {
+        lane_collect(&pool->lanes[i]);
+    }
+}
+
+bool worker_pool_init(struct worker_pool *pool, struct event_loop *loop) {
+    *pool = (struct worker_pool) {
+        .done = {
+            .fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+            .callback = &worker_pool_done,
+            .data = pool,
+        },
+        .loop = loop,
+        .stopping = false,
+    };
+    for (uint32_t i = 0; i < WORKER_THREADS; i++) {
+        pool->lanes[i].wake_fd = -1;
+    }
+    if (pool->done.fd < 0) {
+        perror("eventfd");
+        return false;
+    }
+    for (uint32_t i = 0; i < WORKER_THREADS; i++) {
+        struct worker_lane *lane = &pool->lanes[i];
+        lane->pool = pool;
+        lane->wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (lane->wake_fd < 0) {
+            perror("eventfd");
+            worker_pool_finish(pool);
+            return false;
+        }
+        int err = pthread_create(&lane->thread, NULL, &worker_main, lane);
+        if (err != 0) {
+            fprintf(stderr, "starting a worker failed with %d\n", err);
+            worker_pool_finish(pool);
+            return false;
+        }
+        lane->started = true;
+    }
+    if (!event_loop_add(loop, &pool->done, EPOLLIN)) {
+        worker_pool_finish(pool);
+        return false;
+    }
+    return true;
+}
+
+void worker_pool_finish(struct worker_pool *pool) {
+    if (pool->done.fd < 0) return;
+    // backlogs first; done callbacks may submit more, e.g. closing a store after its last append
+    while (true) {
+        bool busy = false;
+        for (uint32_t i = 0; i < WORKER_THREADS; i++) {
+            struct worker_lane *lane = &pool->lanes[i];
+            lane_collect(lane);
+            if (lane->in_flight > 0) busy = true;
+        }
+        if (!busy) break;
+        struct pollfd done = {.fd = pool->done.fd, .events = POLLIN};
+        uint64_t finished;
+        if (poll(&done, 1, -1) > 0 && read(pool->done.fd, &finished, sizeof finished) < 0) perror("eventfd");
+    }
+    __atomic_store_n(&pool->stopping, true, __ATOMIC_RELEASE);
+    for (uint32_t i = 0; i < WORKER_THREADS; i++) {
+        struct worker_lane *lane = &pool->lanes[i];
+        if (lane->started) {
+            eventfd_bump(lane->wake_fd);
+            pthread_join(lane->thread, NULL);
+            lane->started = false;
+        }
+        if (lane->wake_fd >= 0) close(lane->wake_fd);
+        lane->wake_fd = -1;
+    }
+    event_loop_remove(pool->loop, &pool->done);
+    close(pool->done.fd);
+    pool->done.fd = -1;
+}
+
+void worker_pool_submit(struct worker_pool *pool, uint32_t lane_idx, struct worker_job *job) {
+    struct worker_lane *lane = &pool->lanes[lane_idx % WORKER_THREADS];
+    if (lane->backlog != NULL || lane->in_flight == WORKER_QUEUE_SIZE) {
+        // kept in order behind what is already waiting
+        job->next = NULL;
+        if (lane->backlog == NULL) {
+            lane->backlog = job;
+        } else {
+            lane->backlog_last->next = job;
+        }
+        lane->backlog_last = job;
+        return;
+    }
+    ring_push(&lane->in, job);
+    lane->in_flight++;
+    eventfd_bump(lane->wake_fd);
+}
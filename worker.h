@@ -0,0 +1,69 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "event_loop.h"
+
+// threads in the pool, each with its own pair of queues
+#define WORKER_THREADS 2
+// per queue, a power of two; jobs past it wait on the dispatch thread
+#define WORKER_QUEUE_SIZE 64
+
+struct worker_job;
+
+typedef void worker_job_func(struct worker_job *job);
+
+// embed this in the job; the pool only ever holds a pointer to it.
+// run is called on a worker, done back on the dispatch thread once run has returned,
+// so whatever the job owns goes to the worker and comes back without being copied
+struct worker_job {
+    worker_job_func *run;
+    worker_job_func *done;
+    // in the lane's backlog
+    struct worker_job *next;
+};
+
+// single producer, single consumer; head and tail on their own cache lines
+struct worker_ring {
+    uint32_t head;
+    char head_pad[60];
+    uint32_t tail;
+    char tail_pad[60];
+    struct worker_job *slots[WORKER_QUEUE_SIZE];
+};
+
+// jobs on one lane run in submission order on the same thread, so a lane can own a store
+struct worker_lane {
+    pthread_t thread;
+    bool started;
+    // dispatch thread to worker, and back
+    struct worker_ring in;
+    struct worker_ring out;
+    // an eventfd the worker sleeps on while in is empty
+    int wake_fd;
+    // submitted and not done yet; never more than WORKER_QUEUE_SIZE so out can't fill up
+    uint32_t in_flight;
+    // waiting for room, oldest first
+    struct worker_job *backlog;
+    struct worker_job *backlog_last;
+    struct worker_pool *pool;
+};
+
+struct worker_pool {
+    struct worker_lane lanes[WORKER_THREADS];
+    // every worker bumps this eventfd after queueing a finished job
+    struct event_source done;
+    struct event_loop *loop;
+    bool stopping;
+};
+
+bool worker_pool_init(struct worker_pool *pool, struct event_loop *loop);
+// runs whatever was submitted, calls every done, then joins the threads
+void worker_pool_finish(struct worker_pool *pool);
+// lane is taken modulo WORKER_THREADS
+void worker_pool_submit(struct worker_pool *pool, uint32_t lane, struct worker_job *job);
+
+#endif
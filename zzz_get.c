@@ -1,14 +1,24 @@
+#define _GNU_SOURCE
+
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
+#include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 
+#include "control.h"
+#include "feed.h"
+#include "history.h"
+#include "preview.h"
+#include "search.h"
 #include "wlr-data-control-protocol.h"
 
 void noop() {}
@@ -26,6 +36,8 @@ struct zwlr_data_control_device_v1_listener device_listener = {
 };
 
 struct device_info {
+    // with -S, seats are bound until the one with that name shows up
+    const char *wanted_seat;
     struct wl_seat *seat;
     uint32_t seat_name;
     struct zwlr_data_control_manager_v1 *data_control_manager;
@@ -33,18 +45,57 @@ struct device_info {
     struct zwlr_data_control_device_v1 *device;
 };
 
+void maybe_create_device(struct device_info *device_info) {
+    if (device_info->device == NULL && device_info->seat != NULL && device_info->data_control_manager != NULL) {
+        device_info->device = zwlr_data_control_manager_v1_get_data_device(device_info->data_control_manager, device_info->seat);
+        zwlr_data_control_device_v1_add_listener(device_info->device, &device_listener, NULL);
+    }
+}
+
+// one of these per seat bound with -S, until the wanted one is found
+struct seat_candidate {
+    struct device_info *device_info;
+    uint32_t name;
+};
+
+void seat_name(void *data, struct wl_seat *seat, const char *name) {
+    struct seat_candidate *candidate = data;
+    struct device_info *device_info = candidate->device_info;
+    if (device_info->seat == NULL && strcmp(name, device_info->wanted_seat) == 0) {
+        device_info->seat = seat;
+        device_info->seat_name = candidate->name;
+        maybe_create_device(device_info);
+    } else {
+        wl_seat_destroy(seat);
+    }
+    free(candidate);
+}
+
+struct wl_seat_listener seat_listener = {
+    .capabilities = &noop,
+    .name = &seat_name,
+};
+
 void registry_global(void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t version) {
     struct device_info *device_info = data;
     (void) version; // bad idea?
     if (strcmp(interface, wl_seat_interface.name) == 0) {
-        device_info->seat = wl_registry_bind(registry, name, &wl_seat_interface, version);
+        if (device_info->wanted_seat == NULL) {
+            if (device_info->seat != NULL) return;
+            device_info->seat = wl_registry_bind(registry, name, &wl_seat_interface, version);
+            device_info->seat_name = name;
+        } else if (device_info->seat == NULL && version >= 2) {
+            struct seat_candidate *candidate = malloc(sizeof *candidate);
+            *candidate = (struct seat_candidate) {
+                .device_info = device_info,
+                .name = name,
+            };
+            wl_seat_add_listener(wl_registry_bind(registry, name, &wl_seat_interface, 2), &seat_listener, candidate);
+        }
     } else if (strcmp(interface, zwlr_data_control_manager_v1_interface.name) == 0) {
         device_info->data_control_manager = wl_registry_bind(registry, name, &zwlr_data_control_manager_v1_interface, version);
     }
-    if (device_info->device == NULL && device_info->seat != NULL && device_info->data_control_manager != NULL) {
-        device_info->device = zwlr_data_control_manager_v1_get_data_device(device_info->data_control_manager, device_info->seat);
-        zwlr_data_control_device_v1_add_listener(device_info->device, &device_listener, NULL);
-    }
+    maybe_create_device(device_info);
 }
 
 void registry_remove(void *data, struct wl_registry *registry, uint32_t name) {
@@ -70,21 +121,116 @@ struct wl_registry_listener registry_listener = {
     .global_remove = &registry_remove,
 };
 
+// -P: the primary selection's history, which only zzz itself writes and never serves
+bool primary;
+// -S: a seat other than the first one zzz bound, which has its own histories and isn't served either
+char *seat;
+
+char *store_dir(void) {
+    if (seat == NULL) return primary ? history_primary_dir() : history_dir();
+    char *dir = history_seat_dir(seat);
+    if (dir == NULL || !primary) return dir;
+    char *primary_dir;
+    if (asprintf(&primary_dir, "%s/primary", dir) < 0) primary_dir = NULL;
+    free(dir);
+    return primary_dir;
+}
+
+struct clip_entry {
+    struct history_store store;
+    struct history_entry_rec entry;
+    struct history_item_rec *items;
+    struct history_blob_rec *blobs;
+};
+
+void free_clip_entry(struct clip_entry *clip) {
+    free(clip->items);
+    free(clip->blobs);
+    history_close(&clip->store);
+}
+
+bool load_clip_entry(uint64_t number, struct clip_entry *clip) {
+    char *dir = store_dir();
+    if (dir == NULL) return false;
+    bool opened = history_open(&clip->store, dir, false);
+    free(dir);
+    if (!opened) return false;
+
+    if (!history_get_entry(&clip->store, number, &clip->entry)) {
+        fprintf(stderr, "no clipboard entry %lu\n", (unsigned long)number);
+        history_close(&clip->store);
+        return false;
+    }
+    clip->items = malloc(clip->entry.n_items * sizeof *clip->items);
+    clip->blobs = malloc(clip->entry.n_items * sizeof *clip->blobs);
+    for (uint32_t i = 0; i < clip->entry.n_items; i++) {
+        if (!history_get_item(&clip->store, clip->entry.first_item + i, &clip->items[i])
+                || !history_get_blob(&clip->store, clip->items[i].blob, &clip->blobs[i])) {
+            fputs("corrupt history index\n", stderr);
+            free_clip_entry(clip);
+            return false;
+        }
+    }
+    return true;
+}
+
 void send(void *data, struct zwlr_data_control_source_v1 *sauce, const char *mime_type, int32_t fd) {
-    int *sauce_fd = data;
+    struct clip_entry *clip = data;
     (void) sauce;
-    (void) mime_type; // only one offered
-    // TODO get sendfile to work
-    // sendfile(sauce_info->fd, fd, NULL, SIZE_MAX);
-    off_t start_pos = lseek(*sauce_fd, 0, SEEK_CUR);
-    while (true) {
-        char buf[1024];
-        ssize_t n = read(*sauce_fd, buf, sizeof buf);
-        if (n <= 0) break;
-        write(fd, buf, n);
+    struct history_blob_rec *blob = NULL;
+    for (uint32_t i = 0; i < clip->entry.n_items; i++) {
+        char *mime = history_mime(&clip->store, clip->items[i].mime_id);
+        if (mime != NULL && strcmp(mime, mime_type) == 0) {
+            blob = &clip->blobs[i];
+            break;
+        }
+    }
+    struct history_reader reader;
+    if (blob == NULL || !history_reader_open(&clip->store, blob, &reader)) {
+        close(fd);
+        return;
+    }
+
+    if (reader.codec != CODEC_RAW) {
+        static char buf[64 * 1024];
+        ssize_t n;
+        while ((n = history_reader_read(&reader, buf, sizeof buf)) > 0) {
+            if (!write_all(fd, buf, n)) {
+                if (errno != EPIPE) perror("send");
+                break;
+            }
+        }
+        history_reader_close(&reader);
+        close(fd);
+        return;
     }
+
+    // every request gets its own offset, nothing shares the file position
+    off_t offset = reader.offset;
+    off_t end = reader.end;
+    while (offset < end) {
+        ssize_t n = sendfile(fd, reader.segment_fd, &offset, end - offset);
+        if (n > 0) continue;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EINVAL) {
+            // target can't take sendfile
+            char buf[64 * 1024];
+            size_t want = end - offset < (off_t)sizeof buf ? (size_t)(end - offset) : sizeof buf;
+            n = pread(reader.segment_fd, buf, want, offset);
+            if (n > 0) {
+                if (write_all(fd, buf, n)) {
+                    offset += n;
+                    continue;
+                }
+                if (errno != EPIPE) perror("send");
+                break;
+            }
+        }
+        if (n < 0 && errno != EPIPE) perror("send");
+        break;
+    }
+    history_reader_close(&reader);
     close(fd);
-    lseek(*sauce_fd, start_pos, SEEK_SET);
 }
 
 void cancelled(void *data, struct zwlr_data_control_source_v1 *sauce) {
@@ -99,50 +245,15 @@ struct zwlr_data_control_source_v1_listener sauce_listener = {
     .cancelled = &cancelled,
 };
 
-int main(int argv, char *argc[]) {
-    if (argv != 2) {
-        fprintf(stderr, "expected 1 argument (clipfile number), got %d\n", argv - 1);
-        exit(1);
-    }
-    // find clip dir
-    char *clip_filename = NULL;
-    char *state_dir = getenv("XDG_STATE_HOME");
-    if (state_dir == NULL) {
-        fputs("$XDG_STATE_HOME not set, trying $HOME/.local/state\n", stderr);
-        char *home = getenv("HOME");
-        if (home == NULL) {
-            fputs("$HOME not set, aborting\n", stderr);
-            exit(2);
-        }
-        state_dir = malloc(strlen(home) + strlen("/.local/state") + 1);
-        state_dir[0] = '\0';
-        strcat(state_dir, home);
-        strcat(state_dir, "/.local/state");
-    }
-
-    size_t state_dir_len = strlen(state_dir);
-    char *zzz_dirname = "zzz_clip";
-    clip_filename = malloc(state_dir_len + 1 + strlen(zzz_dirname) + 1 + strlen(argc[1]) + 1);
-    clip_filename[0] = '\0';
-    strcat(clip_filename, state_dir);
-    strcat(clip_filename, "/");
-    strcat(clip_filename, zzz_dirname);
-    strcat(clip_filename, "/");
-    strcat(clip_filename, argc[1]);
-
-    int clipfile = open(clip_filename, O_RDONLY);
-    if (errno) {
-        perror(NULL);
-    }
-
-    char mime[256];
-    int mime_len = 0;
-    char c;
-    while (read(clipfile, &c, 1) == 1 && c != '\n') mime[mime_len++] = c; // ooh dangerous!
-    mime[mime_len] = '\0';
-
-    int *heapfd = malloc(sizeof *heapfd);
-    *heapfd = clipfile;
+// standalone: our own connection, serving the entry until someone else takes the selection
+int serve_entry(uint64_t number) {
+    struct clip_entry clip;
+    if (!load_clip_entry(number, &clip)) {
+        return 1;
+    }
+
+    // the paste target closing early shouldn't kill us
+    signal(SIGPIPE, SIG_IGN);
 
     struct wl_display *display = wl_display_connect(NULL);
     if (display == NULL) {
@@ -152,6 +263,7 @@ int main(int argv, char *argc[]) {
 
     struct wl_registry *registry = wl_display_get_registry(display);
     struct device_info device_info = {
+        .wanted_seat = seat,
         .seat = NULL,
         .seat_name = 0,
         .data_control_manager = NULL,
@@ -166,8 +278,11 @@ int main(int argv, char *argc[]) {
             created = true;
             struct zwlr_data_control_source_v1 *sauce =
                 zwlr_data_control_manager_v1_create_data_source(device_info.data_control_manager);
-            zwlr_data_control_source_v1_offer(sauce, mime);
-            zwlr_data_control_source_v1_add_listener(sauce, &sauce_listener, heapfd);
+            for (uint32_t i = 0; i < clip.entry.n_items; i++) {
+                char *mime = history_mime(&clip.store, clip.items[i].mime_id);
+                if (mime != NULL) zwlr_data_control_source_v1_offer(sauce, mime);
+            }
+            zwlr_data_control_source_v1_add_listener(sauce, &sauce_listener, &clip);
             zwlr_data_control_device_v1_set_selection(device_info.device, sauce);
         }
     }
@@ -175,3 +290,313 @@ int main(int argv, char *argc[]) {
     wl_display_disconnect(display);
     return 0;
 }
+
+// the last column is the entry's preview: its first line of text, the size of its image, or
+// nothing for entries stored without one
+void print_entry(struct control_entry *entry, struct preview_cache *previews) {
+    char when[32];
+    time_t timestamp = entry->timestamp;
+    struct tm tm;
+    strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", localtime_r(&timestamp, &tm));
+    printf("%llu\t%s\t%u mimes\t", (unsigned long long)entry->number, when, entry->n_items);
+    struct preview_rec rec;
+    if (preview_get(previews, entry->number, &rec) && rec.kind == PREVIEW_THUMBNAIL) {
+        printf("[image %ux%u]", rec.width, rec.height);
+    } else if (rec.kind == PREVIEW_TEXT) {
+        char *text = preview_load(previews, &rec);
+        if (text != NULL) fputs(text, stdout);
+        free(text);
+    }
+    putchar('\n');
+}
+
+int list_history(int control_fd, uint64_t max, struct preview_cache *previews) {
+    if (control_fd >= 0) {
+        struct control_request request = {.op = CONTROL_LIST, .arg = max};
+        struct control_reply reply;
+        if (!control_call(control_fd, &request, NULL, &reply) || reply.status != CONTROL_OK) {
+            fputs("listing entries failed\n", stderr);
+            return 1;
+        }
+        struct control_entry entry;
+        for (uint64_t got = 0; got < reply.length / sizeof entry; got++) {
+            if (!control_read(control_fd, &entry, sizeof entry)) return 1;
+            print_entry(&entry, previews);
+        }
+        return 0;
+    }
+
+    struct history_store store;
+    char *dir = store_dir();
+    bool opened = dir != NULL && history_open(&store, dir, false);
+    free(dir);
+    if (!opened) return 1;
+    uint64_t count = history_count(&store);
+    for (uint64_t number = count; number > 0 && count - number < max; number--) {
+        struct history_entry_rec rec;
+        if (!history_get_entry(&store, number - 1, &rec)) continue;
+        struct control_entry entry = {
+            .number = number - 1,
+            .timestamp = rec.timestamp,
+            .n_items = rec.n_items,
+            .flags = rec.flags,
+        };
+        print_entry(&entry, previews);
+    }
+    history_close(&store);
+    return 0;
+}
+
+int list_entries(int control_fd, uint64_t max) {
+    // read straight from the files either way, they are never more than a few KB per screenful
+    struct preview_cache previews = {
+        .index_fd = -1,
+        .data_fd = -1,
+    };
+    char *previews_dir = store_dir();
+    if (previews_dir != NULL) preview_open(&previews, previews_dir, false, 0);
+    free(previews_dir);
+    int ret = list_history(control_fd, max, &previews);
+    preview_close(&previews);
+    return ret;
+}
+
+// NUL terminated "<number>\t<preview>" rows for a picker
+int search_entries(int control_fd, char *query, bool fuzzy, uint64_t max) {
+    if (control_fd >= 0) {
+        struct control_request request = {.op = fuzzy ? CONTROL_FUZZY : CONTROL_SEARCH, .arg = max};
+        struct control_reply reply;
+        if (!control_call(control_fd, &request, query, &reply) || reply.status != CONTROL_OK) {
+            fputs("search failed\n", stderr);
+            return 1;
+        }
+        char *rows = malloc(reply.length + 1);
+        bool ok = control_read(control_fd, rows, reply.length) && write_all(STDOUT_FILENO, rows, reply.length);
+        free(rows);
+        return ok ? 0 : 1;
+    }
+
+    // without a daemon the index only lives as long as this search
+    struct history_store store;
+    char *dir = store_dir();
+    bool opened = dir != NULL && history_open(&store, dir, false);
+    free(dir);
+    if (!opened) return 1;
+    struct search_index index;
+    search_init(&index);
+    search_update(&index, &store);
+    struct search_results results = {0};
+    if (fuzzy) {
+        search_fuzzy(&index, &store, query, max, &results);
+    } else {
+        search_substring(&index, &store, query, max, &results);
+    }
+    bool ok = write_all(STDOUT_FILENO, results.rows, results.len);
+    search_results_free(&results);
+    search_free(&index);
+    history_close(&store);
+    return ok ? 0 : 1;
+}
+
+int output_entry(int control_fd, uint64_t number, char *mime) {
+    static char buf[64 * 1024];
+    if (control_fd >= 0) {
+        struct control_request request = {.op = CONTROL_FETCH, .arg = number};
+        struct control_reply reply;
+        if (!control_call(control_fd, &request, mime, &reply)) return 1;
+        if (reply.status != CONTROL_OK) {
+            fprintf(stderr, "entry %llu: %s\n", (unsigned long long)number, control_status_str(reply.status));
+            return 1;
+        }
+        uint64_t got = 0;
+        ssize_t n;
+        while ((n = read(control_fd, buf, sizeof buf)) > 0 && write_all(STDOUT_FILENO, buf, n)) {
+            got += n;
+        }
+        return got == reply.length ? 0 : 1;
+    }
+
+    struct clip_entry clip;
+    if (!load_clip_entry(number, &clip)) return 1;
+    struct history_blob_rec *blob = NULL;
+    for (uint32_t i = 0; i < clip.entry.n_items && blob == NULL; i++) {
+        char *item_mime = history_mime(&clip.store, clip.items[i].mime_id);
+        if (mime == NULL || (item_mime != NULL && strcmp(item_mime, mime) == 0)) blob = &clip.blobs[i];
+    }
+    if (blob == NULL) {
+        fprintf(stderr, "entry %llu: %s\n", (unsigned long long)number, control_status_str(CONTROL_NO_MIME));
+        free_clip_entry(&clip);
+        return 1;
+    }
+    struct history_reader reader;
+    ssize_t n = -1;
+    if (history_reader_open(&clip.store, blob, &reader)) {
+        while ((n = history_reader_read(&reader, buf, sizeof buf)) > 0) {
+            if (!write_all(STDOUT_FILENO, buf, n)) break;
+        }
+        history_reader_close(&reader);
+    }
+    free_clip_entry(&clip);
+    return n == 0 ? 0 : 1;
+}
+
+int output_thumbnail(uint64_t number) {
+    struct preview_cache previews;
+    char *dir = store_dir();
+    bool opened = dir != NULL && preview_open(&previews, dir, false, 0);
+    free(dir);
+    if (!opened) return 1;
+    struct preview_rec rec;
+    char *png = NULL;
+    if (preview_get(&previews, number, &rec) && rec.kind == PREVIEW_THUMBNAIL) png = preview_load(&previews, &rec);
+    preview_close(&previews);
+    if (png == NULL) {
+        fprintf(stderr, "entry %llu: no thumbnail\n", (unsigned long long)number);
+        return 1;
+    }
+    bool ok = write_all(STDOUT_FILENO, png, rec.length);
+    free(png);
+    return ok ? 0 : 1;
+}
+
+// same columns as print_entry
+void print_feed_entry(struct feed_entry *entry) {
+    char when[32];
+    time_t timestamp = entry->timestamp;
+    struct tm tm;
+    strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", localtime_r(&timestamp, &tm));
+    printf("%llu\t%s\t%u mimes\t", (unsigned long long)entry->number, when, entry->n_mimes);
+    if (entry->preview_kind == PREVIEW_THUMBNAIL) {
+        printf("[image %ux%u]", entry->width, entry->height);
+    } else if (entry->preview_kind == PREVIEW_TEXT) {
+        fputs(entry->preview, stdout);
+    }
+    putchar('\n');
+}
+
+// a line for the newest entry whenever it changes, read from zzz's feed without asking zzz anything;
+// outlives the daemon, waiting for the next one's feed
+int watch_feed(void) {
+    struct feed feed = {0};
+    uint64_t shown = 0;
+    while (true) {
+        if (feed.header == NULL && !feed_open(&feed)) {
+            sleep(1);
+            continue;
+        }
+        uint32_t generation = feed_generation(&feed);
+        uint64_t newest = feed_newest(&feed);
+        struct feed_entry entry;
+        if (newest != shown && newest > 0 && feed_read(&feed, newest - 1, &entry)) {
+            print_feed_entry(&entry);
+            // whatever reads the lines wants each one as it comes
+            if (fflush(stdout) == EOF) return 1;
+            shown = newest;
+        }
+        if (feed_closed(&feed)) {
+            feed_close(&feed);
+            sleep(1);
+            continue;
+        }
+        feed_wait(&feed, generation, -1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    char *help =
+        "usage: zzz_get [options] [number]\n"
+        "  -h       print this help message\n"
+        "  -l       list the newest entries, number of them (default 20), each with a preview\n"
+        "  -o       write entry number to stdout instead of making it the selection\n"
+        "  -t       write the thumbnail of entry number, a small PNG, to stdout\n"
+        "  -w       print the newest entry like -l does, and again each time it changes,\n"
+        "           until killed; for status bars, needs a running zzz\n"
+        "  -m MIME  mimetype -o writes, the entry's first one by default\n"
+        "  -s QUERY entries containing QUERY as NUL separated rows, number of them (default 50)\n"
+        "  -f QUERY like -s but QUERY's characters only have to appear in order\n"
+        "  -P       use the primary selection history (zzz -p) instead\n"
+        "  -S SEAT  use the histories of SEAT, for seats other than the first one zzz found,\n"
+        "           and set the selection on that seat\n"
+        "talks to a running zzz if there is one, otherwise serves the entry itself\n";
+    bool list = false;
+    bool output = false;
+    bool thumbnail = false;
+    bool watch = false;
+    char *mime = NULL;
+    char *query = NULL;
+    bool fuzzy = false;
+    int c;
+    while ((c = getopt(argc, argv, "hlotwm:s:f:PS:")) != -1) {
+        switch (c) {
+            case 'h':
+                fputs(help, stdout);
+                return EXIT_SUCCESS;
+            case 'l':
+                list = true;
+                break;
+            case 'o':
+                output = true;
+                break;
+            case 't':
+                thumbnail = true;
+                break;
+            case 'w':
+                watch = true;
+                break;
+            case 'm':
+                mime = optarg;
+                break;
+            case 'P':
+                primary = true;
+                break;
+            case 'S':
+                seat = optarg;
+                break;
+            case 's':
+            case 'f':
+                query = optarg;
+                fuzzy = c == 'f';
+                break;
+            default:
+                fputs(help, stderr);
+                return EXIT_FAILURE;
+        }
+    }
+
+    unsigned long long number = query != NULL ? 50 : 20;
+    if (optind < argc) {
+        char *end;
+        errno = 0;
+        number = strtoull(argv[optind], &end, 10);
+        if (errno != 0 || end == argv[optind] || *end != '\0') {
+            fprintf(stderr, "invalid clipboard entry number %s\n", argv[optind]);
+            return EXIT_FAILURE;
+        }
+    } else if (!list && query == NULL && !watch) {
+        fputs(help, stderr);
+        return EXIT_FAILURE;
+    }
+
+    if (thumbnail) return output_thumbnail(number);
+    if (watch) return watch_feed();
+    // the daemon only serves the main seat's clipboard history
+    int control_fd = primary || seat != NULL ? -1 : control_connect();
+    if (query != NULL) return search_entries(control_fd, query, fuzzy, number);
+    if (list) return list_entries(control_fd, number);
+    if (output) return output_entry(control_fd, number, mime);
+    if (control_fd < 0) return serve_entry(number);
+
+    struct control_request request = {.op = CONTROL_SELECT, .arg = number};
+    struct control_reply reply;
+    if (!control_call(control_fd, &request, NULL, &reply)) {
+        // the daemon went away mid-request
+        close(control_fd);
+        return serve_entry(number);
+    }
+    close(control_fd);
+    if (reply.status != CONTROL_OK) {
+        fprintf(stderr, "entry %llu: %s\n", number, control_status_str(reply.status));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}